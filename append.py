@@ -0,0 +1,67 @@
+import os
+import sys
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, finish
+
+APPENDS = 400
+SCATTERED = 24 # partial blocks at once, more than CFS_DIRTY_BLOCKS
+DIRTY_BLOCKS = 8
+
+def check(path, f, stuff, when):
+    """Size by path and by the open handle f, and a range read through another handle"""
+    ok = True
+    sizes = [os.stat(path).st_size] + ([os.fstat(f.fileno()).st_size] if f else [])
+    if sizes != [len(stuff)] * len(sizes):
+        print("{}: size {} want {}".format(when, sizes, len(stuff)))
+        ok = False
+    offset = randint(0, len(stuff))
+    length = randint(0, BLOCK_SIZE * 3)
+    with open(path, 'rb') as r:
+        r.seek(offset)
+        if r.read(length) != bytes(stuff[offset:offset + length]):
+            print("{}: {} bytes at {} read back wrong".format(when, length, offset))
+            ok = False
+    return ok
+
+def main():
+    mount = sys.argv[1]
+
+    test_file = test_path(mount)
+    print("File is : {}".format(test_file))
+
+    # small appends never fill a block at once, the tail stays buffered
+    ok = True
+    stuff = bytearray()
+    with open(test_file, 'ab', buffering=0) as f:
+        for i in range(APPENDS):
+            data = random_str(randint(1, BLOCK_SIZE // 8))
+            f.write(data)
+            stuff += data
+            if i % 10 == 0:
+                ok = check(test_file, f, stuff, "Append {}".format(i)) and ok
+    ok = check(test_file, None, stuff, "After close") and ok
+
+    # a few bytes into many blocks, buffered ones get evicted on the way
+    with open(test_file, 'r+b', buffering=0) as f:
+        for i in range(SCATTERED):
+            offset = randint(0, len(stuff) // BLOCK_SIZE) * BLOCK_SIZE + randint(0, BLOCK_SIZE - 1)
+            data = random_str(randint(1, 64))
+            f.seek(offset)
+            f.write(data)
+            stuff[len(stuff):offset] = b'\0' * (offset - len(stuff))
+            stuff[offset:offset + len(data)] = data
+            if i % DIRTY_BLOCKS == 0:
+                ok = check(test_file, f, stuff, "Scattered write {}".format(i)) and ok
+        ok = check(test_file, f, stuff, "Before close") and ok
+
+    with open(test_file, 'rb') as f:
+        if f.read() != bytes(stuff):
+            print("Contents differ after close")
+            ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
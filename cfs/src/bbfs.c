@@ -31,6 +31,8 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -42,6 +44,7 @@
 #endif
 
 #include "log.h"
+#include "snapshot.h"
 #include "storage.h"
 #include "util.h"
 
@@ -60,6 +63,33 @@ static void bb_fullpath(char fpath[PATH_MAX], const char *path)
 		BB_DATA->rootdir, path, fpath);
 }
 
+// Whether *path* is in the snapshots directory, nothing under it may change
+static int bb_readonly(const char *path)
+{
+	const size_t len = strlen(CFS_SNAPSHOTS_DIRECTORY);
+
+	return path[0] == '/' && strncmp(path + 1, CFS_SNAPSHOTS_DIRECTORY, len) == 0 &&
+		(path[len + 1] == '\0' || path[len + 1] == '/');
+}
+
+// Whether *fpath* is the block store, which the mount doesn't show
+static int bb_hidden(const char *fpath)
+{
+	struct stat statbuf;
+
+	return lstat(fpath, &statbuf) == 0 && is_block_store(CFS_STATE->storage, &statbuf);
+}
+
+// Drop the cached size of the CFS file at *fpath*, it is about to change.
+// Returns 0 with *statbuf* filled in if there is such a file.
+static int bb_forget(const char *fpath, struct stat *statbuf)
+{
+	if (lstat(fpath, statbuf) < 0)
+		return -1;
+	cfs_stat_forget(CFS_STATE, statbuf);
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -82,7 +112,9 @@ int bb_getattr(const char *path, struct stat *statbuf)
 	bb_fullpath(fpath, path);
 
 	retstat = log_syscall("lstat", lstat(fpath, statbuf), 0);
-	if (cfs_file_stat(CFS_STATE, fpath, &file)) {
+	if (retstat == 0 && is_block_store(CFS_STATE->storage, statbuf))
+		return -ENOENT;
+	if (retstat == 0 && cfs_file_stat(CFS_STATE, fpath, statbuf, &file) > 0) {
 		statbuf->st_size = file.size;
 		statbuf->st_blksize = BLOCK_SIZE;
 		statbuf->st_blocks = file.total_blocks;
@@ -137,6 +169,8 @@ int bb_mknod(const char *path, mode_t mode, dev_t dev)
 	
 	log_msg("\nbb_mknod(path=\"%s\", mode=0%3o, dev=%lld)\n",
 	  path, mode, dev);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 	
 	// On Linux this could just be 'mknod(path, mode, dev)' but this
@@ -165,6 +199,8 @@ int bb_mkdir(const char *path, mode_t mode)
 	
 	log_msg("\nbb_mkdir(path=\"%s\", mode=0%3o)\n",
 		path, mode);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("mkdir", mkdir(fpath, mode), 0);
@@ -174,12 +210,21 @@ int bb_mkdir(const char *path, mode_t mode)
 int bb_unlink(const char *path)
 {
 	char fpath[PATH_MAX];
+	struct stat statbuf;
+	int found, ret;
 	
 	log_msg("bb_unlink(path=\"%s\")\n",
 		path);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
+	found = bb_forget(fpath, &statbuf) == 0;
 
-	return log_syscall("unlink", unlink(fpath), 0);
+	ret = log_syscall("unlink", unlink(fpath), 0);
+	// the staging extent is named by inode, it goes with the last link
+	if (ret == 0 && found)
+		cfs_unlinked(CFS_STATE, &statbuf);
+	return ret;
 }
 
 /** Remove a directory */
@@ -189,6 +234,8 @@ int bb_rmdir(const char *path)
 	
 	log_msg("bb_rmdir(path=\"%s\")\n",
 		path);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("rmdir", rmdir(fpath), 0);
@@ -205,6 +252,8 @@ int bb_symlink(const char *path, const char *link)
 	
 	log_msg("\nbb_symlink(path=\"%s\", link=\"%s\")\n",
 		path, link);
+	if (bb_readonly(link))
+		return -EROFS;
 	bb_fullpath(flink, link);
 
 	return log_syscall("symlink", symlink(path, flink), 0);
@@ -216,13 +265,23 @@ int bb_rename(const char *path, const char *newpath)
 {
 	char fpath[PATH_MAX];
 	char fnewpath[PATH_MAX];
+	struct stat statbuf, oldbuf;
+	int found, ret;
 	
 	log_msg("\nbb_rename(fpath=\"%s\", newpath=\"%s\")\n",
 		path, newpath);
+	if (bb_readonly(path) || bb_readonly(newpath))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 	bb_fullpath(fnewpath, newpath);
+	// a file renamed over goes away, unless it is the one renamed
+	found = bb_forget(fnewpath, &statbuf) == 0 && lstat(fpath, &oldbuf) == 0 &&
+		(oldbuf.st_ino != statbuf.st_ino || oldbuf.st_dev != statbuf.st_dev);
 
-	return log_syscall("rename", rename(fpath, fnewpath), 0);
+	ret = log_syscall("rename", rename(fpath, fnewpath), 0);
+	if (ret == 0 && found)
+		cfs_unlinked(CFS_STATE, &statbuf);
+	return ret;
 }
 
 /** Create a hard link to a file */
@@ -232,6 +291,8 @@ int bb_link(const char *path, const char *newpath)
 	
 	log_msg("\nbb_link(path=\"%s\", newpath=\"%s\")\n",
 		path, newpath);
+	if (bb_readonly(path) || bb_readonly(newpath))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 	bb_fullpath(fnewpath, newpath);
 
@@ -245,6 +306,8 @@ int bb_chmod(const char *path, mode_t mode)
 	
 	log_msg("\nbb_chmod(fpath=\"%s\", mode=0%03o)\n",
 		path, mode);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("chmod", chmod(fpath, mode), 0);
@@ -258,6 +321,8 @@ int bb_chown(const char *path, uid_t uid, gid_t gid)
 	
 	log_msg("\nbb_chown(path=\"%s\", uid=%d, gid=%d)\n",
 		path, uid, gid);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("chown", chown(fpath, uid, gid), 0);
@@ -267,12 +332,17 @@ int bb_chown(const char *path, uid_t uid, gid_t gid)
 int bb_truncate(const char *path, off_t newsize)
 {
 	char fpath[PATH_MAX];
+	struct stat statbuf;
 	
 	log_msg("\nbb_truncate(path=\"%s\", newsize=%lld)\n",
 		path, newsize);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
+	bb_forget(fpath, &statbuf);
 
-	return log_syscall("truncate", truncate(fpath, newsize), 0);
+	// the file holds the block map, CFS moves the logical end
+	return cfs_truncate(CFS_STATE, fpath, newsize);
 }
 
 /** Change the access and/or modification times of a file */
@@ -283,6 +353,8 @@ int bb_utime(const char *path, struct utimbuf *ubuf)
 	
 	log_msg("\nbb_utime(path=\"%s\", ubuf=0x%08x)\n",
 		path, ubuf);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("utime", utime(fpath, ubuf), 0);
@@ -302,10 +374,13 @@ int bb_open(const char *path, struct fuse_file_info *fi)
 {
 	int retstat = 0;
 	int fd;
+	cfs_file_t *file;
 	char fpath[PATH_MAX];
 	
 	log_msg("\nbb_open(path\"%s\", fi=0x%08x)\n",
 		path, fi);
+	if (bb_readonly(path) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 	
 	// if the open call succeeds, my retstat is the file descriptor,
@@ -317,6 +392,17 @@ int bb_open(const char *path, struct fuse_file_info *fi)
 	} else {
 		cfs_register_file(CFS_STATE, fpath, fd);
 	}
+
+	// with atomic_o_trunc the kernel leaves truncating to open
+	if (fd >= 0 && (fi->flags & O_TRUNC)) {
+		file = cfs_get_file(CFS_STATE, fd);
+		retstat = file ? cfs_file_truncate(CFS_STATE, file, 0) : -EIO;
+		if (retstat < 0) {
+			cfs_release_file(CFS_STATE, fd);
+			close(fd);
+			fd = -1;
+		}
+	}
 	
 	fi->fh = fd;
 
@@ -344,14 +430,7 @@ int bb_open(const char *path, struct fuse_file_info *fi)
 int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	cfs_file_t* file;
-	cfs_block_t blk_buf;
-	off_t current_offset = offset;
-	off_t buffer_index=0;
 
-	off_t rem;
-	off_t left, right; // helper indexes to copy from read block
-
-   
 	log_msg("\nbb_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 		path, buf, size, offset, fi);
 	// no need to get fpath on this one, since I work from fi->fh not the path
@@ -363,39 +442,8 @@ int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
 		return -1;
 	}
 
-	while (current_offset < offset + size) {
-		blk_buf.index = 0;
-		blk_buf.size = 0;
-		memset(&blk_buf.data, '\0', sizeof(blk_buf.data));
-
-		rem = current_offset % BLOCK_SIZE;
-
-		// read curent block 
-		if (cfs_file_read_block(CFS_STATE, file, current_offset / BLOCK_SIZE, &blk_buf)) {
-			// Set up index pointers
-			left = rem;
-			right = max(blk_buf.size - left, 0); // be aware of holes i.e incomplete blocks
-		
-			memcpy(buf + buffer_index, blk_buf.data + left, max(right-left, 0));
-
-			log_msg("\n CFS: read block: left %d, right %d, size: %zu, crnt_off: %d, blk_idx: %d, buff_idx: %d\n",
-				left, right, blk_buf.size, current_offset, blk_buf.index, buffer_index);        
-		} else {
-			// No block at this index
-			left = rem;
-			right = min(BLOCK_SIZE, left + offset + size - current_offset);
-			memset(buf + buffer_index, '\0', right-left);
-			log_msg("\n CFS: fillbuffer: left %d, right %d, size: %zu, crnt_off: %d, blk_idx: %d, buff_idx: %d\n",
-				left, right, right-left, current_offset, current_offset/ BLOCK_SIZE, buffer_index);        
-		}
-	   // Advance current offset to next block, again beware of holes
-		current_offset += BLOCK_SIZE - rem;
-
-		// advance input buffer
-		buffer_index += BLOCK_SIZE - rem;
-	}
-
-	return current_offset - offset;
+	// the whole range is resolved at once and assembled straight into buf
+	return cfs_file_read(CFS_STATE, file, buf, size, offset);
 	//return log_syscall("pread", pread(fi->fh, buf, size, offset), 0);
 }
 
@@ -413,12 +461,6 @@ int bb_write(const char *path, const char *buf, size_t size, off_t offset,
 		 struct fuse_file_info *fi)
 {
 	cfs_file_t* file;
-	cfs_block_t blk_buf;
-	off_t current_offset = offset;
-	off_t buffer_index=0;
-
-	off_t rem;
-	off_t left, right; // helper indexes to copy from read block
 
 	log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 		path, buf, size, offset, fi
@@ -432,35 +474,205 @@ int bb_write(const char *path, const char *buf, size_t size, off_t offset,
 		return -1;
 	}
 
-	while (current_offset < offset + size) {
-		memset(&blk_buf, 0, sizeof(blk_buf));
-		rem = current_offset % BLOCK_SIZE;
-		if (rem) {
-			// We are in the middle of a block, try to read the old one first
-			cfs_file_read_block(CFS_STATE, file, current_offset / BLOCK_SIZE, &blk_buf);
-		}
-		// Set up index pointers
-		left = rem;
-		right = min(BLOCK_SIZE, left + offset + size - current_offset);
-		// copy data to write in block buffer
-		memcpy(blk_buf.data + left, buf + buffer_index, right-left);
-
-		// Set up and write block
-		blk_buf.size = right; // Careful here, dont remove leading hole
-		blk_buf.index = current_offset / BLOCK_SIZE;
-		cfs_file_register_block(CFS_STATE, file, &blk_buf);
-		log_msg("\n CFS: write block: left %d, right %d, size: %zu, crnt_off: %d, blk_idx: %d, buff_idx: %d\n",
-			left, right, blk_buf.size, current_offset, blk_buf.index, buffer_index);        
-		// Advance current offset
-		current_offset += blk_buf.size;
-
-		// advance input buffer
-		buffer_index += right - left;
-	}    
+	// partial blocks stay in the file's write-back buffer until complete
+	return cfs_file_write(CFS_STATE, file, buf, size, offset);
 //    return log_syscall("pwrite", pwrite(fi->fh, buf, size, offset), 0);
-	return size;
 }
 
+#if FUSE_VERSION >= 29
+// Block files the last reply of a thread spliced from.  libfuse sends
+// the reply after read_buf() returns and never closes them, so they are
+// closed by the thread's next read, or when it exits.
+typedef struct {
+	size_t n_fds;
+	int fds[];
+} bb_spliced_t;
+
+static pthread_key_t bb_spliced_key;
+
+static void bb_spliced_release(void *arg)
+{
+	bb_spliced_t *spliced = arg;
+	size_t i;
+
+	if (spliced) {
+		for (i = 0; i < spliced->n_fds; i++)
+			close(spliced->fds[i]);
+		free(spliced);
+	}
+}
+
+/** Read data into a buffer vector
+ *
+ * Blocks that sit whole in a block file of their own are handed to
+ * libfuse as descriptors, it splices them to the kernel without
+ * copying them through user space.  The rest is read into memory like
+ * bb_read().
+ */
+int bb_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+	cfs_extent_t *ext;
+	bb_spliced_t *spliced;
+	struct fuse_bufvec *bufv;
+	struct fuse_buf *b;
+	size_t n_ext, n_fds, i, pos, run, done;
+	char *buf;
+	ssize_t ret, n;
+	int failed = 0;
+
+	log_msg("\nbb_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+		path, bufp, size, offset, fi);
+	log_fi(fi);
+
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		log_msg("\nCFS: Cannot find file %s to read\n", path);
+		return -1;
+	}
+
+	// the previous reply of this thread is long sent
+	bb_spliced_release(pthread_getspecific(bb_spliced_key));
+	pthread_setspecific(bb_spliced_key, NULL);
+
+	buf = malloc(size);
+	if (buf == NULL)
+		return -ENOMEM;
+	ret = cfs_file_read_extents(CFS_STATE, file, buf, size, offset, &ext, &n_ext);
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+
+	// The blocks are unpinned before libfuse sends the reply, a write
+	// may drop them meanwhile.  Only a block file of its own keeps its
+	// data then, regions and the staging extent are copied right away.
+	n_fds = 0;
+	for (i = 0, pos = 0; i < n_ext; pos += ext[i].len, i++) {
+		if (ext[i].fd < 0)
+			continue;
+		if (ext[i].own) {
+			n_fds++;
+			continue;
+		}
+		for (done = 0; done < ext[i].len; done += n) {
+			n = pread(ext[i].fd, buf + pos + done, ext[i].len - done, ext[i].pos + done);
+			if (n <= 0)
+				break;
+		}
+		if (done < ext[i].len) {
+			cfs_extents_release(CFS_STATE, file, ext, n_ext);
+			free(buf);
+			return -EIO;
+		}
+		close(ext[i].fd);
+		ext[i].fd = -1;
+		ext[i].mem = buf + pos;
+	}
+
+	bufv = malloc(sizeof(struct fuse_bufvec) + n_ext * sizeof(struct fuse_buf));
+	spliced = n_fds ? malloc(sizeof(bb_spliced_t) + n_fds * sizeof(int)) : NULL;
+	if (bufv == NULL || (n_fds && spliced == NULL)) {
+		cfs_extents_release(CFS_STATE, file, ext, n_ext);
+		free(bufv);
+		free(spliced);
+		free(buf);
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(ret);
+	bufv->buf[0].mem = buf;
+
+	if (n_fds) {
+		// libfuse frees every memory buffer of the vector, so each piece
+		// between spliced blocks gets its own copy
+		spliced->n_fds = 0;
+		bufv->count = 0;
+		for (i = 0, pos = 0, run = 0; i <= n_ext; i++) {
+			if (i < n_ext && ext[i].fd < 0) {
+				pos += ext[i].len;
+				continue;
+			}
+			if (pos > run) {
+				b = &bufv->buf[bufv->count];
+				memset(b, 0, sizeof(*b));
+				b->size = pos - run;
+				if ((b->mem = malloc(b->size)) == NULL) {
+					failed = 1;
+					break;
+				}
+				memcpy(b->mem, buf + run, b->size);
+				bufv->count++;
+			}
+			if (i == n_ext)
+				break;
+			b = &bufv->buf[bufv->count++];
+			memset(b, 0, sizeof(*b));
+			b->size = ext[i].len;
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->fd = ext[i].fd;
+			b->pos = ext[i].pos;
+			// taken over, the block file outlives the release
+			spliced->fds[spliced->n_fds++] = ext[i].fd;
+			ext[i].fd = -1;
+			pos += ext[i].len;
+			run = pos;
+		}
+		free(buf);
+		cfs_extents_release(CFS_STATE, file, ext, n_ext);
+		if (failed) {
+			for (i = 0; i < bufv->count; i++)
+				free(bufv->buf[i].mem);
+			free(bufv);
+			bb_spliced_release(spliced);
+			return -ENOMEM;
+		}
+		pthread_setspecific(bb_spliced_key, spliced);
+	} else {
+		cfs_extents_release(CFS_STATE, file, ext, n_ext);
+	}
+	*bufp = bufv;
+
+	return 0;
+}
+
+/** Write the contents of a buffer vector to an open file
+ *
+ * Data that arrives in memory is hashed where it is, only data
+ * spliced in from /dev/fuse has to be copied out first.
+ */
+int bb_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		 struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	cfs_file_t *file;
+	ssize_t ret;
+
+	log_msg("\nbb_write_buf(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+		path, buf, dst.buf[0].size, offset, fi);
+	log_fi(fi);
+
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		log_msg("\nCFS: Cannot find file %s to write\n", path);
+		return -1;
+	}
+
+	if (buf->count == 1 && buf->idx == 0 && buf->off == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return cfs_file_write(CFS_STATE, file, buf->buf[0].mem, buf->buf[0].size, offset);
+
+	dst.buf[0].mem = malloc(dst.buf[0].size);
+	if (dst.buf[0].mem == NULL)
+		return -ENOMEM;
+	ret = fuse_buf_copy(&dst, buf, 0);
+	if (ret >= 0)
+		ret = cfs_file_write(CFS_STATE, file, dst.buf[0].mem, ret, offset);
+	free(dst.buf[0].mem);
+
+	return ret;
+}
+#endif
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -508,14 +720,21 @@ int bb_statfs(const char *path, struct statvfs *statv)
  *
  * Changed in version 2.2
  */
-// this is a no-op in BBFS.  It just logs the call and returns success
+// CFS writes back the partially written blocks it still buffers
 int bb_flush(const char *path, struct fuse_file_info *fi)
 {
+	cfs_file_t* file;
+
 	log_msg("\nbb_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
 	// no need to get fpath on this one, since I work from fi->fh not the path
 	log_fi(fi);
-	
-	return 0;
+
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		return 0;
+	}
+
+	return cfs_file_flush(CFS_STATE, file) < 0 ? -EIO : 0;
 }
 
 /** Release an open file
@@ -555,9 +774,16 @@ int bb_release(const char *path, struct fuse_file_info *fi)
  */
 int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+	cfs_file_t* file;
+
 	log_msg("\nbb_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
 		path, datasync, fi);
 	log_fi(fi);
+
+	// every block of the file must be stored, mapped and on disk before its map
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file && cfs_file_fsync(CFS_STATE, file) < 0)
+	return -EIO;
 	
 	// some unix-like systems (notably freebsd) don't have a datasync call
 #ifdef HAVE_FDATASYNC
@@ -583,6 +809,8 @@ int bb_setxattr(const char *path, const char *name, const char *value, size_t si
 	
 	log_msg("\nbb_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, flags=0x%08x)\n",
 		path, name, value, size, flags);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("lsetxattr", lsetxattr(fpath, name, value, size, flags), 0);
@@ -596,6 +824,19 @@ int bb_getxattr(const char *path, const char *name, char *value, size_t size)
 	
 	log_msg("\nbb_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = %d)\n",
 		path, name, value, size);
+
+	// CFS counters can be read from any path, they are not stored anywhere
+	if (strcmp(name, CFS_XATTR_STATS) == 0) {
+		char stats[4096];
+		retstat = cfs_stats(CFS_STATE, stats, sizeof(stats));
+		if (size == 0)
+			return retstat;
+		if (retstat > size)
+			return -ERANGE;
+		memcpy(value, stats, retstat);
+		return retstat;
+	}
+
 	bb_fullpath(fpath, path);
 
 	retstat = log_syscall("lgetxattr", lgetxattr(fpath, name, value, size), 0);
@@ -637,6 +878,8 @@ int bb_removexattr(const char *path, const char *name)
 	
 	log_msg("\nbb_removexattr(path=\"%s\", name=\"%s\")\n",
 		path, name);
+	if (bb_readonly(path))
+		return -EROFS;
 	bb_fullpath(fpath, path);
 
 	return log_syscall("lremovexattr", lremovexattr(fpath, name), 0);
@@ -659,13 +902,12 @@ int bb_opendir(const char *path, struct fuse_file_info *fi)
 	log_msg("\nbb_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
 	
-	if (strcmp(path, BLOCKS_DIRECTORY) == 0) {
+	bb_fullpath(fpath, path);
+	if (bb_hidden(fpath)) {
 		// Hide the blocks directory
 		return -ENOENT;
 	}
 
-	bb_fullpath(fpath, path);
-
 	// since opendir returns a pointer, takes some custom handling of
 	// return status.
 	dp = opendir(fpath);
@@ -708,6 +950,7 @@ int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 	int retstat = 0;
 	DIR *dp;
 	struct dirent *de;
+	char fpath[PATH_MAX];
 	
 	log_msg("\nbb_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 		path, buf, filler, offset, fi);
@@ -731,7 +974,9 @@ int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 	// read the whole directory; the second means the buffer is full.
 	do {
 		log_msg("calling filler with name %s\n", de->d_name);
-		if (strcmp(de->d_name, BLOCKS_DIRECTORY) == 0) {
+		if (de->d_ino == CFS_STATE->storage->ino &&
+			snprintf(fpath, PATH_MAX, "%s%s/%s", BB_DATA->rootdir, path, de->d_name) < PATH_MAX &&
+			bb_hidden(fpath)) {
 			log_msg("     Ignoring BLOCKS directory %s\n", de->d_name);
 			continue;
 		} else if (filler(buf, de->d_name, NULL, 0) != 0) {
@@ -805,6 +1050,26 @@ void *bb_init(struct fuse_conn_info *conn)
 	
 	log_conn(conn);
 	log_fuse_context(fuse_get_context());
+
+	// CFS starts worker threads, so it has to wait until fuse_main()
+	// is done daemonizing -- threads don't survive the fork
+	if (cfs_init(CFS_STATE, BB_DATA->rootdir, &BB_DATA->config) < 0) {
+		fprintf(stderr, "CFS: init failed\n");
+		abort();
+	}
+
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+	// open(O_TRUNC) as one request, bb_open() cuts the block map itself
+	if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+		conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+#endif
+
+#if FUSE_VERSION >= 29
+	// let libfuse splice the block store descriptors bb_read_buf() returns
+	pthread_key_create(&bb_spliced_key, bb_spliced_release);
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+#endif
 	
 	return BB_DATA;
 }
@@ -819,6 +1084,9 @@ void *bb_init(struct fuse_conn_info *conn)
 void bb_destroy(void *userdata)
 {
 	log_msg("\nbb_destroy(userdata=0x%08x)\n", userdata);
+
+	// drains whatever is still staged
+	cfs_destroy(((struct bb_state *) userdata)->cfs_state);
 }
 
 /**
@@ -861,8 +1129,33 @@ int bb_access(const char *path, int mask)
  *
  * Introduced in version 2.5
  */
-// Not implemented.  I had a version that used creat() to create and
-// open the file, which it turned out opened the file write-only.
+// CFS writes the header and registers the file on the one descriptor,
+// mknod() and open() would write it on one and read it back on another.
+int bb_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int fd;
+	char fpath[PATH_MAX];
+	
+	log_msg("\nbb_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
+		path, mode, fi);
+	if (bb_readonly(path))
+		return -EROFS;
+	bb_fullpath(fpath, path);
+	
+	fd = cfs_create_open(CFS_STATE, fpath, mode);
+	if (fd == -EEXIST && !(fi->flags & O_EXCL)) {
+		// someone else created it meanwhile
+		return bb_open(path, fi);
+	}
+	if (fd < 0)
+		return fd;
+	
+	fi->fh = fd;
+	
+	log_fi(fi);
+	
+	return 0;
+}
 
 /**
  * Change the size of an open file
@@ -878,17 +1171,19 @@ int bb_access(const char *path, int mask)
  */
 int bb_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-	int retstat = 0;
+	cfs_file_t *file;
 	
 	log_msg("\nbb_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
 		path, offset, fi);
 	log_fi(fi);
 	
-	retstat = ftruncate(fi->fh, offset);
-	if (retstat < 0)
-	retstat = log_error("bb_ftruncate ftruncate");
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		log_msg("\nCFS: Cannot find file %s to truncate\n", path);
+		return -EBADF;
+	}
 	
-	return retstat;
+	return cfs_file_truncate(CFS_STATE, file, offset);
 }
 
 /**
@@ -906,6 +1201,8 @@ int bb_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
 	int retstat = 0;
+	char fpath[PATH_MAX];
+	cfs_file_t file;
 	
 	log_msg("\nbb_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
 		path, statbuf, fi);
@@ -921,18 +1218,130 @@ int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *f
 	retstat = fstat(fi->fh, statbuf);
 	if (retstat < 0)
 	retstat = log_error("bb_fgetattr fstat");
+
+	// fi->fh is the block map, the open file has the size
+	bb_fullpath(fpath, path);
+	if (retstat == 0 && cfs_file_stat(CFS_STATE, fpath, statbuf, &file) > 0) {
+		statbuf->st_size = file.size;
+		statbuf->st_blksize = BLOCK_SIZE;
+		statbuf->st_blocks = file.total_blocks;
+	}
 	
 	log_stat(statbuf);
 	
 	return retstat;
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified
+ * file.  If this function returns success then any subsequent write
+ * request to specified range is guaranteed not to fail because of lack
+ * of space on the file system media.
+ *
+ * Introduced in version 2.9.1
+ */
+int bb_fallocate(const char *path, int mode, off_t offset, off_t len,
+		 struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+	
+	log_msg("\nbb_fallocate(path=\"%s\", mode=0x%x, offset=%lld, len=%lld, fi=0x%08x)\n",
+		path, mode, offset, len, fi);
+	log_fi(fi);
+	
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		log_msg("\nCFS: Cannot find file %s to allocate\n", path);
+		return -EBADF;
+	}
+	
+	// holes and zeroed ranges are edits of the block map, no zeroes are stored
+	return cfs_file_fallocate(CFS_STATE, file, mode, offset, len);
+}
+#endif
+
+#if FUSE_VERSION >= 28
+// CFS_IOC_CLONE on a file makes it a copy of the file named in the
+// argument, relative to the mount point, sharing all of its blocks
+static int bb_clone(const char *path, struct fuse_file_info *fi, const cfs_clone_arg_t *clone)
+{
+	char fpath[PATH_MAX];
+	cfs_file_t *file;
+	
+	file = cfs_get_file(CFS_STATE, fi->fh);
+	if (file == NULL) {
+		log_msg("\nCFS: Cannot find file %s to clone into\n", path);
+		return -EBADF;
+	}
+	
+	if (strlen(BB_DATA->rootdir) + strlen(clone->path) + 2 > PATH_MAX)
+		return -ENAMETOOLONG;
+	strcpy(fpath, BB_DATA->rootdir);
+	strcat(fpath, "/");
+	strcat(fpath, clone->path);
+	
+	return cfs_clone(CFS_STATE, fpath, file, fuse_get_context()->uid, fuse_get_context()->gid);
+}
+
+/**
+ * Ioctl
+ *
+ * CFS_IOC_CLONE and CFS_IOC_MAP on a file, CFS_IOC_SNAPSHOT and
+ * CFS_IOC_SNAPSHOT_DELETE on a directory.
+ *
+ * Introduced in version 2.8
+ */
+int bb_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+	     unsigned int flags, void *data)
+{
+	const cfs_clone_arg_t *clone = data;
+	const cfs_snapshot_arg_t *snap = data;
+	cfs_file_t *file;
+	char fpath[PATH_MAX];
+	
+	log_msg("\nbb_ioctl(path=\"%s\", cmd=0x%x, fi=0x%08x)\n",
+		path, cmd, fi);
+	
+	switch ((unsigned) cmd) {
+	case CFS_IOC_CLONE:
+		if (flags & FUSE_IOCTL_DIR)
+			return -EISDIR;
+		if (memchr(clone->path, '\0', PATH_MAX) == NULL)
+			return -EINVAL;
+		return bb_clone(path, fi, clone);
+		
+	case CFS_IOC_SNAPSHOT:
+	case CFS_IOC_SNAPSHOT_DELETE:
+		if (memchr(snap->name, '\0', sizeof(snap->name)) == NULL)
+			return -EINVAL;
+		if ((unsigned) cmd == CFS_IOC_SNAPSHOT_DELETE)
+			return snapshot_delete(CFS_STATE, snap->name, fuse_get_context()->uid);
+		bb_fullpath(fpath, path);
+		return snapshot_create(CFS_STATE, fpath, snap->name, fuse_get_context()->uid);
+		
+	case CFS_IOC_MAP:
+		if (flags & FUSE_IOCTL_DIR)
+			return -EISDIR;
+		file = cfs_get_file(CFS_STATE, fi->fh);
+		if (file == NULL)
+			return -EBADF;
+		return cfs_file_map(CFS_STATE, file, data);
+	}
+	
+	return -ENOTTY;
+}
+#endif
+
 struct fuse_operations bb_oper = {
   .getattr = bb_getattr,
   .readlink = bb_readlink,
   // no .getdir -- that's deprecated
   .getdir = NULL,
   .mknod = bb_mknod,
+  .create = bb_create,
   .mkdir = bb_mkdir,
   .unlink = bb_unlink,
   .rmdir = bb_rmdir,
@@ -946,6 +1355,10 @@ struct fuse_operations bb_oper = {
   .open = bb_open,
   .read = bb_read,
   .write = bb_write,
+#if FUSE_VERSION >= 29
+  .read_buf = bb_read_buf,
+  .write_buf = bb_write_buf,
+#endif
   /** Just a placeholder, don't set */ // huh???
   .statfs = bb_statfs,
   .flush = bb_flush,
@@ -967,12 +1380,30 @@ struct fuse_operations bb_oper = {
   .destroy = bb_destroy,
   .access = bb_access,
   .ftruncate = bb_ftruncate,
-  .fgetattr = bb_fgetattr
+  .fgetattr = bb_fgetattr,
+#if FUSE_VERSION >= 29
+  .fallocate = bb_fallocate,
+#endif
+#if FUSE_VERSION >= 28
+  .ioctl = bb_ioctl,
+#endif
+};
+
+static struct fuse_opt bb_opts[] = {
+	BB_CFS_OPTS,
+	FUSE_OPT_END
 };
 
 void bb_usage()
 {
 	fprintf(stderr, "usage:  bbfs [FUSE and mount options] rootDir mountPoint\n");
+	fprintf(stderr, BB_CFS_USAGE);
+	// libfuse handles these itself
+	fprintf(stderr, "Caching options:\n"
+		"    -o kernel_cache          keep file pages cached between opens\n"
+		"    -o auto_cache            like kernel_cache, until a file changes\n"
+		"    -o attr_timeout=T        seconds the kernel caches attributes (default 1.0)\n"
+		"    -o entry_timeout=T       seconds the kernel caches names (default 1.0)\n");
 	abort();
 }
 
@@ -980,6 +1411,9 @@ int main(int argc, char *argv[])
 {
 	int fuse_stat;
 	struct bb_state *bb_data;
+	struct fuse_args args;
+	char max_write[32];
+	char *blocks;
 
 	// bbfs doesn't do any access checking on its own (the comment
 	// blocks in fuse.h mention some of the functions that need
@@ -1024,14 +1458,38 @@ int main(int argc, char *argv[])
 	
 	bb_data->logfile = log_open();
 
-	// init cfs
+	// pick our own options out, the rest goes to fuse
+	args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+	cfs_default_config(&bb_data->config);
+	if (fuse_opt_parse(&args, bb_data, bb_opts, NULL) == -1)
+	bb_usage();
+
+	// the daemon runs from /, so the block store needs an absolute path
+	if (bb_data->config.blocks_dir) {
+		mkdir(bb_data->config.blocks_dir, 0700);
+		blocks = realpath(bb_data->config.blocks_dir, NULL);
+		if (blocks == NULL) {
+			fprintf(stderr, "\n    ERROR: Bad blocks directory %s\n", bb_data->config.blocks_dir);
+			return 1;
+		}
+		free(bb_data->config.blocks_dir);
+		bb_data->config.blocks_dir = blocks;
+	}
+
+	// whole writes are registered as one batch, so ask for large ones.
+	// These go first, options given on the command line still win.
+	snprintf(max_write, sizeof(max_write), "-omax_write=%d", BB_MAX_WRITE);
+	fuse_opt_insert_arg(&args, 1, max_write);
+	fuse_opt_insert_arg(&args, 1, "-obig_writes");
+
+	// cfs itself is initialised in bb_init()
 	bb_data->cfs_state = malloc(sizeof(cfs_state_t));
-	cfs_init(bb_data->cfs_state, bb_data->rootdir);
 
 	// turn over control to fuse
 	fprintf(stderr, "about to call fuse_main\n");
-	fuse_stat = fuse_main(argc, argv, &bb_oper, bb_data);
+	fuse_stat = fuse_main(args.argc, args.argv, &bb_oper, bb_data);
 	fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+	fuse_opt_free_args(&args);
 
 	return fuse_stat;
 }
@@ -0,0 +1,1547 @@
+/*
+  Big Brother File System, FUSE 3 low-level build
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The same file system as bbfs.c, but the kernel talks to it in inode
+  numbers instead of paths.  Every inode the kernel holds a lookup
+  reference to is kept in a resident table, together with an O_PATH
+  descriptor of its file under rootdir, so requests never walk the
+  tree from the root again.  CFS still knows open files by path; that
+  path is read back from the descriptor when a file is opened, created
+  or stat'ed.
+
+  bbfs.c stays the high-level (FUSE 2.6) build for systems without
+  FUSE 3.
+*/
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#include "log.h"
+#include "snapshot.h"
+#include "storage.h"
+#include "util.h"
+
+#define BB_LL_BUCKETS 1024 /* initial size of the inode table */
+#define BB_LL_TIMEOUT 1.0 /* default entry and attribute timeout, seconds */
+
+// An inode the kernel knows about
+typedef struct bb_inode {
+	int fd; /* O_PATH descriptor of the file under rootdir */
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;
+	struct bb_inode *next; /* hash chain */
+
+	// in the snapshots directory, nothing under it may change
+	int readonly;
+	// the snapshots directory itself, its entries come and go by ioctl
+	int snapshots;
+
+	// with kernel_cache, the file as the kernel's cached pages know it
+	int cached;
+	off_t size;
+	struct timespec mtime;
+} bb_inode_t;
+
+// Inodes by (dev, ino) of their file, the fuse inode number is the pointer
+typedef struct {
+	bb_inode_t root;
+	bb_inode_t **buckets;
+	size_t n_buckets;
+	size_t count;
+	pthread_mutex_t lock;
+} bb_inode_table_t;
+
+// An open directory, readdir() may be asked to resume anywhere
+typedef struct {
+	DIR *dp;
+	struct dirent *entry; /* read but not yet returned */
+	off_t offset;
+} bb_dir_t;
+
+// Where the kernel's cached pages of a file stand
+enum { BB_CACHE_NONE, BB_CACHE_VALID, BB_CACHE_STALE };
+
+static bb_inode_table_t inodes;
+static struct fuse_session *session;
+
+#define BB_LL_DATA(req) ((struct bb_state *) fuse_req_userdata(req))
+#define BB_LL_STATE(req) (BB_LL_DATA(req)->cfs_state)
+
+static bb_inode_t *bb_ll_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &inodes.root;
+	return (bb_inode_t *) (uintptr_t) ino;
+}
+
+static size_t bb_ll_bucket(dev_t dev, ino_t ino, size_t n_buckets)
+{
+	return (ino ^ (dev * 31)) % n_buckets;
+}
+
+// Double the table once the chains get long
+static void bb_ll_grow(void)
+{
+	bb_inode_t **buckets, *inode, *next;
+	size_t i, n = inodes.n_buckets * 2;
+
+	buckets = calloc(n, sizeof(bb_inode_t *));
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i < inodes.n_buckets; i++) {
+		for (inode = inodes.buckets[i]; inode; inode = next) {
+			next = inode->next;
+			inode->next = buckets[bb_ll_bucket(inode->dev, inode->ino, n)];
+			buckets[bb_ll_bucket(inode->dev, inode->ino, n)] = inode;
+		}
+	}
+	free(inodes.buckets);
+	inodes.buckets = buckets;
+	inodes.n_buckets = n;
+}
+
+// Take a lookup reference on the inode of *fd*, adding it to the table
+// if it is new.  *fd* is owned by the table afterwards.
+static bb_inode_t *bb_ll_get_inode(int fd, const struct stat *st)
+{
+	bb_inode_t *inode;
+	size_t b;
+
+	pthread_mutex_lock(&inodes.lock);
+	b = bb_ll_bucket(st->st_dev, st->st_ino, inodes.n_buckets);
+	for (inode = inodes.buckets[b]; inode; inode = inode->next) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+			inode->nlookup++;
+			pthread_mutex_unlock(&inodes.lock);
+			close(fd);
+			return inode;
+		}
+	}
+
+	inode = calloc(1, sizeof(bb_inode_t));
+	if (inode == NULL) {
+		pthread_mutex_unlock(&inodes.lock);
+		close(fd);
+		return NULL;
+	}
+	inode->fd = fd;
+	inode->dev = st->st_dev;
+	inode->ino = st->st_ino;
+	inode->nlookup = 1;
+	inode->next = inodes.buckets[b];
+	inodes.buckets[b] = inode;
+	if (++inodes.count > inodes.n_buckets * 2)
+		bb_ll_grow();
+	pthread_mutex_unlock(&inodes.lock);
+
+	return inode;
+}
+
+// Drop *n* lookup references, the last one frees the inode
+static void bb_ll_put_inode(bb_inode_t *inode, uint64_t n)
+{
+	bb_inode_t **link;
+
+	if (inode == &inodes.root)
+		return;
+
+	pthread_mutex_lock(&inodes.lock);
+	inode->nlookup -= n;
+	if (inode->nlookup > 0) {
+		pthread_mutex_unlock(&inodes.lock);
+		return;
+	}
+
+	link = &inodes.buckets[bb_ll_bucket(inode->dev, inode->ino, inodes.n_buckets)];
+	while (*link != inode)
+		link = &(*link)->next;
+	*link = inode->next;
+	inodes.count--;
+	pthread_mutex_unlock(&inodes.lock);
+
+	close(inode->fd);
+	free(inode);
+}
+
+static void bb_ll_proc_path(char proc[64], int fd)
+{
+	snprintf(proc, 64, "/proc/self/fd/%d", fd);
+}
+
+// Current path of the file behind *fd*, the way CFS knows it
+static int bb_ll_path(int fd, char path[PATH_MAX])
+{
+	char proc[64];
+	ssize_t len;
+
+	bb_ll_proc_path(proc, fd);
+	len = readlink(proc, path, PATH_MAX - 1);
+	if (len < 0)
+		return -errno;
+	path[len] = '\0';
+
+	return 0;
+}
+
+static int bb_ll_child_path(bb_inode_t *dir, const char *name, char path[PATH_MAX])
+{
+	int ret;
+
+	ret = bb_ll_path(dir->fd, path);
+	if (ret < 0)
+		return ret;
+	if (strlen(path) + strlen(name) + 2 > PATH_MAX)
+		return -ENAMETOOLONG;
+	strcat(path, "/");
+	strcat(path, name);
+
+	return 0;
+}
+
+// Stat the file behind *fd*, regular files report the size of the
+// CFS file they hold rather than the size of its block map.  *path* is
+// where the file is if the caller knows, NULL looks it up.
+static int bb_ll_stat(cfs_state_t *state, int fd, const char *path, struct stat *statbuf)
+{
+	char fdpath[PATH_MAX];
+	cfs_file_t file;
+
+	if (fstatat(fd, "", statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		return log_error("bb_ll_stat fstatat");
+
+	if (S_ISREG(statbuf->st_mode) && path == NULL && bb_ll_path(fd, fdpath) == 0)
+		path = fdpath;
+	if (S_ISREG(statbuf->st_mode) && path &&
+		cfs_file_stat(state, path, statbuf, &file) > 0) {
+		statbuf->st_size = file.size;
+		statbuf->st_blksize = BLOCK_SIZE;
+		statbuf->st_blocks = file.total_blocks;
+	}
+
+	return 0;
+}
+
+// Check the kernel's cached pages of *inode* against the file behind it,
+// then record the file as it is now.  Returns the BB_CACHE_* state they
+// were in.
+static int bb_ll_cache_update(bb_inode_t *inode)
+{
+	struct stat st;
+	int ret;
+
+	if (fstatat(inode->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		return BB_CACHE_STALE;
+
+	pthread_mutex_lock(&inodes.lock);
+	if (!inode->cached)
+		ret = BB_CACHE_NONE;
+	else if (inode->size == st.st_size &&
+		 inode->mtime.tv_sec == st.st_mtim.tv_sec &&
+		 inode->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		ret = BB_CACHE_VALID;
+	else
+		ret = BB_CACHE_STALE;
+	inode->cached = 1;
+	inode->size = st.st_size;
+	inode->mtime = st.st_mtim;
+	pthread_mutex_unlock(&inodes.lock);
+
+	return ret;
+}
+
+// Resolve *name* in *parent* into an entry the kernel can cache.
+// *dirpath* is where *parent* is if the caller knows, NULL looks it up.
+static int bb_ll_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *dirpath,
+			   const char *name, struct fuse_entry_param *e)
+{
+	struct bb_state *bb = BB_LL_DATA(req);
+	bb_inode_t *inode;
+	char path[PATH_MAX];
+	int fd, ret;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = bb->attr_timeout;
+	e->entry_timeout = bb->entry_timeout;
+
+	fd = openat(bb_ll_inode(parent)->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return errno;
+
+	if (dirpath && snprintf(path, PATH_MAX, "%s/%s", dirpath, name) >= PATH_MAX)
+		dirpath = NULL;
+	ret = bb_ll_stat(bb->cfs_state, fd, dirpath ? path : NULL, &e->attr);
+	if (ret < 0) {
+		close(fd);
+		return -ret;
+	}
+	if (is_block_store(bb->cfs_state->storage, &e->attr)) {
+		// Hide the blocks directory
+		close(fd);
+		return ENOENT;
+	}
+
+	inode = bb_ll_get_inode(fd, &e->attr);
+	if (inode == NULL)
+		return ENOMEM;
+	e->ino = (uintptr_t) inode;
+	if (bb_ll_inode(parent)->readonly)
+		inode->readonly = 1;
+	if (parent == FUSE_ROOT_ID && strcmp(name, CFS_SNAPSHOTS_DIRECTORY) == 0)
+		inode->readonly = inode->snapshots = 1;
+
+	// a snapshot deleted by ioctl never goes through the kernel's
+	// dentries, so have each one revalidated
+	if (bb_ll_inode(parent)->snapshots)
+		e->entry_timeout = 0;
+
+	log_msg("    bb_ll_lookup:  %s -> inode %lld, %llu lookups\n",
+		name, (long long) e->attr.st_ino, (unsigned long long) inode->nlookup);
+
+	return 0;
+}
+
+static void bb_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int ret;
+
+	ret = bb_ll_do_lookup(req, parent, NULL, name, &e);
+	if (ret)
+		fuse_reply_err(req, ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void bb_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	log_msg("\nbb_ll_lookup(parent=%lld, name=\"%s\")\n", parent, name);
+
+	bb_ll_reply_entry(req, parent, name);
+}
+
+static void bb_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	bb_ll_put_inode(bb_ll_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void bb_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		bb_ll_put_inode(bb_ll_inode(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void bb_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat statbuf;
+	int ret;
+
+	log_msg("\nbb_ll_getattr(ino=%lld)\n", ino);
+
+	ret = bb_ll_stat(BB_LL_STATE(req), bb_ll_inode(ino)->fd, NULL, &statbuf);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &statbuf, BB_LL_DATA(req)->attr_timeout);
+}
+
+static void bb_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			  int to_set, struct fuse_file_info *fi)
+{
+	bb_inode_t *inode = bb_ll_inode(ino);
+	cfs_file_t *file;
+	char proc[64];
+	char path[PATH_MAX];
+	struct timespec tv[2];
+	struct stat st;
+	int ret = 0;
+
+	log_msg("\nbb_ll_setattr(ino=%lld, to_set=0x%x)\n", ino, to_set);
+	if (inode->readonly) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	bb_ll_proc_path(proc, inode->fd);
+
+	if (to_set & FUSE_SET_ATTR_MODE)
+		ret = log_syscall("chmod", chmod(proc, attr->st_mode), 0);
+	if (!ret && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		ret = log_syscall("fchownat", fchownat(inode->fd, "", uid, gid,
+			AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW), 0);
+	}
+	if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if (fstatat(inode->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == 0)
+			cfs_stat_forget(BB_LL_STATE(req), &st);
+		// the file holds the block map, CFS moves the logical end
+		file = fi ? cfs_get_file(BB_LL_STATE(req), fi->fh) : NULL;
+		if (file == NULL)
+			ret = bb_ll_path(inode->fd, path);
+		if (!ret)
+			ret = file ? cfs_file_truncate(BB_LL_STATE(req), file, attr->st_size) :
+				cfs_truncate(BB_LL_STATE(req), path, attr->st_size);
+	}
+	if (!ret && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		tv[0].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1] = tv[0];
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+		ret = log_syscall("utimensat", utimensat(AT_FDCWD, proc, tv, 0), 0);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		bb_ll_getattr(req, ino, fi);
+}
+
+static void bb_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char link[PATH_MAX];
+	ssize_t ret;
+
+	log_msg("\nbb_ll_readlink(ino=%lld)\n", ino);
+
+	ret = readlinkat(bb_ll_inode(ino)->fd, "", link, sizeof(link) - 1);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	link[ret] = '\0';
+	fuse_reply_readlink(req, link);
+}
+
+static void bb_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode, dev_t rdev)
+{
+	bb_inode_t *dir = bb_ll_inode(parent);
+	char path[PATH_MAX];
+	int ret;
+
+	log_msg("\nbb_ll_mknod(parent=%lld, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+
+	if (dir->readonly)
+		ret = -EROFS;
+	else if (S_ISREG(mode)) {
+		ret = bb_ll_child_path(dir, name, path);
+		if (ret == 0)
+			ret = cfs_create_file(BB_LL_STATE(req), path, mode);
+		if (ret >= 0)
+			ret = log_syscall("close", close(ret), 0);
+	}
+	else if (S_ISFIFO(mode))
+		ret = log_syscall("mkfifoat", mkfifoat(dir->fd, name, mode), 0);
+	else
+		ret = log_syscall("mknodat", mknodat(dir->fd, name, mode, rdev), 0);
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		bb_ll_reply_entry(req, parent, name);
+}
+
+static void bb_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	int ret;
+
+	log_msg("\nbb_ll_mkdir(parent=%lld, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+
+	if (bb_ll_inode(parent)->readonly)
+		ret = -EROFS;
+	else
+		ret = log_syscall("mkdirat", mkdirat(bb_ll_inode(parent)->fd, name, mode), 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		bb_ll_reply_entry(req, parent, name);
+}
+
+static void bb_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	int ret;
+
+	log_msg("\nbb_ll_symlink(link=\"%s\", parent=%lld, name=\"%s\")\n", link, parent, name);
+
+	if (bb_ll_inode(parent)->readonly)
+		ret = -EROFS;
+	else
+		ret = log_syscall("symlinkat", symlinkat(link, bb_ll_inode(parent)->fd, name), 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		bb_ll_reply_entry(req, parent, name);
+}
+
+static void bb_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	char proc[64];
+	int ret;
+
+	log_msg("\nbb_ll_link(ino=%lld, newparent=%lld, newname=\"%s\")\n", ino, newparent, newname);
+	bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+
+	// a snapshot file linked elsewhere could be written there
+	if (bb_ll_inode(ino)->readonly || bb_ll_inode(newparent)->readonly)
+		ret = -EROFS;
+	else
+		ret = log_syscall("linkat", linkat(AT_FDCWD, proc, bb_ll_inode(newparent)->fd, newname,
+			AT_SYMLINK_FOLLOW), 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		bb_ll_reply_entry(req, newparent, newname);
+}
+
+// Drop the cached size of the CFS file *name* in *parent*, it is about
+// to go away.  Returns 0 with *st* filled in if there is such a file.
+static int bb_ll_forget_size(fuse_req_t req, fuse_ino_t parent, const char *name, struct stat *st)
+{
+	if (fstatat(bb_ll_inode(parent)->fd, name, st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	cfs_stat_forget(BB_LL_STATE(req), st);
+	return 0;
+}
+
+static void bb_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct stat st;
+	int found, ret;
+
+	log_msg("\nbb_ll_unlink(parent=%lld, name=\"%s\")\n", parent, name);
+	if (bb_ll_inode(parent)->readonly) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	found = bb_ll_forget_size(req, parent, name, &st) == 0;
+
+	ret = log_syscall("unlinkat", unlinkat(bb_ll_inode(parent)->fd, name, 0), 0);
+	// the staging extent is named by inode, it goes with the last link
+	if (ret == 0 && found)
+		cfs_unlinked(BB_LL_STATE(req), &st);
+	fuse_reply_err(req, -ret);
+}
+
+static void bb_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int ret;
+
+	log_msg("\nbb_ll_rmdir(parent=%lld, name=\"%s\")\n", parent, name);
+	if (bb_ll_inode(parent)->readonly) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	ret = log_syscall("unlinkat", unlinkat(bb_ll_inode(parent)->fd, name, AT_REMOVEDIR), 0);
+	fuse_reply_err(req, -ret);
+}
+
+static void bb_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	struct stat st, old;
+	int found, ret;
+
+	log_msg("\nbb_ll_rename(parent=%lld, name=\"%s\", newparent=%lld, newname=\"%s\")\n",
+		parent, name, newparent, newname);
+
+	if (flags) {
+		// no RENAME_EXCHANGE or RENAME_NOREPLACE
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (bb_ll_inode(parent)->readonly || bb_ll_inode(newparent)->readonly) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	// a file renamed over goes away, unless it is the one renamed
+	found = bb_ll_forget_size(req, newparent, newname, &st) == 0 &&
+		fstatat(bb_ll_inode(parent)->fd, name, &old, AT_SYMLINK_NOFOLLOW) == 0 &&
+		(old.st_ino != st.st_ino || old.st_dev != st.st_dev);
+	ret = log_syscall("renameat", renameat(bb_ll_inode(parent)->fd, name,
+		bb_ll_inode(newparent)->fd, newname), 0);
+	if (ret == 0 && found)
+		cfs_unlinked(BB_LL_STATE(req), &st);
+	fuse_reply_err(req, -ret);
+}
+
+/*
+ * Hand the descriptor fd of path over to CFS, cut to nothing for O_TRUNC:
+ * with atomic_o_trunc, on by default, the kernel leaves that to open.
+ * Returns fd, or -errno after closing it.
+ */
+static int bb_ll_register(cfs_state_t *state, const char *path, int fd, int flags)
+{
+	cfs_file_t *file;
+	int ret = 0;
+
+	if (cfs_register_file(state, path, fd) < 0) {
+		close(fd);
+		return -EIO;
+	}
+
+	if (flags & O_TRUNC) {
+		file = cfs_get_file(state, fd);
+		ret = file ? cfs_file_truncate(state, file, 0) : -EIO;
+	}
+	if (ret < 0) {
+		cfs_release_file(state, fd);
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static void bb_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	bb_inode_t *inode = bb_ll_inode(ino);
+	char proc[64];
+	char path[PATH_MAX];
+	int fd, ret, cache = BB_CACHE_NONE;
+
+	log_msg("\nbb_ll_open(ino=%lld)\n", ino);
+	if (inode->readonly && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	bb_ll_proc_path(proc, inode->fd);
+
+	// CFS reads the block map too, so the file is always opened read-write
+	fd = log_syscall("open", open(proc, O_RDWR), 0);
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+
+	ret = bb_ll_path(inode->fd, path);
+	if (ret == 0)
+		ret = bb_ll_register(BB_LL_STATE(req), path, fd, fi->flags);
+	else
+		close(fd);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	// keep the pages from earlier opens unless the file changed
+	// behind the kernel's back
+	if (BB_LL_DATA(req)->kernel_cache) {
+		cache = bb_ll_cache_update(inode);
+		fi->keep_cache = cache == BB_CACHE_VALID;
+	}
+
+	// not opening keep_cache only drops the pages, the attributes the
+	// kernel holds are stale too.  Dropping them takes no page locks, so
+	// it is done before the reply, or the first read could still see
+	// them.  The pages are left to the kernel not keeping them.
+	if (cache == BB_CACHE_STALE) {
+		log_msg("    bb_ll_open:  inode %lld changed, invalidating\n", ino);
+		fuse_lowlevel_notify_inval_inode(session, ino, -1, 0);
+	}
+
+	fi->fh = fd;
+	log_fi(fi);
+	fuse_reply_open(req, fi);
+}
+
+// CFS writes the header and registers the file on the one descriptor,
+// mknod and open would write it on one and read it back on another
+static void bb_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, struct fuse_file_info *fi)
+{
+	bb_inode_t *dir = bb_ll_inode(parent);
+	struct fuse_entry_param e;
+	char dirpath[PATH_MAX];
+	char path[PATH_MAX];
+	int fd, ret;
+
+	log_msg("\nbb_ll_create(parent=%lld, name=\"%s\", mode=0%3o)\n", parent, name, mode);
+
+	ret = dir->readonly ? -EROFS : bb_ll_path(dir->fd, dirpath);
+	if (ret == 0 && snprintf(path, PATH_MAX, "%s/%s", dirpath, name) >= PATH_MAX)
+		ret = -ENAMETOOLONG;
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fd = cfs_create_open(BB_LL_STATE(req), path, mode);
+	if (fd == -EEXIST && !(fi->flags & O_EXCL)) {
+		// someone else created it meanwhile, open it as it is
+		fd = log_syscall("openat", openat(dir->fd, name, O_RDWR | O_NOFOLLOW), 0);
+		if (fd >= 0)
+			fd = bb_ll_register(BB_LL_STATE(req), path, fd, fi->flags);
+	}
+	if (fd < 0) {
+		fuse_reply_err(req, -fd);
+		return;
+	}
+
+	ret = bb_ll_do_lookup(req, parent, dirpath, name, &e);
+	if (ret) {
+		cfs_release_file(BB_LL_STATE(req), fd);
+		close(fd);
+		fuse_reply_err(req, ret);
+		return;
+	}
+	if (BB_LL_DATA(req)->kernel_cache)
+		bb_ll_cache_update(bb_ll_inode(e.ino));
+
+	fi->fh = fd;
+	log_fi(fi);
+	fuse_reply_create(req, &e, fi);
+}
+
+static void bb_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	cfs_state_t *state = BB_LL_STATE(req);
+	cfs_file_t *file;
+	cfs_extent_t *ext;
+	struct fuse_bufvec *bufv;
+	size_t n_ext, i;
+	char *buf;
+	ssize_t ret;
+
+	log_msg("\nbb_ll_read(ino=%lld, size=%d, offset=%lld)\n", ino, size, offset);
+
+	file = cfs_get_file(state, fi->fh);
+	buf = malloc(size);
+	if (file == NULL || buf == NULL) {
+		free(buf);
+		fuse_reply_err(req, file ? ENOMEM : EBADF);
+		return;
+	}
+
+	// whole blocks are left in the block store and spliced from there
+	ret = cfs_file_read_extents(state, file, buf, size, offset, &ext, &n_ext);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		free(buf);
+		return;
+	}
+
+	bufv = malloc(sizeof(struct fuse_bufvec) + n_ext * sizeof(struct fuse_buf));
+	if (bufv == NULL) {
+		fuse_reply_err(req, ENOMEM);
+	} else {
+		*bufv = FUSE_BUFVEC_INIT(0);
+		for (i = 0; i < n_ext; i++) {
+			memset(&bufv->buf[i], 0, sizeof(struct fuse_buf));
+			bufv->buf[i].size = ext[i].len;
+			if (ext[i].fd >= 0) {
+				bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				bufv->buf[i].fd = ext[i].fd;
+				bufv->buf[i].pos = ext[i].pos;
+			} else {
+				bufv->buf[i].mem = ext[i].mem;
+			}
+		}
+		bufv->count = n_ext;
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+		free(bufv);
+	}
+
+	// the reply is sent, the descriptors and the pin on the blocks can go
+	cfs_extents_release(state, file, ext, n_ext);
+	free(buf);
+}
+
+static void bb_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+	cfs_file_t *file;
+	ssize_t ret;
+
+	log_msg("\nbb_ll_write_buf(ino=%lld, size=%d, offset=%lld)\n", ino, dst.buf[0].size, offset);
+
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file == NULL) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	if (in_buf->count == 1 && in_buf->idx == 0 && in_buf->off == 0 &&
+		!(in_buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		// hashed straight from the request buffer
+		ret = cfs_file_write(BB_LL_STATE(req), file, in_buf->buf[0].mem, in_buf->buf[0].size, offset);
+	} else {
+		// spliced in from /dev/fuse, it has to be in memory to be hashed
+		dst.buf[0].mem = malloc(dst.buf[0].size);
+		if (dst.buf[0].mem == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		ret = fuse_buf_copy(&dst, in_buf, 0);
+		if (ret >= 0)
+			ret = cfs_file_write(BB_LL_STATE(req), file, dst.buf[0].mem, ret, offset);
+		free(dst.buf[0].mem);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void bb_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+
+	log_msg("\nbb_ll_flush(ino=%lld)\n", ino);
+
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file && cfs_file_flush(BB_LL_STATE(req), file) < 0)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_err(req, 0);
+}
+
+static void bb_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_msg("\nbb_ll_release(ino=%lld)\n", ino);
+	log_fi(fi);
+
+	cfs_release_file(BB_LL_STATE(req), fi->fh);
+	log_syscall("close", close(fi->fh), 0);
+
+	// writes through this handle went through the kernel's cache too
+	if (BB_LL_DATA(req)->kernel_cache)
+		bb_ll_cache_update(bb_ll_inode(ino));
+	fuse_reply_err(req, 0);
+}
+
+static void bb_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+	int ret;
+
+	log_msg("\nbb_ll_fsync(ino=%lld, datasync=%d)\n", ino, datasync);
+
+	// every block of the file must be stored, mapped and on disk before its map
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file && cfs_file_fsync(BB_LL_STATE(req), file) < 0) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
+
+#ifdef HAVE_FDATASYNC
+	if (datasync)
+		ret = log_syscall("fdatasync", fdatasync(fi->fh), 0);
+	else
+#endif
+		ret = log_syscall("fsync", fsync(fi->fh), 0);
+	fuse_reply_err(req, -ret);
+}
+
+static void bb_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+			   off_t length, struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+	int ret;
+
+	log_msg("\nbb_ll_fallocate(ino=%lld, mode=0x%x, offset=%lld, length=%lld)\n",
+		ino, mode, offset, length);
+
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file == NULL) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	// holes and zeroed ranges are edits of the block map, no zeroes are stored
+	ret = cfs_file_fallocate(BB_LL_STATE(req), file, mode, offset, length);
+	fuse_reply_err(req, -ret);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void bb_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			struct fuse_file_info *fi)
+{
+	cfs_file_t *file;
+	off_t ret;
+
+	log_msg("\nbb_ll_lseek(ino=%lld, off=%lld, whence=%d)\n", ino, off, whence);
+
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file == NULL) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	// holes are the blocks missing from the block map
+	ret = cfs_file_seek(BB_LL_STATE(req), file, off, whence);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_lseek(req, ret);
+}
+#endif
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+static void bb_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+				  struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+				  struct fuse_file_info *fi_out, size_t len, int flags)
+{
+	cfs_file_t *src, *dst;
+	ssize_t ret;
+
+	log_msg("\nbb_ll_copy_file_range(ino_in=%lld, off_in=%lld, ino_out=%lld, off_out=%lld, len=%lld)\n",
+		ino_in, off_in, ino_out, off_out, (long long) len);
+
+	src = cfs_get_file(BB_LL_STATE(req), fi_in->fh);
+	dst = cfs_get_file(BB_LL_STATE(req), fi_out->fh);
+	if (src == NULL || dst == NULL) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	// whole blocks are shared, not copied
+	ret = cfs_file_copy_range(BB_LL_STATE(req), src, off_in, dst, off_out, min(len, BB_COPY_MAX));
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+#endif
+
+// CFS_IOC_CLONE on a file makes it a copy of the file named in the
+// argument, relative to the mount point, sharing all of its blocks.
+// The caller invalidates what the kernel caches of the file once the
+// ioctl has been answered.
+static int bb_ll_clone(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+		       const cfs_clone_arg_t *clone)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	char path[PATH_MAX];
+	cfs_file_t *file;
+	int ret;
+
+	file = cfs_get_file(BB_LL_STATE(req), fi->fh);
+	if (file == NULL)
+		return -EBADF;
+
+	if (strlen(BB_LL_DATA(req)->rootdir) + strlen(clone->path) + 2 > PATH_MAX)
+		return -ENAMETOOLONG;
+	strcpy(path, BB_LL_DATA(req)->rootdir);
+	strcat(path, "/");
+	strcat(path, clone->path);
+
+	ret = cfs_clone(BB_LL_STATE(req), path, file, ctx->uid, ctx->gid);
+	if (ret == 0 && BB_LL_DATA(req)->kernel_cache)
+		bb_ll_cache_update(bb_ll_inode(ino));
+
+	return ret;
+}
+
+static void bb_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned flags,
+			const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+	const cfs_clone_arg_t *clone = in_buf;
+	const cfs_snapshot_arg_t *snap = in_buf;
+	cfs_map_arg_t *map = NULL;
+	cfs_file_t *file;
+	char path[PATH_MAX];
+	int ret;
+
+	log_msg("\nbb_ll_ioctl(ino=%lld, cmd=0x%x)\n", ino, cmd);
+
+	switch ((unsigned) cmd) {
+	case CFS_IOC_CLONE:
+		if (flags & FUSE_IOCTL_DIR)
+			ret = -EISDIR;
+		else if (in_bufsz < sizeof(cfs_clone_arg_t) || memchr(clone->path, '\0', PATH_MAX) == NULL)
+			ret = -EINVAL;
+		else
+			ret = bb_ll_clone(req, ino, fi, clone);
+		break;
+
+	// on a directory, snapshot the tree under it, or delete a snapshot
+	case CFS_IOC_SNAPSHOT:
+	case CFS_IOC_SNAPSHOT_DELETE:
+		if (in_bufsz < sizeof(cfs_snapshot_arg_t) || memchr(snap->name, '\0', sizeof(snap->name)) == NULL)
+			ret = -EINVAL;
+		else if ((unsigned) cmd == CFS_IOC_SNAPSHOT_DELETE)
+			ret = snapshot_delete(BB_LL_STATE(req), snap->name, ctx->uid);
+		else if ((ret = bb_ll_path(bb_ll_inode(ino)->fd, path)) == 0)
+			ret = snapshot_create(BB_LL_STATE(req), path, snap->name, ctx->uid);
+		break;
+
+	// on a file, list where its blocks are mapped
+	case CFS_IOC_MAP:
+		file = (flags & FUSE_IOCTL_DIR) ? NULL : cfs_get_file(BB_LL_STATE(req), fi->fh);
+		if (file == NULL)
+			ret = (flags & FUSE_IOCTL_DIR) ? -EISDIR : -EBADF;
+		else if (in_bufsz < sizeof(cfs_map_arg_t) || out_bufsz < sizeof(cfs_map_arg_t))
+			ret = -EINVAL;
+		else if ((map = malloc(sizeof(cfs_map_arg_t))) == NULL)
+			ret = -ENOMEM;
+		else {
+			memcpy(map, in_buf, sizeof(cfs_map_arg_t));
+			ret = cfs_file_map(BB_LL_STATE(req), file, map);
+		}
+		break;
+
+	default:
+		ret = -ENOTTY;
+	}
+
+	// the clone replaced the whole file, the size the kernel holds must
+	// be gone before the caller can stat or read it again
+	if ((unsigned) cmd == CFS_IOC_CLONE && ret == 0) {
+		log_msg("    bb_ll_ioctl:  inode %lld cloned over, invalidating\n", ino);
+		fuse_lowlevel_notify_inval_inode(session, ino, -1, 0);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (map)
+		fuse_reply_ioctl(req, 0, map, sizeof(cfs_map_arg_t));
+	else
+		fuse_reply_ioctl(req, 0, NULL, 0);
+	free(map);
+
+	// so are its pages whether or not the kernel keeps them across opens,
+	// dropping those waits on page locks, safe now that it is answered
+	if ((unsigned) cmd == CFS_IOC_CLONE && ret == 0)
+		fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+}
+
+static void bb_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	bb_dir_t *d;
+	int fd;
+
+	log_msg("\nbb_ll_opendir(ino=%lld)\n", ino);
+
+	d = calloc(1, sizeof(bb_dir_t));
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(bb_ll_inode(ino)->fd, ".", O_RDONLY);
+	if (fd < 0 || (d->dp = fdopendir(fd)) == NULL) {
+		fuse_reply_err(req, errno);
+		if (fd >= 0)
+			close(fd);
+		free(d);
+		return;
+	}
+
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+// Fill a reply of up to *size* bytes with the entries from *offset* on.
+// With *plus* every entry carries its attributes and a lookup reference,
+// so the kernel needs no lookup or getattr per file afterwards.
+static void bb_ll_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			     struct fuse_file_info *fi, int plus)
+{
+	bb_dir_t *d = (bb_dir_t *) (uintptr_t) fi->fh;
+	struct fuse_entry_param e;
+	struct stat st;
+	char dirpath[PATH_MAX];
+	char *buf, *p;
+	const char *name;
+	size_t left = size, entsize;
+	off_t next;
+
+	log_msg("\nbb_ll_readdir%s(ino=%lld, size=%d, offset=%lld)\n", plus ? "plus" : "", ino, size, offset);
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	p = buf;
+
+	// one path lookup for the whole buffer, the entries are resolved under it
+	if (plus && bb_ll_path(bb_ll_inode(ino)->fd, dirpath) < 0)
+		plus = 0;
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	while (1) {
+		if (d->entry == NULL) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL) {
+				if (errno && left == size) {
+					fuse_reply_err(req, errno);
+					free(buf);
+					return;
+				}
+				break;
+			}
+		}
+		next = d->entry->d_off;
+		name = d->entry->d_name;
+
+		if (d->entry->d_ino == BB_LL_STATE(req)->storage->ino &&
+			fstatat(dirfd(d->dp), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			is_block_store(BB_LL_STATE(req)->storage, &st)) {
+			log_msg("     Ignoring BLOCKS directory %s\n", name);
+		} else {
+			// "." and "..", or an entry gone since, go without attributes
+			if (!plus || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+				bb_ll_do_lookup(req, ino, dirpath, name, &e) != 0) {
+				memset(&e, 0, sizeof(e));
+				e.attr.st_ino = d->entry->d_ino;
+				e.attr.st_mode = d->entry->d_type << 12;
+			}
+
+			if (plus)
+				entsize = fuse_add_direntry_plus(req, p, left, name, &e, next);
+			else
+				entsize = fuse_add_direntry(req, p, left, name, &e.attr, next);
+			if (entsize > left) {
+				// not sent, so the kernel won't forget it
+				if (e.ino)
+					bb_ll_put_inode(bb_ll_inode(e.ino), 1);
+				break;
+			}
+			p += entsize;
+			left -= entsize;
+		}
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	fuse_reply_buf(req, buf, size - left);
+	free(buf);
+}
+
+static void bb_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	bb_ll_do_readdir(req, ino, size, offset, fi, 0);
+}
+
+static void bb_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			      struct fuse_file_info *fi)
+{
+	bb_ll_do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void bb_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	bb_dir_t *d = (bb_dir_t *) (uintptr_t) fi->fh;
+
+	log_msg("\nbb_ll_releasedir(ino=%lld)\n", ino);
+
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void bb_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	log_msg("\nbb_ll_fsyncdir(ino=%lld, datasync=%d)\n", ino, datasync);
+
+	fuse_reply_err(req, 0);
+}
+
+static void bb_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs statv;
+
+	log_msg("\nbb_ll_statfs(ino=%lld)\n", ino);
+
+	if (fstatvfs(bb_ll_inode(ino)->fd, &statv) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	log_statvfs(&statv);
+	fuse_reply_statfs(req, &statv);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static void bb_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	char proc[64];
+	int ret;
+
+	log_msg("\nbb_ll_setxattr(ino=%lld, name=\"%s\", size=%d)\n", ino, name, size);
+	bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+
+	if (bb_ll_inode(ino)->readonly)
+		ret = -EROFS;
+	else
+		ret = log_syscall("setxattr", setxattr(proc, name, value, size, flags), 0);
+	fuse_reply_err(req, -ret);
+}
+
+static void bb_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	char proc[64];
+	char *value = NULL;
+	ssize_t ret;
+
+	log_msg("\nbb_ll_getxattr(ino=%lld, name=\"%s\", size=%d)\n", ino, name, size);
+
+	if (size) {
+		value = malloc(size);
+		if (value == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	// CFS counters can be read from any inode, they are not stored anywhere
+	if (strcmp(name, CFS_XATTR_STATS) == 0) {
+		char stats[4096];
+		ret = cfs_stats(BB_LL_STATE(req), stats, sizeof(stats));
+		if (size && ret <= size)
+			memcpy(value, stats, ret);
+	} else {
+		bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+		ret = log_syscall("getxattr", getxattr(proc, name, value, size), 0);
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size == 0)
+		fuse_reply_xattr(req, ret);
+	else if (ret > size)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, value, ret);
+	free(value);
+}
+
+static void bb_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char proc[64];
+	char *list = NULL;
+	ssize_t ret;
+
+	log_msg("\nbb_ll_listxattr(ino=%lld, size=%d)\n", ino, size);
+	bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+
+	if (size) {
+		list = malloc(size);
+		if (list == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	ret = log_syscall("listxattr", listxattr(proc, list, size), 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size == 0)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, list, ret);
+	free(list);
+}
+
+static void bb_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	char proc[64];
+	int ret;
+
+	log_msg("\nbb_ll_removexattr(ino=%lld, name=\"%s\")\n", ino, name);
+	bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+
+	if (bb_ll_inode(ino)->readonly)
+		ret = -EROFS;
+	else
+		ret = log_syscall("removexattr", removexattr(proc, name), 0);
+	fuse_reply_err(req, -ret);
+}
+#endif
+
+static void bb_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char proc[64];
+	int ret;
+
+	log_msg("\nbb_ll_access(ino=%lld, mask=0%o)\n", ino, mask);
+	bb_ll_proc_path(proc, bb_ll_inode(ino)->fd);
+
+	ret = access(proc, mask);
+	if (ret < 0)
+		ret = log_error("bb_ll_access access");
+	fuse_reply_err(req, -ret);
+}
+
+static void bb_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct bb_state *bb = (struct bb_state *) userdata;
+
+	log_msg("\nbb_ll_init()\n");
+	log_conn(conn);
+
+	// the session loop runs after fuse_daemonize(), threads are safe here
+	if (cfs_init(bb->cfs_state, bb->rootdir, &bb->config) < 0) {
+		fprintf(stderr, "CFS: init failed\n");
+		abort();
+	}
+
+	// bb_ll_read() replies with block store descriptors, splice them
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+	// open(O_TRUNC) as one request, bb_ll_register() cuts the block map
+	if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+		conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+	// listings carry the CFS sizes, no getattr round trip per file.
+	// READDIRPLUS_AUTO, on by default, still lets the kernel pick.
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+
+	// whole writes are registered as one batch, so ask for large ones.
+	// libfuse derives max_pages from this and clamps it to its buffer.
+	conn->max_write = BB_MAX_WRITE;
+}
+
+static void bb_ll_destroy(void *userdata)
+{
+	log_msg("\nbb_ll_destroy(userdata=0x%08x)\n", userdata);
+
+	// drains whatever is still staged
+	cfs_destroy(((struct bb_state *) userdata)->cfs_state);
+}
+
+static const struct fuse_lowlevel_ops bb_ll_oper = {
+	.init = bb_ll_init,
+	.destroy = bb_ll_destroy,
+	.lookup = bb_ll_lookup,
+	.forget = bb_ll_forget,
+	.forget_multi = bb_ll_forget_multi,
+	.getattr = bb_ll_getattr,
+	.setattr = bb_ll_setattr,
+	.readlink = bb_ll_readlink,
+	.mknod = bb_ll_mknod,
+	.mkdir = bb_ll_mkdir,
+	.unlink = bb_ll_unlink,
+	.rmdir = bb_ll_rmdir,
+	.symlink = bb_ll_symlink,
+	.rename = bb_ll_rename,
+	.link = bb_ll_link,
+	.open = bb_ll_open,
+	.create = bb_ll_create,
+	.read = bb_ll_read,
+	.write_buf = bb_ll_write_buf,
+	.flush = bb_ll_flush,
+	.release = bb_ll_release,
+	.fsync = bb_ll_fsync,
+	.fallocate = bb_ll_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 4)
+	.copy_file_range = bb_ll_copy_file_range,
+#endif
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	.lseek = bb_ll_lseek,
+#endif
+	.ioctl = bb_ll_ioctl,
+	.opendir = bb_ll_opendir,
+	.readdir = bb_ll_readdir,
+	.readdirplus = bb_ll_readdirplus,
+	.releasedir = bb_ll_releasedir,
+	.fsyncdir = bb_ll_fsyncdir,
+	.statfs = bb_ll_statfs,
+#ifdef HAVE_SYS_XATTR_H
+	.setxattr = bb_ll_setxattr,
+	.getxattr = bb_ll_getxattr,
+	.listxattr = bb_ll_listxattr,
+	.removexattr = bb_ll_removexattr,
+#endif
+	.access = bb_ll_access,
+};
+
+static struct fuse_opt bb_ll_opts[] = {
+	BB_CFS_OPTS,
+	BB_OPT("entry_timeout=%lf", entry_timeout, 0),
+	BB_OPT("attr_timeout=%lf", attr_timeout, 0),
+	BB_OPT("kernel_cache", kernel_cache, 1),
+	FUSE_OPT_END
+};
+
+static void bb_ll_usage(void)
+{
+	fprintf(stderr, "usage:  bbfs3 [FUSE and mount options] rootDir mountPoint\n");
+	fprintf(stderr, BB_CFS_USAGE
+		"    -o entry_timeout=T       seconds the kernel caches names (default 1.0)\n"
+		"    -o attr_timeout=T        seconds the kernel caches attributes (default 1.0)\n"
+		"    -o kernel_cache          keep file pages cached between opens until the file changes\n");
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+	exit(1);
+}
+
+// Set up the inode table, rooted at *rootdir*
+static int bb_ll_init_inodes(const char *rootdir)
+{
+	struct stat st;
+
+	inodes.root.fd = open(rootdir, O_PATH);
+	if (inodes.root.fd < 0 || fstat(inodes.root.fd, &st) < 0) {
+		perror("bbfs3: open root directory");
+		return -1;
+	}
+	inodes.root.dev = st.st_dev;
+	inodes.root.ino = st.st_ino;
+	inodes.root.nlookup = 2;
+
+	inodes.n_buckets = BB_LL_BUCKETS;
+	inodes.buckets = calloc(inodes.n_buckets, sizeof(bb_inode_t *));
+	if (inodes.buckets == NULL)
+		return -1;
+	pthread_mutex_init(&inodes.lock, NULL);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args;
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	struct bb_state *bb_data;
+	char *blocks;
+	int ret = 1;
+
+	// see bbfs.c, the same holes are open here
+	if ((getuid() == 0) || (geteuid() == 0)) {
+		fprintf(stderr, "Running BBFS as root opens unnacceptable security holes\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Fuse library version %d.%d, low-level API\n", FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
+
+	if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
+		bb_ll_usage();
+
+	bb_data = calloc(1, sizeof(struct bb_state));
+	if (bb_data == NULL) {
+		perror("main calloc");
+		abort();
+	}
+
+	// Pull the rootdir out of the argument list, fuse only gets the mountpoint
+	bb_data->rootdir = realpath(argv[argc-2], NULL);
+	if (bb_data->rootdir == NULL) {
+		fprintf(stderr, "\n    ERROR: Bad root directory %s\n", argv[argc-2]);
+		return 1;
+	}
+	argv[argc-2] = argv[argc-1];
+	argv[argc-1] = NULL;
+	argc--;
+
+	bb_data->logfile = log_open();
+
+	args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+	cfs_default_config(&bb_data->config);
+	bb_data->entry_timeout = BB_LL_TIMEOUT;
+	bb_data->attr_timeout = BB_LL_TIMEOUT;
+	if (fuse_opt_parse(&args, bb_data, bb_ll_opts, NULL) == -1)
+		bb_ll_usage();
+
+	// the daemon runs from /, so the block store needs an absolute path
+	if (bb_data->config.blocks_dir) {
+		mkdir(bb_data->config.blocks_dir, 0700);
+		blocks = realpath(bb_data->config.blocks_dir, NULL);
+		if (blocks == NULL) {
+			fprintf(stderr, "\n    ERROR: Bad blocks directory %s\n", bb_data->config.blocks_dir);
+			return 1;
+		}
+		free(bb_data->config.blocks_dir);
+		bb_data->config.blocks_dir = blocks;
+	}
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if (opts.show_help || opts.mountpoint == NULL)
+		bb_ll_usage();
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		return 0;
+	}
+
+	if (bb_ll_init_inodes(bb_data->rootdir) < 0)
+		return 1;
+
+	// cfs itself is initialised in bb_ll_init()
+	bb_data->cfs_state = malloc(sizeof(cfs_state_t));
+
+	se = fuse_session_new(&args, &bb_ll_oper, sizeof(bb_ll_oper), bb_data);
+	if (se == NULL)
+		goto out;
+	session = se;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+	fprintf(stderr, "fuse session loop returned %d\n", ret);
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+/*
+    Block buffers.
+
+    Every block held in memory, staged, prefetched or partially written, lives
+    in a page aligned buffer from one pool, so it can be handed from one
+    stage to the next and read or written with O_DIRECT. Buffers are carved
+    from 2MiB mappings, backed by huge pages when asked for and available,
+    and go back on a free list when released.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buffers.h"
+#include "storage.h"
+#include "util.h"
+#include "log.h"
+
+
+/*
+    Map one more chunk and put its buffers on the free list.
+    Called with the pool lock held.
+*/
+static int buffers_grow(cfs_buffers_t* bufs)
+{
+    cfs_free_buffer_t* buffer;
+    void** grown;
+    char* chunk = MAP_FAILED;
+    size_t i;
+
+    if (bufs->n_chunks == bufs->chunks_cap) {
+        grown = realloc(bufs->chunks, max(bufs->chunks_cap * 2, (size_t)16) * sizeof(void*));
+        if (grown == NULL) {
+            return -1;
+        }
+        bufs->chunks = grown;
+        bufs->chunks_cap = max(bufs->chunks_cap * 2, (size_t)16);
+    }
+
+#ifdef MAP_HUGETLB
+    if (bufs->huge) {
+        chunk = mmap(NULL, CFS_BUFFER_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk == MAP_FAILED) {
+            log_msg("\n CFS: No huge pages left, block buffers use normal ones\n");
+            bufs->huge = 0;
+        } else {
+            bufs->huge_chunks++;
+        }
+    }
+#endif
+    if (chunk == MAP_FAILED) {
+        chunk = mmap(NULL, CFS_BUFFER_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            log_error("CFS: Cannot map block buffers");
+            return -1;
+        }
+    }
+    bufs->chunks[bufs->n_chunks++] = chunk;
+
+    for (i=0; i<CFS_BUFFER_CHUNK / BLOCK_SIZE; i++) {
+        buffer = (cfs_free_buffer_t*)(chunk + i * BLOCK_SIZE);
+        buffer->next = bufs->free;
+        bufs->free = buffer;
+    }
+
+    return 0;
+}
+
+
+void buffers_init(cfs_buffers_t* bufs, const int huge)
+{
+    memset(bufs, 0, sizeof(*bufs));
+    bufs->huge = huge;
+    pthread_mutex_init(&bufs->lock, NULL);
+}
+
+
+/*
+    Unmap every chunk, the buffers must all have been put back.
+*/
+void buffers_destroy(cfs_buffers_t* bufs)
+{
+    size_t i;
+
+    if (bufs->in_use > 0) {
+        log_msg("\n CFS: %zu block buffers still in use\n", bufs->in_use);
+    }
+    for (i=0; i<bufs->n_chunks; i++) {
+        munmap(bufs->chunks[i], CFS_BUFFER_CHUNK);
+    }
+    free(bufs->chunks);
+    pthread_mutex_destroy(&bufs->lock);
+}
+
+
+/*
+    A BLOCK_SIZE buffer, aligned to BLOCK_SIZE. Its contents are undefined.
+    Returns NULL when no memory is left.
+*/
+char* buffers_get(cfs_buffers_t* bufs)
+{
+    cfs_free_buffer_t* buffer = NULL;
+
+    pthread_mutex_lock(&bufs->lock);
+    if (bufs->free || buffers_grow(bufs) == 0) {
+        buffer = bufs->free;
+        bufs->free = buffer->next;
+        bufs->in_use++;
+    }
+    pthread_mutex_unlock(&bufs->lock);
+
+    return (char*)buffer;
+}
+
+
+/*
+    Give back a buffer from buffers_get(), NULL is ignored.
+*/
+void buffers_put(cfs_buffers_t* bufs, char* data)
+{
+    cfs_free_buffer_t* buffer = (cfs_free_buffer_t*)data;
+
+    if (buffer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&bufs->lock);
+    buffer->next = bufs->free;
+    bufs->free = buffer;
+    bufs->in_use--;
+    pthread_mutex_unlock(&bufs->lock);
+}
+
+
+int buffers_stats(cfs_buffers_t* bufs, char* buf, size_t size)
+{
+    size_t in_use, n_chunks, huge_chunks;
+
+    pthread_mutex_lock(&bufs->lock);
+    in_use = bufs->in_use;
+    n_chunks = bufs->n_chunks;
+    huge_chunks = bufs->huge_chunks;
+    pthread_mutex_unlock(&bufs->lock);
+
+    return snprintf(buf, size,
+        "buffers_in_use %zu\n"
+        "buffers_mapped_bytes %zu\n"
+        "buffers_huge_bytes %zu\n",
+        in_use, n_chunks * CFS_BUFFER_CHUNK, huge_chunks * CFS_BUFFER_CHUNK);
+}
@@ -0,0 +1,36 @@
+#ifndef __CFS_BUFFERS__
+#define __CFS_BUFFERS__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define CFS_BUFFER_CHUNK (2 * 1024 * 1024) /* mapped at a time, one huge page */
+
+/* A free buffer, linked through its own data */
+typedef struct cfs_free_buffer {
+    struct cfs_free_buffer* next;
+} cfs_free_buffer_t;
+
+/*
+    Page aligned BLOCK_SIZE buffers, carved from CFS_BUFFER_CHUNK mappings
+    that stay until the pool is destroyed. A buffer belongs to whoever got
+    it, blocks trade them instead of copying their data.
+*/
+typedef struct {
+    cfs_free_buffer_t* free;
+    void** chunks;
+    size_t n_chunks;
+    size_t chunks_cap;
+    size_t huge_chunks; /* of n_chunks, backed by huge pages */
+    size_t in_use;
+    int huge; /* try huge pages first */
+    pthread_mutex_t lock;
+} cfs_buffers_t;
+
+void buffers_init(cfs_buffers_t* bufs, const int huge);
+void buffers_destroy(cfs_buffers_t* bufs);
+char* buffers_get(cfs_buffers_t* bufs);
+void buffers_put(cfs_buffers_t* bufs, char* data);
+int buffers_stats(cfs_buffers_t* bufs, char* buf, size_t size);
+
+#endif
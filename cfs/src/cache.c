@@ -0,0 +1,187 @@
+/*
+    Block cache of a direct store.
+
+    With O_DIRECT the page cache no longer holds the block store, so hot
+    blocks are kept here instead, once, in buffers of the block pool. Blocks
+    are looked up by hash through chained buckets and evicted with a clock
+    hand over the entries.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "storage.h"
+#include "util.h"
+#include "log.h"
+
+
+int cache_init(cfs_cache_t* cache, cfs_buffers_t* buffers, const size_t cap)
+{
+    size_t n_buckets = 1, i;
+
+    // hashes are uniform, their first bytes pick the bucket
+    while (n_buckets < cap) {
+        n_buckets *= 2;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->buffers = buffers;
+    cache->cap = cap;
+    cache->mask = n_buckets - 1;
+    cache->entries = calloc(cap, sizeof(cfs_cache_entry_t));
+    cache->buckets = malloc(n_buckets * sizeof(ssize_t));
+    if (cache->entries == NULL || cache->buckets == NULL) {
+        free(cache->entries);
+        free(cache->buckets);
+        return -1;
+    }
+    for (i=0; i<n_buckets; i++) {
+        cache->buckets[i] = -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return 0;
+}
+
+
+void cache_destroy(cfs_cache_t* cache)
+{
+    size_t i;
+
+    for (i=0; i<cache->used; i++) {
+        buffers_put(cache->buffers, cache->entries[i].data);
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+
+static ssize_t* cache_bucket(cfs_cache_t* cache, const unsigned char* hash)
+{
+    size_t key;
+
+    memcpy(&key, hash, sizeof(key));
+    return &cache->buckets[key & cache->mask];
+}
+
+
+/*
+    Entry holding *hash*, or -1. Called with the cache lock held.
+*/
+static ssize_t cache_find(cfs_cache_t* cache, const unsigned char* hash)
+{
+    ssize_t i;
+
+    for (i=*cache_bucket(cache, hash); i >= 0; i=cache->entries[i].next) {
+        if (memcmp(cache->entries[i].hash, hash, HASH_LENGTH) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+    Copy *len* bytes at *offset* of block *hash* to *dst* if it is cached,
+    past the end of the block reads as zeroes.
+    Returns 1 on a hit, 0 when the block has to be loaded.
+*/
+int cache_copy(cfs_cache_t* cache, const unsigned char* hash, char* dst, const off_t offset, const size_t len)
+{
+    cfs_cache_entry_t* entry;
+    size_t avail;
+    ssize_t i;
+
+    pthread_mutex_lock(&cache->lock);
+    i = cache_find(cache, hash);
+    if (i < 0) {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    entry = &cache->entries[i];
+    entry->referenced = 1;
+    avail = entry->size > offset ? min(entry->size - offset, len) : 0;
+    memcpy(dst, entry->data + offset, avail);
+    memset(dst + avail, '\0', len - avail);
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return 1;
+}
+
+
+/*
+    Keep the *size* bytes of block *hash* that *data* points to. The cache
+    takes over the buffer and leaves the one of an evicted block, or NULL,
+    in its place for the caller to put back. A block already cached is left
+    alone, *data* then stays the caller's.
+*/
+void cache_insert(cfs_cache_t* cache, const unsigned char* hash, char** data, const size_t size)
+{
+    cfs_cache_entry_t* entry;
+    ssize_t* link;
+    char* victim = NULL;
+    ssize_t i;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache_find(cache, hash) >= 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    if (cache->used < cache->cap) {
+        i = cache->used++;
+    } else {
+        // second chance: referenced entries are passed over once
+        while (cache->entries[cache->hand].referenced) {
+            cache->entries[cache->hand].referenced = 0;
+            cache->hand = (cache->hand + 1) % cache->cap;
+        }
+        i = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->cap;
+
+        link = cache_bucket(cache, cache->entries[i].hash);
+        while (*link != i) {
+            link = &cache->entries[*link].next;
+        }
+        *link = cache->entries[i].next;
+        victim = cache->entries[i].data;
+        cache->evictions++;
+    }
+
+    entry = &cache->entries[i];
+    memcpy(entry->hash, hash, HASH_LENGTH);
+    entry->data = *data;
+    entry->size = size;
+    entry->referenced = 0;
+    link = cache_bucket(cache, hash);
+    entry->next = *link;
+    *link = i;
+    pthread_mutex_unlock(&cache->lock);
+
+    *data = victim;
+}
+
+
+int cache_stats(cfs_cache_t* cache, char* buf, size_t size)
+{
+    int ret;
+
+    pthread_mutex_lock(&cache->lock);
+    ret = snprintf(buf, size,
+        "block_cache_blocks %zu\n"
+        "block_cache_hits %zu\n"
+        "block_cache_misses %zu\n"
+        "block_cache_evictions %zu\n",
+        cache->used, cache->hits, cache->misses, cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
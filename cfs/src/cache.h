@@ -0,0 +1,48 @@
+#ifndef __CFS_CACHE__
+#define __CFS_CACHE__
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "buffers.h"
+#include "util.h"
+
+#define CFS_BLOCK_CACHE 16384 /* blocks a direct store keeps in memory, 64MiB */
+
+typedef struct {
+    unsigned char hash[HASH_LENGTH];
+    char* data; /* a buffer of the pool, NULL while the entry is unused */
+    size_t size;
+    int referenced; /* hit since the clock hand last passed */
+    ssize_t next; /* entry in the same bucket, -1 ends the chain */
+} cfs_cache_entry_t;
+
+/*
+    Stored blocks kept in memory by hash, for a store read with O_DIRECT.
+    Stored data never changes, so entries never go stale.
+    Eviction is CLOCK, with new entries starting unreferenced: a block a scan
+    read once is the first to go, blocks hit again survive the scan.
+*/
+typedef struct {
+    cfs_buffers_t* buffers;
+    cfs_cache_entry_t* entries;
+    ssize_t* buckets; /* first entry of each chain, -1 when empty */
+    size_t mask; /* of buckets */
+    size_t cap;
+    size_t used; /* entries holding a block, the first ones */
+    size_t hand;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    pthread_mutex_t lock;
+} cfs_cache_t;
+
+int cache_init(cfs_cache_t* cache, cfs_buffers_t* buffers, const size_t cap);
+void cache_destroy(cfs_cache_t* cache);
+int cache_copy(cfs_cache_t* cache, const unsigned char* hash, char* dst, const off_t offset, const size_t len);
+void cache_insert(cfs_cache_t* cache, const unsigned char* hash, char** data, const size_t size);
+int cache_stats(cfs_cache_t* cache, char* buf, size_t size);
+
+#endif
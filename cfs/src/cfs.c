@@ -7,35 +7,89 @@ off_t file_size
 off_t total_blocks
 
 off_t block_index - (20) hash  X total_blocks times
+inline data of the one block marked so, if any
 -----------------
 
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <linux/limits.h>
+#include <linux/falloc.h>
 #include <pthread.h>
 
 #include <fuse.h>
 
 #include "cfs.h"
+#include "pipeline.h"
+#include "dedup.h"
+#include "readahead.h"
 #include "storage.h"
 #include "io.h"
 #include "util.h"
 #include "log.h"
 
+static cfs_file_t* cfs_find_file(cfs_state_t* state, const struct stat* st);
+static int cfs_put_file(cfs_state_t* state, cfs_file_t* file);
+static int cfs_put_file_locked(cfs_state_t* state, cfs_file_t* file);
+static int cfs_register(cfs_state_t* state, const char* path, const int fd, const int fresh);
+static int cfs_create(const char* path, mode_t mode, const int flags);
+static off_t cfs_file_size(const cfs_file_t* file);
+static int cfs_hash_is_staged(const unsigned char* hash);
+static size_t cfs_staged_size(const unsigned char* hash);
+static void cfs_staged_hash(unsigned char* hash, const size_t size);
+static int cfs_hash_is_inline(const unsigned char* hash);
+static size_t cfs_inline_size(const unsigned char* hash);
+static void cfs_inline_hash(unsigned char* hash, const size_t size);
+static int cfs_file_stage_fd(cfs_state_t* state, cfs_file_t* file, const int create);
+static void cfs_file_release(cfs_state_t* state, cfs_file_t* file, const unsigned char* hash);
+static void cfs_dirty_free(cfs_state_t* state, cfs_file_t* file);
+static int cfs_magic_known(const char* header);
+static int cfs_file_write_header(cfs_file_t* file);
+
+/*
+    Fill *config* with the defaults
+*/
+void cfs_default_config(cfs_config_t* config)
+{
+    config->offline = 0;
+    config->dedup_budget = CFS_DEDUP_BUDGET;
+    config->bypass_window = CFS_BYPASS_WINDOW;
+    config->bypass_sample = CFS_BYPASS_SAMPLE;
+    config->readahead = CFS_READAHEAD;
+    config->regions = 0;
+    config->stat_cache = CFS_STAT_CACHE;
+    config->inline_max = CFS_INLINE_MAX;
+    config->huge_pages = 0;
+    config->direct_store = 0;
+    config->block_cache = CFS_BLOCK_CACHE;
+    config->blocks_dir = NULL;
+}
+
 
 /*
     Initialise the CFS file system
+    A NULL *config* uses the defaults.
 */
-int cfs_init(cfs_state_t *state, const char* rootdir) {
+int cfs_init(cfs_state_t *state, const char* rootdir, const cfs_config_t* config) {
     int i;
 
+    // the front ends allocate the state uninitialised, counters start at zero
+    memset(state, 0, sizeof(*state));
     pthread_mutex_init(&state->lock, NULL);
+    state->root = strdup(rootdir);
+    if (config) {
+        state->config = *config;
+    } else {
+        cfs_default_config(&state->config);
+    }
 
     /* get the maximum number of file descriptors the systems is configured to have */
     state->max_fds = sysconf(_SC_OPEN_MAX);
@@ -44,15 +98,73 @@ int cfs_init(cfs_state_t *state, const char* rootdir) {
     }
 
     state->storage = (cfs_blk_store_t*)malloc(sizeof(cfs_blk_store_t));
-    init_storage(state->storage, rootdir);
+    if (state->storage == NULL || init_storage(state->storage, rootdir, state->config.blocks_dir) < 0) {
+        log_msg("\n CFS: Cannot open the block store\n");
+        return -1;
+    }
+    state->storage->direct = state->config.direct_store;
+    if (state->config.direct_store && !state->config.regions) {
+        log_msg("\n CFS: direct_store only applies to placement=stream\n");
+    }
+
+    if (pool_init(&state->io_pool, CFS_IO_THREADS) < 0) {
+        log_msg("\n CFS: No IO workers, reads will be serial\n");
+    }
+    if (pool_init(&state->ra_pool, CFS_PREFETCH_THREADS) < 0) {
+        log_msg("\n CFS: No prefetch workers, readahead will be synchronous\n");
+    }
+    memset(&state->bypass_stats, 0, sizeof(state->bypass_stats));
+    memset(&state->ra_stats, 0, sizeof(state->ra_stats));
+    pthread_mutex_init(&state->sync_lock, NULL);
+    buffers_init(&state->buffers, state->config.huge_pages);
+
+    state->cache = NULL;
+    if (state->config.direct_store && state->config.block_cache > 0) {
+        state->cache = malloc(sizeof(cfs_cache_t));
+        if (state->cache == NULL || cache_init(state->cache, &state->buffers, state->config.block_cache) < 0) {
+            log_msg("\n CFS: No block cache, every read of the direct store goes to disk\n");
+            free(state->cache);
+            state->cache = NULL;
+        }
+    }
+
+    pthread_mutex_init(&state->stat_lock, NULL);
+    state->stat_hits = 0;
+    state->stat_misses = 0;
+    state->stat_cache = NULL;
+    if (state->config.stat_cache > 0) {
+        state->stat_cache = calloc(state->config.stat_cache, sizeof(cfs_stat_entry_t));
+        if (state->stat_cache == NULL) {
+            log_msg("\n CFS: No stat cache, every stat will read the file header\n");
+        }
+    }
+
+    state->pipeline = malloc(sizeof(cfs_pipeline_t));
+    if (state->pipeline == NULL || pipeline_init(state->pipeline, state, CFS_STAGE_SLOTS, CFS_STAGE_WORKERS) < 0) {
+        log_msg("\n CFS: No pipeline, writes will be synchronous\n");
+        free(state->pipeline);
+        state->pipeline = NULL;
+    }
 
     /* init file state map */
-    state->files = malloc(sizeof(cfs_file_t) * FDS_STORE_INITIAL);
+    state->files = malloc(sizeof(cfs_file_t*) * FDS_STORE_INITIAL);
     state->fds = malloc(sizeof(int) * FDS_STORE_INITIAL);
     state->fds_cap = FDS_STORE_INITIAL;
     state->n_fds = 0;
+    state->open_files = NULL;
     for (i=0; i<state->fds_cap; i++) {
         state->fds[i] = -1;
+        state->files[i] = NULL;
+    }
+
+    state->dedup = NULL;
+    if (state->config.offline) {
+        state->dedup = malloc(sizeof(cfs_dedup_t));
+        if (state->dedup == NULL || dedup_init(state->dedup, state) < 0) {
+            log_msg("\n CFS: Cannot start the deduplicator\n");
+            free(state->dedup);
+            return -1;
+        }
     }
     return 0;
 }
@@ -63,43 +175,197 @@ int cfs_init(cfs_state_t *state, const char* rootdir) {
 */
 int cfs_destroy(cfs_state_t* state)
 {
+    if (state->dedup) {
+        dedup_destroy(state->dedup);
+        free(state->dedup);
+    }
+    if (state->pipeline) {
+        pipeline_destroy(state->pipeline);
+        free(state->pipeline);
+    }
+    pool_destroy(&state->io_pool);
+    pool_destroy(&state->ra_pool);
     pthread_mutex_destroy(&state->lock);
+    pthread_mutex_destroy(&state->stat_lock);
+    pthread_mutex_destroy(&state->sync_lock);
+    free(state->stat_cache);
     free(state->files);
     free(state->fds);
+    free(state->root);
     destroy_storage(state->storage);
+    if (state->cache) {
+        cache_destroy(state->cache);
+        free(state->cache);
+    }
+    buffers_destroy(&state->buffers);
+}
+
+
+/*
+    Stat cache entry the file with block map *st* would be kept in.
+    Caller must hold the stat lock.
+*/
+static cfs_stat_entry_t* cfs_stat_slot(cfs_state_t* state, const struct stat* st)
+{
+    return &state->stat_cache[(st->st_ino ^ st->st_dev * 31) % state->config.stat_cache];
+}
+
+
+/*
+    Remember the logical size of the closed file with block map *st*.
+*/
+static void cfs_stat_remember(cfs_state_t* state, const struct stat* st, const off_t size, const off_t total_blocks)
+{
+    cfs_stat_entry_t* entry;
+
+    if (state->stat_cache == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&state->stat_lock);
+    entry = cfs_stat_slot(state, st);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->map_size = st->st_size;
+    entry->size = size;
+    entry->total_blocks = total_blocks;
+    pthread_mutex_unlock(&state->stat_lock);
+}
+
+
+/*
+    Forget the size of the file with block map *st*, before it is unlinked,
+    replaced or truncated.
+    A changed block map never matches its entry anyway, this only keeps a
+    reused inode from being looked up at all.
+*/
+void cfs_stat_forget(cfs_state_t* state, const struct stat* st)
+{
+    cfs_stat_entry_t* entry;
+
+    if (state->stat_cache == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&state->stat_lock);
+    entry = cfs_stat_slot(state, st);
+    if (entry->ino == st->st_ino && entry->dev == st->st_dev) {
+        entry->ino = 0;
+    }
+    pthread_mutex_unlock(&state->stat_lock);
+}
+
+
+/*
+    Drop the staging extent of the file with block map *st*, now that one of
+    its links was removed, if that was the last one. An open file keeps it
+    until its last handle is released.
+*/
+void cfs_unlinked(cfs_state_t* state, const struct stat* st)
+{
+    cfs_file_t* file;
+
+    if (!S_ISREG(st->st_mode) || st->st_nlink != 1) {
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    file = cfs_find_file(state, st);
+    if (file) {
+        file->unlinked = 1;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (file == NULL) {
+        remove_staging(state->storage, st->st_ino);
+    }
+}
+
+
+/*
+    Whether *header* starts with a magic this build reads.
+*/
+static int cfs_magic_known(const char* header)
+{
+    return memcmp(header, MAGIC, sizeof(MAGIC)) == 0 || memcmp(header, MAGIC_V1, sizeof(MAGIC_V1)) == 0;
 }
 
 
 /*
     Stat a CFS file.
-    Path must contain root.
+    Path must contain root, *st* is what lstat() returned for it.
+    Returns 1 with the logical size in *stat_buf*, 0 if it is no CFS file,
+    -1 on error.
 */
-int cfs_file_stat(cfs_state_t* state, const char* path, cfs_file_t* stat_buf)
+int cfs_file_stat(cfs_state_t* state, const char* path, const struct stat* st, cfs_file_t* stat_buf)
 {
-    int fd, ret=0;
-    char magic_buff[sizeof(MAGIC) + 1];
+    int fd, hit = 0;
+    char header[BLOCK_START];
     ssize_t total;
+    cfs_file_t* file;
+    cfs_stat_entry_t* entry;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        return -1;
+    if (!S_ISREG(st->st_mode)) {
+        return 0;
     }
 
-    magic_buff[sizeof(MAGIC)] = '\0';
-    total = s_read(fd, (void*)magic_buff, sizeof(MAGIC));
-    if (total < sizeof(MAGIC) || (strcmp(magic_buff, MAGIC) != 0 )) {
-        log_msg("\nCFS: file: %s is not a CFS file!\n", path);
+    // an open file knows its size better than its header, writes may still be buffered
+    pthread_mutex_lock(&state->lock);
+    file = cfs_find_file(state, st);
+    if (file) {
+        file->refs++;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (file) {
+        pthread_mutex_lock(&file->lock);
+        stat_buf->size = cfs_file_size(file);
+        stat_buf->total_blocks = file->total_blocks;
+        pthread_mutex_unlock(&file->lock);
+        cfs_put_file(state, file);
+        return 1;
+    }
+
+    // a closed file's header is good as long as its block map is untouched
+    if (state->stat_cache) {
+        pthread_mutex_lock(&state->stat_lock);
+        entry = cfs_stat_slot(state, st);
+        hit = entry->ino == st->st_ino && entry->dev == st->st_dev &&
+            entry->map_size == st->st_size &&
+            entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+        if (hit) {
+            stat_buf->size = entry->size;
+            stat_buf->total_blocks = entry->total_blocks;
+            state->stat_hits++;
+        } else {
+            state->stat_misses++;
+        }
+        pthread_mutex_unlock(&state->stat_lock);
+        if (hit) {
+            return 1;
+        }
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
         return -1;
     }
-    ret |= s_read(fd, (void*)&(stat_buf->size), sizeof(off_t));
-    ret |= s_read(fd, (void*)&(stat_buf->total_blocks), sizeof(off_t));
-    if (ret > 0) {
-        log_msg("\n CFS: File stat: %s, size: %d, blocks: %d\n", path, stat_buf->size, stat_buf->total_blocks);
-        return ret;
-    } else {
+    total = s_pread(fd, header, sizeof(header), 0);
+    close(fd);
+    if (total < 0) {
         log_error("\n CFS: Cant read file! \n");
         return -1;
-    } 
+    }
+    if (total < sizeof(header) || !cfs_magic_known(header)) {
+        log_msg("\nCFS: file: %s is not a CFS file!\n", path);
+        return 0;
+    }
+
+    memcpy(&stat_buf->size, header + SIZE_START, sizeof(off_t));
+    memcpy(&stat_buf->total_blocks, header + (TOTAL_BLOCKS_START), sizeof(off_t));
+    log_msg("\n CFS: File stat: %s, size: %d, blocks: %d\n", path, stat_buf->size, stat_buf->total_blocks);
+    cfs_stat_remember(state, st, stat_buf->size, stat_buf->total_blocks);
+
+    return 1;
 }
 
 
@@ -107,61 +373,238 @@ int cfs_print_state(cfs_state_t* state) {
     int i = 0;
     log_msg("\nCFS STATE:\n");
     for (i=0; i<state->fds_cap; i++) {
-        log_msg("[%d] -> %s\n", state->fds[i], state->files[i].path);
+        log_msg("[%d] -> %s\n", state->fds[i], state->files[i] ? state->files[i]->path : "");
     }
     return -1;
 }
 
+
+/*
+    Find the open file whose block map is *st*. Paths go stale on renames
+    and unlinks, the inode doesn't.
+    Caller must hold the state lock.
+*/
+static cfs_file_t* cfs_find_file(cfs_state_t* state, const struct stat* st)
+{
+    cfs_file_t* file;
+
+    for (file = state->open_files; file; file = file->next) {
+        if (file->ino == st->st_ino && file->dev == st->st_dev) {
+            // its header is only up to date once it is synced, it is reopened
+            if (file->closing) {
+                file->closing = 2;
+            }
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Whether any file under the directory *dir* is open. Only used on
+    snapshots, nothing in them is ever renamed, so the paths still hold.
+*/
+int cfs_open_under(cfs_state_t* state, const char* dir)
+{
+    const size_t len = strlen(dir);
+    int i, found = 0;
+
+    pthread_mutex_lock(&state->lock);
+    for (i=0; !found && i<state->fds_cap; i++) {
+        found = state->fds[i] != -1 && strncmp(state->files[i]->path, dir, len) == 0 &&
+            state->files[i]->path[len] == '/';
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return found;
+}
+
+
+/*
+    Drop a reference to a file, the last one writes back buffered blocks
+    and frees it.
+*/
+static int cfs_put_file(cfs_state_t* state, cfs_file_t* file)
+{
+    pthread_mutex_lock(&state->lock);
+    return cfs_put_file_locked(state, file);
+}
+
+
+/*
+    cfs_put_file() with the state lock held, it is released. The file is
+    found by cfs_find_file() until it is synced, if it is reopened
+    meanwhile the references taken since close it instead.
+*/
+static int cfs_put_file_locked(cfs_state_t* state, cfs_file_t* file)
+{
+    cfs_file_t** prev;
+    struct stat st;
+    int ret = 0, unlinked;
+
+    file->refs--;
+    if (file->refs > 0 || file->closing) {
+        pthread_mutex_unlock(&state->lock);
+        return 0;
+    }
+    file->closing = 1;
+    pthread_mutex_unlock(&state->lock);
+
+    for (;;) {
+        ret = cfs_file_sync(state, file);
+        // the next stat of the closed file needs no header read, remembered
+        // while a reopen would still find the file rather than the header
+        if (ret == 0 && fstat(file->fd, &st) == 0) {
+            pthread_mutex_lock(&file->lock);
+            cfs_stat_remember(state, &st, cfs_file_size(file), file->total_blocks);
+            pthread_mutex_unlock(&file->lock);
+        }
+        pthread_mutex_lock(&state->lock);
+        if (file->refs > 0 || file->closing == 1) {
+            break;
+        }
+        // reopened and released again, sync what was written meanwhile
+        file->closing = 1;
+        pthread_mutex_unlock(&state->lock);
+    }
+    file->closing = 0;
+    if (file->refs > 0) {
+        pthread_mutex_unlock(&state->lock);
+        return ret;
+    }
+    for (prev = &state->open_files; *prev != file; prev = &(*prev)->next);
+    *prev = file->next;
+    pthread_mutex_unlock(&state->lock);
+
+    log_msg("\n CFS: Closing file %s\n", file->path);
+    if (file->region) {
+        close_region(state->storage, file->region);
+        free(file->region);
+    }
+    if (file->ra) {
+        pthread_mutex_lock(&state->lock);
+        readahead_stats_add(&state->ra_stats, file->ra);
+        pthread_mutex_unlock(&state->lock);
+        readahead_destroy(file->ra);
+        free(file->ra);
+    }
+    pthread_mutex_lock(&state->lock);
+    state->closed_gen = max(state->closed_gen, file->store_gen);
+    unlinked = file->unlinked;
+    pthread_mutex_unlock(&state->lock);
+    if (file->stage_fd >= 0) {
+        // written in offline mode, deduplicate it now that it is closed
+        close(file->stage_fd);
+        if (state->dedup && !unlinked) {
+            dedup_notify(state->dedup, file->path);
+        }
+    }
+    if (unlinked) {
+        remove_staging(state->storage, file->ino);
+    }
+    close(file->fd);
+    pthread_mutex_destroy(&file->lock);
+    cfs_dirty_free(state, file);
+    free(file->released);
+    free(file->hashes);
+    free(file);
+    return ret;
+}
+
+
 /*
     Register a file to be manipulated with CFS.
     Equivalent to open without O_CREAT.
     Path must contain root
 */
 int cfs_register_file(cfs_state_t* state, const char* path, const int fd) {
-    int i = 0, ret;
-    off_t buff;
+    return cfs_register(state, path, fd, 0);
+}
+
+
+/*
+    Register *fd* of the file at *path*, a *fresh* file is known to be
+    empty and its header isn't read back. Handles of one block map share
+    its cfs_file_t, whatever path they were opened by.
+*/
+static int cfs_register(cfs_state_t* state, const char* path, const int fd, const int fresh) {
+    int i = 0, ret = 0;
+    char header[BLOCK_START];
+    cfs_file_t* file;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        log_error("CFS: Register file");
+        return -1;
+    }
 
     pthread_mutex_lock(&state->lock);
 
     if (state->n_fds >= state->fds_cap /2) {
         /* make the state map bigger*/
-        i = state->fds_cap - 1; /* store old upper bound, to init the new memory */
+        i = state->fds_cap; /* store old upper bound, to init the new memory */
         state->fds_cap = state->fds_cap * 2;
-        state->files = realloc(state->files, sizeof(cfs_file_t) * state->fds_cap);
+        state->files = realloc(state->files, sizeof(cfs_file_t*) * state->fds_cap);
         state->fds = realloc(state->fds, sizeof(int) * state->fds_cap);
         for (; i<state->fds_cap; i++) {
             state->fds[i] = -1;
+            state->files[i] = NULL;
+        }
+    }
+
+    file = cfs_find_file(state, &st);
+    if (file == NULL) {
+        file = calloc(1, sizeof(cfs_file_t));
+        if (file == NULL) {
+            pthread_mutex_unlock(&state->lock);
+            return -1;
+        }
+        strcpy(file->path, path);
+        file->fd = dup(fd);
+        file->stage_fd = -1;
+        // blocks mapped through handles closed since may not be on disk either
+        file->store_gen = state->closed_gen;
+        pthread_mutex_init(&file->lock, NULL);
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+
+        /* read size and blocks */
+        if (!fresh) {
+            ret = s_pread(file->fd, header, sizeof(header), 0);
+            if (ret >= 0 && (ret < (int)sizeof(header) || !cfs_magic_known(header))) {
+                // a map of a newer format would be mangled by the first write
+                log_msg("\nCFS: file: %s is not a CFS file!\n", path);
+                ret = -1;
+            }
+            memcpy(&file->size, header + SIZE_START, sizeof(off_t));
+            memcpy(&file->total_blocks, header + TOTAL_BLOCKS_START, sizeof(off_t));
         }
+        if (file->fd < 0 || ret < 0 ) {
+            log_error("CFS: Register file");
+            close(file->fd);
+            free(file);
+            pthread_mutex_unlock(&state->lock);
+            return -1;
+        }
+        log_msg("\n CFS: File %s is %lld bytes, %lld blocks \n",
+            path, file->size, file->total_blocks);
+        file->next = state->open_files;
+        state->open_files = file;
     }
 
     /* find a free spot in the map */
     for (i=0; i<state->fds_cap; i++) {
         if (state->fds[i] == -1) {
             state->fds[i] = fd;
-            state->files[i].offset = 0;
-            state->files[i].fd = fd;
-            strcpy(state->files[i].path, path);
-
-            log_msg("\n CFS: registered file[FD: %d]: %s at index: %d \n", fd, path, i);
+            state->files[i] = file;
+            file->refs++;
             state->n_fds++;
 
-            /* read size and blocks */
-            ret = s_lseek(fd, sizeof(MAGIC), SEEK_SET);
-            ret |= s_read(fd, (void*)&(state->files[i].size), sizeof(off_t));
-            ret |= s_read(fd, (void*)&(state->files[i].total_blocks), sizeof(off_t));
-            if (ret < 0 ) {
-                log_error("CFS: Register file");
-                pthread_mutex_unlock(&state->lock);
-                return ret;
-            } else {
-                log_msg("\n CFS: File [FD: %d]: %s is %lld bytes, %lld blocks \n",
-                    fd, path,
-                    state->files[i].size,
-                    state->files[i].total_blocks);
-    
-                pthread_mutex_unlock(&state->lock);
-                return fd;
-            }
+            log_msg("\n CFS: registered file[FD: %d]: %s at index: %d, handles: %d \n", fd, path, i, file->refs);
+            pthread_mutex_unlock(&state->lock);
+            return fd;
         }
     }
 
@@ -175,15 +618,18 @@ int cfs_register_file(cfs_state_t* state, const char* path, const int fd) {
 */
 int cfs_release_file(cfs_state_t* state, const int fd) {
     int i;
+    cfs_file_t* file;
     
     pthread_mutex_lock(&state->lock);
     for (i=0; i<state->fds_cap; i++) {
         if (state->fds[i] == fd) {
-            log_msg("\n CFS: Released file %d at [%d] -> *%p\n", fd, i, &state->files[i]);
+            file = state->files[i];
+            log_msg("\n CFS: Released file %d at [%d] -> *%p\n", fd, i, file);
             state->fds[i] = -1;
+            state->files[i] = NULL;
             state->n_fds--;
-            pthread_mutex_unlock(&state->lock);
-            return 0;
+            // never out of sight of cfs_find_file(), or it would be opened twice
+            return cfs_put_file_locked(state, file);
         }
     }
 
@@ -198,18 +644,54 @@ int cfs_release_file(cfs_state_t* state, const int fd) {
     Path must contain root.
 */
 int cfs_create_file(cfs_state_t* state, const char* path, mode_t mode)
+{
+    return cfs_create(path, mode, O_WRONLY);
+}
+
+
+/*
+    Create a file, write its header and register it, all on one descriptor.
+    Equivalent to open with O_CREAT | O_EXCL | O_RDWR.
+    Path must contain root. Returns the descriptor or -errno.
+*/
+int cfs_create_open(cfs_state_t* state, const char* path, mode_t mode)
 {
     int fd;
-    off_t buff = 0;
 
-    fd = log_syscall("cfs: open", open(path, O_CREAT | O_EXCL | O_WRONLY, mode), 0);
+    fd = cfs_create(path, mode, O_RDWR);
+    if (fd >= 0 && cfs_register(state, path, fd, 1) < 0) {
+        close(fd);
+        unlink(path);
+        return -EIO;
+    }
+
+    return fd;
+}
+
+
+/*
+    Create an empty file opened with *flags*.
+    Returns the descriptor or -errno.
+*/
+static int cfs_create(const char* path, mode_t mode, const int flags)
+{
+    int fd, ret;
+    char header[BLOCK_START];
+
+    // We have 0 file size and 0 total blocks
+    memset(header, 0, sizeof(header));
+    memcpy(header, MAGIC, sizeof(MAGIC));
+
+    fd = log_syscall("cfs: open", open(path, O_CREAT | O_EXCL | flags, mode), 0);
     if (fd >= 0) {
-        s_write(fd, (void*)MAGIC, sizeof(MAGIC));
-        // We have 0 file size and 0 total blocks
-        s_write(fd, (void*)&buff, sizeof(off_t));
-        s_write(fd, (void*)&buff, sizeof(off_t));
+        if (s_write(fd, header, sizeof(header)) < 0) {
+            ret = log_error("cfs_create_file write");
+            close(fd);
+            unlink(path);
+            return ret;
+        }
         log_msg("\n CFS: created file: %s\n", path);
-    } else if (fd == -1 && errno == EEXIST) {
+    } else if (fd == -EEXIST) {
         log_msg("\n File exists: %s \n", path);
     } else {
         log_error("cfs_create_file");
@@ -225,14 +707,19 @@ int cfs_create_file(cfs_state_t* state, const char* path, mode_t mode)
 cfs_file_t* cfs_get_file(cfs_state_t* state, int fd)
 {
     int i;
+    cfs_file_t* file = NULL;
+
+    pthread_mutex_lock(&state->lock);
     for (i=0; i<state->fds_cap; i++) {
         if (state->fds[i] == fd) {
-            log_msg("\n CFS: Found file %d at [%d] -> *%p\n", fd, i, &state->files[i]);
-            return &state->files[i];
+            log_msg("\n CFS: Found file %d at [%d] -> *%p\n", fd, i, state->files[i]);
+            file = state->files[i];
+            break;
         }
     }
+    pthread_mutex_unlock(&state->lock);
 
-    return NULL;
+    return file;
 }
 
 
@@ -247,6 +734,7 @@ int cfs_file_find_index(const cfs_state_t* state, cfs_file_t* file, const off_t
     ssize_t block_size;
     ssize_t bytes_read;
     off_t index_buff;
+    off_t left = file->total_blocks;
 
     if (file->total_blocks == 0) {
         return 0;
@@ -255,8 +743,8 @@ int cfs_file_find_index(const cfs_state_t* state, cfs_file_t* file, const off_t
     // start from the beginning
     s_lseek(file->fd, BLOCK_START, SEEK_SET);
 
-    // find the index-hash pair in the file
-    do {
+    // find the index-hash pair in the file, an inline block may follow the last one
+    while (left-- > 0) {
         bytes_read = s_read(file->fd, (void*)&index_buff, sizeof(off_t));
         if (bytes_read == 0) {
             return 0;
@@ -266,93 +754,650 @@ int cfs_file_find_index(const cfs_state_t* state, cfs_file_t* file, const off_t
             // skip this hash
             s_lseek(file->fd, HASH_LENGTH, SEEK_CUR);
         }
-    } while(1);
+    }
 
     return 0;
 }
 
 
 /*
-    Register a *block* to *file*.
-    Block is saved in block storage, if it doesn't already exist. 
+    Region new blocks of *file* are placed in, opened on first use.
+    NULL places them by hash alone.
+    Caller must hold the file lock.
 */
-int cfs_file_register_block(cfs_state_t* state, cfs_file_t* file, const cfs_block_t* block)
+static cfs_region_t* cfs_file_region(cfs_state_t* state, cfs_file_t* file)
 {
-    int ret;
-    unsigned char hash [HASH_LENGTH];
-    ssize_t old_size=0, bytes_read;
-
-    calculate_hash(block->data, block->size, hash);
-   
-    pthread_mutex_lock(&state->lock);
-   
-    // try to store the block, 
-    ret = store_block(state->storage, block->data, block->size, hash);
-    if (ret < 0) {
-        pthread_mutex_unlock(&state->lock);
-        log_error("CFS: Cant store block!");
-        pthread_mutex_unlock(&state->lock);
-        return ret;
+    if (file->region == NULL && state->config.regions) {
+        file->region = malloc(sizeof(cfs_region_t));
+        if (file->region && open_region(state->storage, file->region) < 0) {
+            free(file->region);
+            file->region = NULL;
+        }
     }
 
-    // check if we have a different block at this index
-    ret = cfs_file_find_index(state, file, block->index);
-    if (ret) {
-        log_msg("CFS: other block found at index: %lld\n", block->index);
-        /* block at this index already exists, find the old block's size*/
-        ret = s_read(file->fd, (void*)hash, HASH_LENGTH);
-        old_size = block_get_size(state->storage, hash);
+    return file->region;
+}
 
-        // replace the block hash at this index 
-        s_lseek(file->fd, -HASH_LENGTH, SEEK_CUR); 
-        s_write(file->fd, (void*)hash, HASH_LENGTH);
-    } else {
-        // append pair to the end of the file
-        log_msg("CFS: registering new block [%d] for file %s", block->index, file->path);
-        s_lseek(file->fd, 0, SEEK_END);
-        s_write(file->fd, (void*)&(block->index), sizeof(block->index));
-        s_write(file->fd, (void*)hash, HASH_LENGTH);
-        file->total_blocks ++;
-    }
 
-    // update file size
-    file->size = file->size - old_size + block->size;
-    s_lseek(file->fd, SIZE_START, SEEK_SET);
-    s_write(file->fd, (void*)&(file->size), sizeof(file->size));
-    s_write(file->fd, (void*)&(file->total_blocks), sizeof(file->total_blocks));
+/*
+    Remember that block *index* of *file* is mapped to *hash*.
+    Caller must hold the state lock.
+*/
+static void cfs_file_cache_hash(cfs_file_t* file, const off_t index, const unsigned char* hash)
+{
+    cfs_cached_hash_t* entry;
+    size_t i;
 
-    pthread_mutex_unlock(&state->lock);
+    if (file->hashes == NULL) {
+        file->hashes = malloc(sizeof(cfs_cached_hash_t) * CFS_HASH_CACHE);
+        if (file->hashes == NULL) {
+            // every rewrite is stored then
+            return;
+        }
+        for (i=0; i<CFS_HASH_CACHE; i++) {
+            file->hashes[i].index = -1;
+        }
+    }
 
-    return 0;
+    entry = &file->hashes[index % CFS_HASH_CACHE];
+    entry->index = index;
+    memcpy(entry->hash, hash, HASH_LENGTH);
 }
 
 
 /*
-    Read a block from file
-    Index is the block index, not to be confused with file offset
+    Forget the hashes of blocks [first, end) of *file*.
+    Caller must hold the state lock.
 */
-int cfs_file_read_block(cfs_state_t* state, cfs_file_t* file, const off_t index, cfs_block_t* buff)
+static void cfs_file_forget_hashes(cfs_file_t* file, const off_t first, const off_t end)
 {
-    int ret;
-    unsigned char hash [HASH_LENGTH];
-    ssize_t block_size;
-    ssize_t bytes_read;
-    off_t index_buff;
-
-    pthread_mutex_lock(&state->lock);
-    // start from the beginning
-    s_lseek(file->fd, BLOCK_START, SEEK_SET);
+    size_t i;
 
-    // find the index-hash pair in the file
-    ret = cfs_file_find_index(state, file, index);
-    if (!ret) {
-        pthread_mutex_unlock(&state->lock);
-        return 0;
+    for (i=0; file->hashes && i<CFS_HASH_CACHE; i++) {
+        if (file->hashes[i].index >= first && file->hashes[i].index < end) {
+            file->hashes[i].index = -1;
+        }
     }
-    bytes_read = s_read(file->fd, (void*)hash, HASH_LENGTH);
+}
 
 
-    ret = load_block(state->storage, hash, buff->data, &buff->size);
+/*
+    Whether block *index* of *file* is known to be mapped to *hash* already,
+    writing it again would store and map nothing new. Counts such blocks.
+    Caller must hold the state lock.
+*/
+int cfs_file_unchanged(cfs_state_t* state, cfs_file_t* file, const off_t index, const unsigned char* hash)
+{
+    const cfs_cached_hash_t* entry;
+
+    if (file->hashes == NULL || cfs_hash_is_staged(hash)) {
+        return 0;
+    }
+    entry = &file->hashes[index % CFS_HASH_CACHE];
+    if (entry->index != index || memcmp(entry->hash, hash, HASH_LENGTH) != 0) {
+        return 0;
+    }
+    state->unchanged_blocks++;
+
+    return 1;
+}
+
+
+/*
+    Note that *file* maps blocks whose writes to the store may not be on
+    disk yet, its next fsync has to sync the store.
+    Caller must hold the state lock.
+*/
+static void cfs_file_mark_unsynced(cfs_state_t* state, cfs_file_t* file)
+{
+    file->store_gen = ++state->store_gen;
+}
+
+
+/*
+    Register *size* bytes of *data* as block *index* of *file*.
+    Block is saved in block storage, if it doesn't already exist. 
+    Caller must hold the file lock.
+*/
+int cfs_file_register_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const char* data, const size_t size)
+{
+    int ret;
+    unsigned char hash [HASH_LENGTH];
+
+    calculate_hash(data, size, hash);
+    cfs_file_region(state, file);
+   
+    pthread_mutex_lock(&state->lock);
+    if (cfs_file_unchanged(state, file, index, hash)) {
+        cfs_file_account(state, file, 1, 0);
+        pthread_mutex_unlock(&state->lock);
+        return 0;
+    }
+   
+    // try to store the block, 
+    ret = store_block_in(state->storage, file->region, (const unsigned char*)data, size, hash);
+    if (ret < 0) {
+        log_error("CFS: Cant store block!");
+        pthread_mutex_unlock(&state->lock);
+        return ret;
+    }
+
+    cfs_file_map_block(state, file, index, size, hash);
+    cfs_file_account(state, file, ret == 0, 0);
+
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+
+/*
+    Register *count* whole blocks of *data* as blocks *first* onwards of *file*.
+    They are stored and mapped under a single acquisition of the state lock,
+    with one metadata update for all of them.
+    Caller must hold the file lock.
+*/
+int cfs_file_register_blocks(cfs_state_t* state, cfs_file_t* file, const off_t first, const char* data, const size_t count)
+{
+    cfs_mapping_t* maps;
+    size_t n = 0, i;
+    int ret = 0;
+
+    maps = malloc(count * sizeof(cfs_mapping_t));
+    if (maps == NULL) {
+        return -1;
+    }
+
+    // hashing needs no lock
+    for (i=0; i<count; i++) {
+        maps[i].index = first + i;
+        maps[i].size = BLOCK_SIZE;
+        calculate_hash(data + i * BLOCK_SIZE, BLOCK_SIZE, maps[i].hash);
+    }
+    cfs_file_region(state, file);
+
+    pthread_mutex_lock(&state->lock);
+    for (i=0; i<count; i++) {
+        if (cfs_file_unchanged(state, file, maps[i].index, maps[i].hash)) {
+            cfs_file_account(state, file, 1, 0);
+            continue;
+        }
+        ret = store_block_in(state->storage, file->region, (const unsigned char*)data + i * BLOCK_SIZE, BLOCK_SIZE, maps[i].hash);
+        if (ret < 0) {
+            log_error("CFS: Cant store block!");
+            break;
+        }
+        cfs_file_account(state, file, ret == 0, 0);
+        maps[n++] = maps[i];
+    }
+    // the blocks stored before a failure are still mapped
+    if (cfs_file_map_blocks(state, file, maps, n) < 0 || ret < 0) {
+        ret = -1;
+    } else {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    free(maps);
+
+    return ret;
+}
+
+
+/*
+    Account a block written to *file*, *hit* if it was already stored.
+    A file stops being deduplicated when less than CFS_BYPASS_MIN_HITS percent
+    of a window of blocks are hits, and starts again once that many of the
+    blocks *sampled* while bypassing are.
+    Caller must hold the state lock.
+*/
+void cfs_file_account(cfs_state_t* state, cfs_file_t* file, const int hit, const int sampled)
+{
+    const size_t window = state->config.bypass_window;
+
+    // blocks still in the pipeline when the mode switched don't count
+    if (window == 0 || file->bypass != sampled) {
+        return;
+    }
+
+    file->window_blocks++;
+    file->window_hits += hit != 0;
+    if (!file->bypass && file->window_blocks >= window) {
+        if (file->window_hits * 100 < window * CFS_BYPASS_MIN_HITS) {
+            log_msg("\n CFS: %s does not dedup, bypassing\n", file->path);
+            file->bypass = 1;
+            state->bypass_stats.switches++;
+        }
+    } else if (file->bypass && file->window_blocks >= CFS_BYPASS_SAMPLES) {
+        if (file->window_hits * 100 >= file->window_blocks * CFS_BYPASS_MIN_HITS) {
+            log_msg("\n CFS: %s dedups again\n", file->path);
+            file->bypass = 0;
+        }
+    } else {
+        return;
+    }
+    file->window_blocks = 0;
+    file->window_hits = 0;
+}
+
+
+/*
+    Write *n* pairs after the last pair of *file*. The data of an inline
+    block that followed them is moved past the new ones.
+    Caller must hold the state lock.
+*/
+static int cfs_file_append_pairs(cfs_file_t* file, const char* pairs, const size_t n)
+{
+    char tail[BLOCK_SIZE];
+    const off_t end = BLOCK_START + file->total_blocks * (BLOCK_PAIR);
+    off_t map_end;
+    ssize_t len = 0;
+
+    map_end = s_lseek(file->fd, 0, SEEK_END);
+    if (map_end < 0) {
+        return -1;
+    }
+    if (map_end > end) {
+        len = s_pread(file->fd, tail, min(map_end - end, (off_t)BLOCK_SIZE), end);
+        if (len < 0) {
+            return -1;
+        }
+    }
+
+    if (s_pwrite(file->fd, pairs, n * (BLOCK_PAIR), end) < 0 ||
+        (len > 0 && s_pwrite(file->fd, tail, len, end + n * (BLOCK_PAIR)) < 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Read *len* bytes at *offset* of the inline block of *file*, whose hash is
+    *hash*, into *dst*. Past its end reads as zeroes.
+    Returns its size, or -1.
+    Caller must hold the state lock.
+*/
+static ssize_t cfs_file_read_inline_range(const cfs_file_t* file, const unsigned char* hash, char* dst,
+    const off_t offset, const size_t len)
+{
+    const size_t size = min(cfs_inline_size(hash), (size_t)BLOCK_SIZE);
+    const size_t avail = min(size > offset ? size - offset : 0, len);
+
+    if (s_pread(file->fd, dst, avail, BLOCK_START + file->total_blocks * (BLOCK_PAIR) + offset) < 0) {
+        log_error("CFS: Cant read inline block!");
+        return -1;
+    }
+    memset(dst + avail, '\0', len - avail);
+
+    return size;
+}
+
+
+/*
+    Load the inline block of *file* into a BLOCK_SIZE buffer.
+    Caller must hold the state lock.
+*/
+static ssize_t cfs_file_read_inline(const cfs_file_t* file, const unsigned char* hash, char* data)
+{
+    return cfs_file_read_inline_range(file, hash, data, 0, BLOCK_SIZE);
+}
+
+
+/*
+    Keep *size* bytes of *data* as block *index* of *file* in the block map
+    itself, if the block is under config.inline_max and ends the file at *end*.
+    A file has one inline block at most, while it has one the others are stored.
+    Returns 1 if it was inlined, 0 if it is to be stored, -1 on errors.
+    Caller must hold the file lock.
+*/
+static int cfs_file_inline_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const char* data,
+    const size_t size, const off_t end)
+{
+    unsigned char hash[HASH_LENGTH];
+    char old[BLOCK_SIZE];
+    off_t pairs_end, map_end;
+    char found;
+    int ret = 0;
+
+    if (size >= state->config.inline_max || index * BLOCK_SIZE + (off_t)size < end) {
+        return 0;
+    }
+    // an older copy left in the pipeline must not be mapped over it
+    if (state->pipeline) {
+        pipeline_drain(state->pipeline, file);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    pairs_end = BLOCK_START + file->total_blocks * (BLOCK_PAIR);
+    map_end = s_lseek(file->fd, 0, SEEK_END);
+    if (map_end > pairs_end) {
+        // the data there belongs to this block or to another one
+        ret = cfs_file_find_hashes(state, file, index, 1, hash, &found);
+        if (ret == 0 || (ret > 0 && !cfs_hash_is_inline(hash))) {
+            pthread_mutex_unlock(&state->lock);
+            return 0;
+        }
+        if (ret > 0 && cfs_inline_size(hash) == size && cfs_file_read_inline(file, hash, old) >= 0 &&
+            memcmp(old, data, size) == 0) {
+            state->unchanged_blocks++;
+            pthread_mutex_unlock(&state->lock);
+            return 1;
+        }
+    }
+
+    if (map_end < 0 || ret < 0 || s_pwrite(file->fd, data, size, pairs_end) < 0 ||
+        (map_end > pairs_end + (off_t)size && ftruncate(file->fd, pairs_end + size) < 0)) {
+        pthread_mutex_unlock(&state->lock);
+        return -1;
+    }
+    cfs_inline_hash(hash, size);
+    ret = cfs_file_map_block(state, file, index, size, hash);
+    if (ret == 0) {
+        state->inline_blocks++;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return ret < 0 ? -1 : 1;
+}
+
+
+/*
+    Point block *index* of *file* to an already stored block.
+    Caller must hold the state lock.
+*/
+int cfs_file_map_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const size_t size, const unsigned char* hash)
+{
+    cfs_mapping_t map;
+
+    map.index = index;
+    map.size = size;
+    memcpy(map.hash, hash, HASH_LENGTH);
+
+    return cfs_file_map_blocks(state, file, &map, 1);
+}
+
+
+static int cfs_mapping_cmp(const void* a, const void* b)
+{
+    const cfs_mapping_t* x = *(const cfs_mapping_t* const*)a;
+    const cfs_mapping_t* y = *(const cfs_mapping_t* const*)b;
+
+    if (x->index != y->index) {
+        return x->index < y->index ? -1 : 1;
+    }
+    // the later mapping of one index wins
+    return x < y ? -1 : x > y;
+}
+
+
+static int cfs_mapping_find(const void* key, const void* elem)
+{
+    const off_t index = *(const off_t*)key;
+    const cfs_mapping_t* map = *(const cfs_mapping_t* const*)elem;
+
+    return index < map->index ? -1 : index > map->index;
+}
+
+
+/*
+    Apply *n* mappings to *file* in order, with one pass over its index-hash
+    pairs and a single write for the new ones and one for the header.
+    The file takes over the reference each stored block was given, the ones
+    of the blocks it no longer points to are released.
+    Caller must hold the state lock.
+*/
+int cfs_file_map_blocks(cfs_state_t* state, cfs_file_t* file, const cfs_mapping_t* maps, const size_t n)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    const cfs_mapping_t** sorted;
+    const cfs_mapping_t** match;
+    char* added;
+    unsigned char* old;
+    off_t* found;
+    off_t pos = BLOCK_START, left = file->total_blocks, index;
+    const off_t old_size = file->size;
+    size_t n_unique = 0, n_found = 0, n_added = 0, i, k;
+    ssize_t bytes_read;
+    int ret = 0, changed = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    // the blocks were stored, referenced or staged right before, whether
+    // mapping them works out or not. Inline data goes with the map itself
+    for (i=0; i<n; i++) {
+        if (!cfs_hash_is_inline(maps[i].hash)) {
+            cfs_file_mark_unsynced(state, file);
+            break;
+        }
+    }
+
+    sorted = malloc(n * sizeof(cfs_mapping_t*));
+    found = malloc(n * sizeof(off_t));
+    added = malloc(n * (BLOCK_PAIR));
+    old = malloc(n * HASH_LENGTH);
+    if (sorted == NULL || found == NULL || added == NULL || old == NULL) {
+        free(sorted);
+        free(found);
+        free(added);
+        free(old);
+        return -1;
+    }
+
+    // only the last mapping of each index matters
+    for (i=0; i<n; i++) {
+        sorted[i] = &maps[i];
+        file->size = max(file->size, (off_t)(maps[i].index * BLOCK_SIZE + maps[i].size));
+    }
+    qsort(sorted, n, sizeof(cfs_mapping_t*), cfs_mapping_cmp);
+    for (i=0; i<n; i++) {
+        if (i + 1 < n && sorted[i + 1]->index == sorted[i]->index) {
+            cfs_file_release(state, file, sorted[i]->hash);
+            continue;
+        }
+        sorted[n_unique] = sorted[i];
+        found[n_unique] = -1;
+        n_unique++;
+    }
+
+    // find the pairs already in the file
+    while (left > 0 && n_found < n_unique) {
+        k = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, k * (BLOCK_PAIR), pos);
+        if (bytes_read < 0) {
+            log_error("CFS: Scan pairs");
+            ret = -1;
+            goto out;
+        }
+        k = bytes_read / (BLOCK_PAIR);
+        if (k == 0) {
+            break;
+        }
+
+        for (i=0; i<k; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index < sorted[0]->index || index > sorted[n_unique - 1]->index) {
+                continue;
+            }
+            match = bsearch(&index, sorted, n_unique, sizeof(cfs_mapping_t*), cfs_mapping_find);
+            if (match && found[match - sorted] < 0) {
+                found[match - sorted] = pos + i * (BLOCK_PAIR);
+                memcpy(old + (match - sorted) * HASH_LENGTH, pairs + i * (BLOCK_PAIR) + sizeof(off_t), HASH_LENGTH);
+                n_found++;
+            }
+        }
+
+        pos += k * (BLOCK_PAIR);
+        left -= k;
+    }
+
+    for (i=0; i<n_unique; i++) {
+        if (found[i] >= 0 && memcmp(old + i * HASH_LENGTH, sorted[i]->hash, HASH_LENGTH) == 0) {
+            // already points there, only the reference it was given goes
+            cfs_file_release(state, file, sorted[i]->hash);
+        } else if (found[i] >= 0) {
+            // replace the block hash at this index
+            if (s_pwrite(file->fd, sorted[i]->hash, HASH_LENGTH, found[i] + sizeof(off_t)) < 0) {
+                ret = -1;
+            } else {
+                cfs_file_release(state, file, old + i * HASH_LENGTH);
+                changed = 1;
+            }
+            // an inline block that gets stored leaves no data behind
+            if (cfs_hash_is_inline(old + i * HASH_LENGTH) && !cfs_hash_is_inline(sorted[i]->hash) &&
+                ftruncate(file->fd, BLOCK_START + file->total_blocks * (BLOCK_PAIR)) < 0) {
+                ret = -1;
+            }
+        } else {
+            memcpy(added + n_added * (BLOCK_PAIR), &sorted[i]->index, sizeof(off_t));
+            memcpy(added + n_added * (BLOCK_PAIR) + sizeof(off_t), sorted[i]->hash, HASH_LENGTH);
+            n_added++;
+        }
+    }
+
+    if (n_added > 0) {
+        // append the new pairs to the end of the file
+        log_msg("CFS: registering %zu new blocks for file %s\n", n_added, file->path);
+        if (cfs_file_append_pairs(file, added, n_added) < 0) {
+            ret = -1;
+            goto out;
+        }
+        file->total_blocks += n_added;
+        changed = 1;
+    }
+
+    // file size is the end of the last block, it sits right before the block count
+    if ((changed || file->size != old_size) && cfs_file_write_header(file) < 0) {
+        ret = -1;
+    }
+
+out:
+    // after a failure the map may hold either hash
+    for (i=0; i<n_unique; i++) {
+        if (ret == 0) {
+            cfs_file_cache_hash(file, sorted[i]->index, sorted[i]->hash);
+        } else {
+            cfs_file_forget_hashes(file, sorted[i]->index, sorted[i]->index + 1);
+        }
+    }
+    free(sorted);
+    free(found);
+    free(added);
+    free(old);
+
+    return ret;
+}
+
+
+/*
+    Drop the reference *file* held to block *hash*, staged and inline blocks
+    hold none. While reads may still be loading it, that is left to the last
+    of them.
+    Caller must hold the state lock.
+*/
+static void cfs_file_release(cfs_state_t* state, cfs_file_t* file, const unsigned char* hash)
+{
+    unsigned char* grown;
+    size_t cap;
+
+    if (cfs_hash_is_staged(hash) || cfs_hash_is_inline(hash)) {
+        return;
+    }
+    if (file->readers == 0) {
+        block_dec_ref(state->storage, hash);
+        return;
+    }
+
+    if (file->n_released == file->released_cap) {
+        cap = max(file->released_cap * 2, CFS_SCAN_PAIRS);
+        grown = realloc(file->released, cap * HASH_LENGTH);
+        if (grown == NULL) {
+            // leaking the block beats deleting it under a reader
+            return;
+        }
+        file->released = grown;
+        file->released_cap = cap;
+    }
+    memcpy(file->released + file->n_released * HASH_LENGTH, hash, HASH_LENGTH);
+    file->n_released++;
+}
+
+
+/*
+    End a read of *file* that resolved its hashes, the last one drops the
+    references released meanwhile.
+    Caller must hold the state lock.
+*/
+static void cfs_file_unpin(cfs_state_t* state, cfs_file_t* file)
+{
+    size_t i;
+
+    file->readers--;
+    if (file->readers > 0) {
+        return;
+    }
+    for (i=0; i<file->n_released; i++) {
+        block_dec_ref(state->storage, file->released + i * HASH_LENGTH);
+    }
+    file->n_released = 0;
+}
+
+
+/*
+    Read a block from file
+    Index is the block index, not to be confused with file offset
+*/
+int cfs_file_read_block(cfs_state_t* state, cfs_file_t* file, const off_t index, cfs_block_t* buff)
+{
+    int ret;
+    size_t refs;
+    unsigned char hash [HASH_LENGTH];
+    ssize_t block_size;
+    ssize_t bytes_read;
+    off_t index_buff;
+
+    pthread_mutex_lock(&state->lock);
+    // start from the beginning
+    s_lseek(file->fd, BLOCK_START, SEEK_SET);
+
+    // find the index-hash pair in the file
+    ret = cfs_file_find_index(state, file, index);
+    if (!ret) {
+        pthread_mutex_unlock(&state->lock);
+        return 0;
+    }
+    bytes_read = s_read(file->fd, (void*)hash, HASH_LENGTH);
+    if (bytes_read == HASH_LENGTH) {
+        // a partial rewrite of the block starts from here
+        cfs_file_cache_hash(file, index, hash);
+    }
+    if (cfs_hash_is_staged(hash)) {
+        // data lives in the staging extent, which the file lock protects
+        pthread_mutex_unlock(&state->lock);
+        buff->size = cfs_staged_size(hash);
+        if (cfs_file_stage_fd(state, file, 0) < 0 ||
+            s_pread(file->stage_fd, buff->data, buff->size, index * BLOCK_SIZE) < 0) {
+            log_error("CFS: Cant read staged block!");
+            return -1;
+        }
+        buff->index = index;
+        return 1;
+    }
+    if (cfs_hash_is_inline(hash)) {
+        bytes_read = cfs_file_read_inline(file, hash, buff->data);
+        pthread_mutex_unlock(&state->lock);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        buff->size = bytes_read;
+        buff->index = index;
+        return 1;
+    }
+
+
+    ret = load_block(state->storage, hash, buff->data, &buff->size, &refs);
     if (ret != 0) {
         log_error("CFS: Cant read block!");
         pthread_mutex_unlock(&state->lock);
@@ -363,3 +1408,2399 @@ int cfs_file_read_block(cfs_state_t* state, cfs_file_t* file, const off_t index,
     pthread_mutex_unlock(&state->lock);
     return 1;
 }
+
+
+/*
+    Resolve the hashes of blocks [first, first + count) with a single pass over the
+    index-hash pairs of *file*. found[i] is set if block first + i is mapped and its
+    hash is copied to hashes + i * HASH_LENGTH.
+    Caller must hold the state lock.
+*/
+int cfs_file_find_hashes(const cfs_state_t* state, const cfs_file_t* file, const off_t first, const size_t count,
+    unsigned char* hashes, char* found)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    off_t pos = BLOCK_START;
+    off_t left = file->total_blocks;
+    off_t index;
+    ssize_t bytes_read;
+    size_t n, i, matched = 0;
+
+    memset(found, 0, count);
+
+    while (left > 0 && matched < count) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        if (bytes_read < 0) {
+            log_error("CFS: Scan pairs");
+            return -1;
+        }
+        n = bytes_read / (BLOCK_PAIR);
+        if (n == 0) {
+            break;
+        }
+
+        for (i=0; i<n; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index >= first && index < first + count && !found[index - first]) {
+                memcpy(hashes + (index - first) * HASH_LENGTH, pairs + i * (BLOCK_PAIR) + sizeof(off_t), HASH_LENGTH);
+                found[index - first] = 1;
+                matched++;
+            }
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+
+    return matched;
+}
+
+
+/*
+    Logical size of a file, counting blocks still buffered or staged.
+    Caller must hold the file lock.
+*/
+static off_t cfs_file_size(const cfs_file_t* file)
+{
+    off_t size = max(file->size, file->staged_end);
+    size_t i;
+
+    for (i=0; file->dirty && i<CFS_DIRTY_BLOCKS; i++) {
+        if (file->dirty[i].block.index != -1) {
+            size = max(size, (off_t)(file->dirty[i].block.index * BLOCK_SIZE + file->dirty[i].block.size));
+        }
+    }
+
+    return size;
+}
+
+
+/*
+    Write a block of a file that doesn't dedup straight to its staging extent,
+    without hashing it. One in bypass_sample blocks is still hashed, a hit is
+    mapped to the stored copy.
+    Caller must hold the file lock.
+*/
+static int cfs_file_bypass_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const char* data, const size_t size)
+{
+    unsigned char hash[HASH_LENGTH];
+    char padded[BLOCK_SIZE];
+    int hit, ret = 0;
+
+    if (!file->bypassing) {
+        // earlier copies still in the pipeline must not be mapped over these
+        if (state->pipeline) {
+            pipeline_drain(state->pipeline, file);
+        }
+        file->bypassing = 1;
+        file->bypass_count = 0;
+    }
+
+    if (state->config.bypass_sample && ++file->bypass_count >= state->config.bypass_sample) {
+        file->bypass_count = 0;
+        calculate_hash(data, size, hash);
+        pthread_mutex_lock(&state->lock);
+        // a hit takes a reference like any stored block
+        hit = block_inc_ref(state->storage, hash) > 0;
+        cfs_file_account(state, file, hit, 1);
+        if (hit) {
+            ret = cfs_file_map_block(state, file, index, size, hash);
+        }
+        pthread_mutex_unlock(&state->lock);
+        if (hit) {
+            return ret;
+        }
+    }
+
+    if (cfs_file_stage_fd(state, file, 1) < 0) {
+        return -1;
+    }
+    if (size < BLOCK_SIZE) {
+        // the whole slot is rewritten, stale bytes must not survive past the end
+        memcpy(padded, data, size);
+        memset(padded + size, '\0', BLOCK_SIZE - size);
+        data = padded;
+    }
+    if (s_pwrite(file->stage_fd, data, BLOCK_SIZE, index * BLOCK_SIZE) < 0) {
+        log_error("CFS: Cant write staged block!");
+        return -1;
+    }
+
+    cfs_staged_hash(hash, size);
+    pthread_mutex_lock(&state->lock);
+    ret = cfs_file_map_block(state, file, index, size, hash);
+    state->bypass_stats.blocks++;
+    state->bypass_stats.bytes += size;
+    pthread_mutex_unlock(&state->lock);
+
+    return ret;
+}
+
+
+/*
+    Hand a complete block over to be hashed, stored and mapped. *data* is only
+    used until this returns. When it is the buffer of *owner*, the pipeline
+    takes that buffer over instead of copying it and leaves a free one there.
+    Caller must hold the file lock.
+*/
+static int cfs_file_stage_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const char* data, const size_t size,
+    cfs_block_t* owner)
+{
+    int bypass, ret;
+
+    ret = cfs_file_inline_block(state, file, index, data, size, cfs_file_size(file));
+    if (ret != 0) {
+        return ret < 0 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    bypass = file->bypass;
+    pthread_mutex_unlock(&state->lock);
+    if (bypass) {
+        return cfs_file_bypass_block(state, file, index, data, size);
+    }
+    file->bypassing = 0;
+    // workers place the block in it without the file lock
+    cfs_file_region(state, file);
+
+    if (state->pipeline == NULL) {
+        return cfs_file_register_block(state, file, index, data, size);
+    }
+    if (owner) {
+        return pipeline_give(state->pipeline, file, owner);
+    }
+
+    return pipeline_submit(state->pipeline, file, index, data, size);
+}
+
+
+/*
+    Hand *count* whole blocks of *data* over, starting at block *first*.
+    Without a pipeline they are registered as one batch.
+    Caller must hold the file lock.
+*/
+static int cfs_file_stage_blocks(cfs_state_t* state, cfs_file_t* file, const off_t first, const char* data, const size_t count)
+{
+    size_t i;
+    int bypass, ret = 0;
+
+    pthread_mutex_lock(&state->lock);
+    bypass = file->bypass;
+    pthread_mutex_unlock(&state->lock);
+    if (bypass || state->pipeline || count == 1) {
+        // the pipeline copies each block into a slot of its own anyway
+        for (i=0; ret == 0 && i<count; i++) {
+            ret = cfs_file_stage_block(state, file, first + i, data + i * BLOCK_SIZE, BLOCK_SIZE, NULL);
+        }
+        return ret;
+    }
+    file->bypassing = 0;
+
+    return cfs_file_register_blocks(state, file, first, data, count);
+}
+
+
+/*
+    Give the buffers of the write-back slots of *file* back, they must be free.
+*/
+static void cfs_dirty_free(cfs_state_t* state, cfs_file_t* file)
+{
+    size_t i;
+
+    for (i=0; file->dirty && i<CFS_DIRTY_BLOCKS; i++) {
+        buffers_put(&state->buffers, file->dirty[i].block.data);
+    }
+    free(file->dirty);
+    file->dirty = NULL;
+}
+
+
+/*
+    Find the buffered copy of block *index*, if any.
+    Caller must hold the file lock.
+*/
+static cfs_dirty_t* cfs_dirty_find(const cfs_file_t* file, const off_t index)
+{
+    size_t i;
+
+    if (file->n_dirty == 0) {
+        return NULL;
+    }
+
+    for (i=0; i<CFS_DIRTY_BLOCKS; i++) {
+        if (file->dirty[i].block.index == index) {
+            return &file->dirty[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Stage a buffered block, then free its slot.
+    Caller must hold the file lock.
+*/
+static int cfs_dirty_store(cfs_state_t* state, cfs_file_t* file, cfs_dirty_t* dirty)
+{
+    int ret;
+
+    ret = cfs_file_stage_block(state, file, dirty->block.index, dirty->block.data, dirty->block.size, &dirty->block);
+    if (ret == 0) {
+        dirty->block.index = -1;
+        file->n_dirty--;
+    }
+
+    return ret;
+}
+
+
+/*
+    Get a buffer slot for block *index*, loading the stored block into it.
+    When all slots are taken, the least recently used one is written back.
+    Caller must hold the file lock.
+*/
+static cfs_dirty_t* cfs_dirty_get(cfs_state_t* state, cfs_file_t* file, const off_t index)
+{
+    cfs_dirty_t* dirty = NULL;
+    cfs_stage_t* staged;
+    size_t i;
+
+    if (file->dirty == NULL) {
+        file->dirty = calloc(CFS_DIRTY_BLOCKS, sizeof(cfs_dirty_t));
+        for (i=0; file->dirty && i<CFS_DIRTY_BLOCKS; i++) {
+            file->dirty[i].block.index = -1;
+            file->dirty[i].block.data = buffers_get(&state->buffers);
+            if (file->dirty[i].block.data == NULL) {
+                cfs_dirty_free(state, file);
+            }
+        }
+        if (file->dirty == NULL) {
+            return NULL;
+        }
+    }
+
+    for (i=0; i<CFS_DIRTY_BLOCKS; i++) {
+        if (file->dirty[i].block.index == -1) {
+            dirty = &file->dirty[i];
+            break;
+        } else if (dirty == NULL || file->dirty[i].used < dirty->used) {
+            dirty = &file->dirty[i];
+        }
+    }
+
+    if (dirty->block.index != -1) {
+        log_msg("\n CFS: evicting buffered block [%lld] of %s\n", dirty->block.index, file->path);
+        if (cfs_dirty_store(state, file, dirty) < 0) {
+            return NULL;
+        }
+    }
+
+    dirty->block.size = 0;
+    if (state->pipeline) {
+        // a staged copy is newer than the stored one
+        pthread_mutex_lock(&state->pipeline->lock);
+        staged = pipeline_find(state->pipeline, file, index);
+        if (staged) {
+            dirty->block.size = staged->block.size;
+            memcpy(dirty->block.data, staged->block.data, staged->block.size);
+        } else {
+            cfs_file_read_block(state, file, index, &dirty->block);
+        }
+        pthread_mutex_unlock(&state->pipeline->lock);
+    } else {
+        cfs_file_read_block(state, file, index, &dirty->block);
+    }
+    // only what the block holds was loaded, the buffer is reused
+    memset(dirty->block.data + dirty->block.size, '\0', BLOCK_SIZE - dirty->block.size);
+    dirty->block.index = index;
+    file->n_dirty++;
+
+    return dirty;
+}
+
+
+/*
+    Hand every buffered block of *file* over to be stored.
+*/
+int cfs_file_flush(cfs_state_t* state, cfs_file_t* file)
+{
+    int ret = 0;
+    size_t i;
+
+    pthread_mutex_lock(&file->lock);
+    for (i=0; file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        if (file->dirty[i].block.index != -1) {
+            ret |= cfs_dirty_store(state, file, &file->dirty[i]);
+        }
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
+}
+
+
+/*
+    Store every buffered and staged block of *file* and map them.
+    Returns the first error hit since the last sync.
+*/
+int cfs_file_sync(cfs_state_t* state, cfs_file_t* file)
+{
+    int ret;
+
+    ret = cfs_file_flush(state, file);
+    if (state->pipeline) {
+        ret |= pipeline_wait(state->pipeline, file);
+    }
+
+    return ret;
+}
+
+
+/*
+    Make every block *file* maps durable, so its map can be synced next.
+    Blocks are stored and mapped like cfs_file_sync(), then the block store
+    is synced if a block was mapped since the last store sync. One sync
+    covers the blocks of every file written meanwhile: concurrent fsyncs
+    share it and a file whose blocks it already covered skips it. The
+    staging extent is synced on its own, it is the only container of the
+    data staged in it.
+    The caller syncs the map itself.
+*/
+int cfs_file_fsync(cfs_state_t* state, cfs_file_t* file)
+{
+    unsigned long needed, target;
+    int ret;
+
+    ret = cfs_file_sync(state, file);
+
+    pthread_mutex_lock(&file->lock);
+    if (file->stage_fd >= 0 && fdatasync(file->stage_fd) < 0) {
+        log_error("CFS: Cannot sync the staging extent");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    pthread_mutex_lock(&state->lock);
+    needed = file->store_gen;
+    pthread_mutex_unlock(&state->lock);
+
+    pthread_mutex_lock(&state->sync_lock);
+    if (state->synced_gen < needed) {
+        // whatever was mapped up to here was written before the sync starts
+        pthread_mutex_lock(&state->lock);
+        target = state->store_gen;
+        pthread_mutex_unlock(&state->lock);
+        if (sync_storage(state->storage) < 0) {
+            ret = -1;
+        } else {
+            state->synced_gen = target;
+        }
+        state->store_syncs++;
+    } else {
+        state->store_syncs_saved++;
+    }
+    pthread_mutex_unlock(&state->sync_lock);
+
+    return ret;
+}
+
+
+/*
+    Write the size and block count of *file* to its header, along with the
+    current magic: what follows may need it.
+    Caller must hold the state lock.
+*/
+static int cfs_file_write_header(cfs_file_t* file)
+{
+    char header[BLOCK_START];
+
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    memcpy(header + SIZE_START, &file->size, sizeof(off_t));
+    memcpy(header + TOTAL_BLOCKS_START, &file->total_blocks, sizeof(off_t));
+
+    return s_pwrite(file->fd, header, sizeof(header), 0) < 0 ? -1 : 0;
+}
+
+
+/*
+    Remove the pairs of blocks [first, end) from *file* and release their
+    blocks, they read as zeroes afterwards. Pairs that stay but sit past the
+    new end of the map are moved into the holes left below it, then the map
+    is cut, so only the removed pairs are written. The data of an inline
+    block that stays follows the pairs down.
+    The header is left to the caller.
+    Caller must hold the state lock.
+*/
+static int cfs_file_unmap(cfs_state_t* state, cfs_file_t* file, const off_t first, const off_t end)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    char tail[BLOCK_SIZE];
+    off_t pos = BLOCK_START, left = file->total_blocks, index, total, map_end;
+    off_t* holes = NULL;
+    unsigned char* hashes = NULL;
+    void* grown;
+    size_t n_removed = 0, cap = 0, n_holes = 0, n, i;
+    ssize_t bytes_read, tail_len = 0;
+    int ret = 0;
+
+    cfs_file_forget_hashes(file, first, end);
+
+    // find the pairs to remove, the map is not ordered
+    while (left > 0) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        if (bytes_read < 0) {
+            log_error("CFS: Scan pairs");
+            ret = -1;
+            goto out;
+        }
+        n = bytes_read / (BLOCK_PAIR);
+        if (n == 0) {
+            break;
+        }
+
+        for (i=0; i<n; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index < first || index >= end) {
+                continue;
+            }
+            if (n_removed == cap) {
+                cap = max(cap * 2, CFS_SCAN_PAIRS);
+                grown = realloc(holes, cap * sizeof(off_t));
+                if (grown == NULL) {
+                    ret = -1;
+                    goto out;
+                }
+                holes = grown;
+                grown = realloc(hashes, cap * HASH_LENGTH);
+                if (grown == NULL) {
+                    ret = -1;
+                    goto out;
+                }
+                hashes = grown;
+            }
+            holes[n_removed] = pos + i * (BLOCK_PAIR);
+            memcpy(hashes + n_removed * HASH_LENGTH, pairs + i * (BLOCK_PAIR) + sizeof(off_t), HASH_LENGTH);
+            n_removed++;
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+    if (n_removed == 0) {
+        goto out;
+    }
+
+    // an inline block that stays is read before the map is cut
+    pos = BLOCK_START + file->total_blocks * (BLOCK_PAIR);
+    map_end = s_lseek(file->fd, 0, SEEK_END);
+    if (map_end > pos) {
+        tail_len = min(map_end - pos, (off_t)BLOCK_SIZE);
+        for (i=0; i<n_removed; i++) {
+            if (cfs_hash_is_inline(hashes + i * HASH_LENGTH)) {
+                tail_len = 0;
+            }
+        }
+        if (tail_len > 0 && (tail_len = s_pread(file->fd, tail, tail_len, pos)) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    // as many pairs to keep lie past the new end as holes before it
+    total = file->total_blocks - n_removed;
+    pos = BLOCK_START + total * (BLOCK_PAIR);
+    left = n_removed;
+    while (left > 0 && n_holes < n_removed && holes[n_holes] < BLOCK_START + total * (BLOCK_PAIR)) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        n = bytes_read > 0 ? bytes_read / (BLOCK_PAIR) : 0;
+        if (n == 0) {
+            log_error("CFS: Scan pairs");
+            ret = -1;
+            goto out;
+        }
+
+        for (i=0; i<n; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index >= first && index < end) {
+                continue;
+            }
+            if (s_pwrite(file->fd, pairs + i * (BLOCK_PAIR), BLOCK_PAIR, holes[n_holes]) < 0) {
+                ret = -1;
+                goto out;
+            }
+            n_holes++;
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+
+    if (ftruncate(file->fd, BLOCK_START + total * (BLOCK_PAIR)) < 0 ||
+        (tail_len > 0 && s_pwrite(file->fd, tail, tail_len, BLOCK_START + total * (BLOCK_PAIR)) < 0)) {
+        log_error("CFS: Cut pairs");
+        ret = -1;
+        goto out;
+    }
+    file->total_blocks = total;
+
+    // only once nothing points to them any more
+    for (i=0; i<n_removed; i++) {
+        cfs_file_release(state, file, hashes + i * HASH_LENGTH);
+    }
+
+out:
+    free(holes);
+    free(hashes);
+
+    return ret;
+}
+
+
+/*
+    Cut or extend *file* to *size* bytes, like ftruncate(2).
+    Blocks past the new end are unmapped and released, a block cut in the
+    middle is stored, or inlined, again with its new size. Growing only moves
+    the end, the blocks in between read as zeroes.
+    Returns 0 or -errno.
+*/
+int cfs_file_truncate(cfs_state_t* state, cfs_file_t* file, const off_t size)
+{
+    cfs_block_t blk_buf;
+    cfs_dirty_t* dirty;
+    const off_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const size_t tail = size % BLOCK_SIZE;
+    off_t old_size;
+    size_t i, readers;
+    int inlined, ret = 0;
+
+    pthread_mutex_lock(&file->lock);
+    // staged blocks must not be mapped after the cut
+    if (state->pipeline) {
+        pipeline_drain(state->pipeline, file);
+    }
+    old_size = cfs_file_size(file);
+
+    // buffered blocks past the end are dropped, the one cut short is zeroed
+    for (i=0; file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        dirty = &file->dirty[i];
+        if (dirty->block.index == -1) {
+            continue;
+        }
+        if (dirty->block.index >= keep) {
+            dirty->block.index = -1;
+            file->n_dirty--;
+        } else if (dirty->block.index == keep - 1 && tail > 0 && dirty->block.size > tail) {
+            memset(dirty->block.data + tail, '\0', dirty->block.size - tail);
+            dirty->block.size = tail;
+        }
+    }
+
+    if (size < old_size && tail > 0 && cfs_dirty_find(file, keep - 1) == NULL) {
+        blk_buf.size = 0;
+        blk_buf.data = buffers_get(&state->buffers);
+        if (blk_buf.data == NULL || cfs_file_read_block(state, file, keep - 1, &blk_buf) < 0) {
+            ret = -EIO;
+        } else if (blk_buf.size > tail) {
+            inlined = cfs_file_inline_block(state, file, keep - 1, blk_buf.data, tail, size);
+            if (inlined < 0 || (!inlined && cfs_file_register_block(state, file, keep - 1, blk_buf.data, tail) < 0)) {
+                ret = -EIO;
+            }
+        }
+        if (ret < 0) {
+            log_msg("\n CFS: cannot cut block [%lld] of %s\n", (long long)(keep - 1), file->path);
+        }
+        buffers_put(&state->buffers, blk_buf.data);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    if (ret == 0 && size < old_size && cfs_file_unmap(state, file, keep, CFS_INDEX_MAX) < 0) {
+        ret = -EIO;
+    }
+    if (ret == 0) {
+        file->size = size;
+        file->staged_end = min(file->staged_end, size);
+        if (cfs_file_write_header(file) < 0) {
+            ret = -EIO;
+        }
+    }
+    readers = file->readers;
+    pthread_mutex_unlock(&state->lock);
+
+    // the staging extent keeps no data past the end either, unless a read still splices from it
+    if (ret == 0 && size < old_size && readers == 0 && cfs_file_stage_fd(state, file, 0) >= 0 &&
+        ftruncate(file->stage_fd, keep * BLOCK_SIZE) < 0) {
+        ret = log_error("cfs_file_truncate staging");
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
+}
+
+
+/*
+    Truncate the file at *path* like truncate(2), whether it is open or not.
+    Returns 0 or -errno.
+*/
+int cfs_truncate(cfs_state_t* state, const char* path, const off_t size)
+{
+    cfs_file_t* file;
+    int fd, ret;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (cfs_register_file(state, path, fd) < 0) {
+        close(fd);
+        return -EIO;
+    }
+
+    file = cfs_get_file(state, fd);
+    ret = cfs_file_truncate(state, file, size);
+    if (cfs_release_file(state, fd) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+    close(fd);
+
+    return ret;
+}
+
+
+/*
+    Allocate, punch or zero [offset, offset + len) of *file* like fallocate(2),
+    *mode* may hold FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE and
+    FALLOC_FL_ZERO_RANGE. Whole blocks in the range are unmapped and released,
+    only the blocks it starts or ends in the middle of get zeroes written.
+    Blocks are shared, so there is no space to reserve, allocating only moves
+    the end.
+    Returns 0 or -errno.
+*/
+int cfs_file_fallocate(cfs_state_t* state, cfs_file_t* file, const int mode, const off_t offset, const off_t len)
+{
+    static const char zeroes[BLOCK_SIZE];
+    const off_t end = offset + len;
+    off_t size, zero_end, first = 0, last = 0;
+    cfs_dirty_t* dirty;
+    ssize_t written;
+    size_t i;
+    int ret = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
+    }
+    // same rules as the kernel, a hole never moves the end
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE))) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (end < offset) {
+        return -EFBIG;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    size = cfs_file_size(file);
+    pthread_mutex_unlock(&file->lock);
+
+    // past the end everything reads as zeroes already
+    zero_end = min(end, size);
+    if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) && offset < zero_end) {
+        first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        last = zero_end == size ? (size + BLOCK_SIZE - 1) / BLOCK_SIZE : zero_end / BLOCK_SIZE;
+
+        if (offset < first * BLOCK_SIZE) {
+            written = cfs_file_write(state, file, zeroes, min(first * BLOCK_SIZE, zero_end) - offset, offset);
+            if (written < 0) {
+                return written;
+            }
+        }
+        if (last >= first && last * BLOCK_SIZE < zero_end) {
+            written = cfs_file_write(state, file, zeroes, zero_end - last * BLOCK_SIZE, last * BLOCK_SIZE);
+            if (written < 0) {
+                return written;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&file->lock);
+    // staged blocks must not be mapped into the hole afterwards
+    if (first < last && state->pipeline) {
+        pipeline_drain(state->pipeline, file);
+    }
+    size = cfs_file_size(file);
+
+    // buffered blocks in the hole are dropped
+    for (i=0; first < last && file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        dirty = &file->dirty[i];
+        if (dirty->block.index >= first && dirty->block.index < last) {
+            dirty->block.index = -1;
+            file->n_dirty--;
+        }
+    }
+
+    pthread_mutex_lock(&state->lock);
+    if (first < last && cfs_file_unmap(state, file, first, last) < 0) {
+        ret = -EIO;
+    }
+    if (ret == 0 && (first < last || (!(mode & FALLOC_FL_KEEP_SIZE) && end > size))) {
+        // the unmapped blocks may have held the end
+        file->size = (mode & FALLOC_FL_KEEP_SIZE) ? size : max(size, end);
+        if (cfs_file_write_header(file) < 0) {
+            ret = -EIO;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
+}
+
+
+/*
+    Hand every buffered block of *file* over and wait until all of them are
+    mapped, so its block map alone describes it.
+    Caller must hold the file lock.
+*/
+static int cfs_file_settle(cfs_state_t* state, cfs_file_t* file)
+{
+    int ret = 0;
+    size_t i;
+
+    for (i=0; file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        if (file->dirty[i].block.index != -1) {
+            ret |= cfs_dirty_store(state, file, &file->dirty[i]);
+        }
+    }
+    if (state->pipeline) {
+        pipeline_drain(state->pipeline, file);
+    }
+
+    return ret;
+}
+
+
+/*
+    Lock two files, always in the same order, so copies between them in
+    both directions don't deadlock.
+*/
+static void cfs_lock_files(cfs_file_t* a, cfs_file_t* b)
+{
+    if (a == b) {
+        pthread_mutex_lock(&a->lock);
+        return;
+    }
+    pthread_mutex_lock(a < b ? &a->lock : &b->lock);
+    pthread_mutex_lock(a < b ? &b->lock : &a->lock);
+}
+
+
+static void cfs_unlock_files(cfs_file_t* a, cfs_file_t* b)
+{
+    pthread_mutex_unlock(&a->lock);
+    if (a != b) {
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+
+static int cfs_mapping_hash_cmp(const void* a, const void* b)
+{
+    const cfs_mapping_t* x = *(const cfs_mapping_t* const*)a;
+    const cfs_mapping_t* y = *(const cfs_mapping_t* const*)b;
+
+    return memcmp(x->hash, y->hash, HASH_LENGTH);
+}
+
+
+/*
+    Append *n* pairs cloned from *src* to the map of *dst*, none of their
+    blocks may be mapped there yet. Every stored block gets one reference
+    update for all its copies, a staged one has its data copied from the
+    staging extent of *src*, *shift* blocks further. An inline block stays
+    inline, unless *dst* has one already, then it is stored.
+    Blocks that can't be referenced are left out.
+    Caller must hold both file locks and the state lock.
+*/
+static int cfs_file_append_clones(cfs_state_t* state, cfs_file_t* src, cfs_file_t* dst, cfs_mapping_t* maps,
+    const size_t n, const off_t shift)
+{
+    const cfs_mapping_t** sorted;
+    char* added;
+    char data[BLOCK_SIZE];
+    char tail[BLOCK_SIZE];
+    unsigned char hash[HASH_LENGTH];
+    size_t n_added = 0, i, j, k;
+    ssize_t size, tail_len = -1;
+    int ret = 0;
+
+    sorted = malloc(n * sizeof(cfs_mapping_t*));
+    added = malloc(n * (BLOCK_PAIR));
+    if (sorted == NULL || added == NULL) {
+        free(sorted);
+        free(added);
+        return -1;
+    }
+
+    for (i=0; i<n; i++) {
+        sorted[i] = &maps[i];
+    }
+    qsort(sorted, n, sizeof(cfs_mapping_t*), cfs_mapping_hash_cmp);
+
+    for (i=0; i<n; i=j) {
+        for (j=i+1; j<n && memcmp(sorted[j]->hash, sorted[i]->hash, HASH_LENGTH) == 0; j++);
+
+        if (cfs_hash_is_staged(sorted[i]->hash)) {
+            // staged data belongs to one file, it is copied
+            for (k=i; k<j; k++) {
+                if (cfs_file_stage_fd(state, src, 0) < 0 || cfs_file_stage_fd(state, dst, 1) < 0 ||
+                    s_pread(src->stage_fd, data, BLOCK_SIZE, (sorted[k]->index - shift) * BLOCK_SIZE) < 0 ||
+                    s_pwrite(dst->stage_fd, data, BLOCK_SIZE, sorted[k]->index * BLOCK_SIZE) < 0) {
+                    ret = -1;
+                    continue;
+                }
+                memcpy(added + n_added * (BLOCK_PAIR), &sorted[k]->index, sizeof(off_t));
+                memcpy(added + n_added * (BLOCK_PAIR) + sizeof(off_t), sorted[k]->hash, HASH_LENGTH);
+                n_added++;
+            }
+            continue;
+        }
+
+        if (cfs_hash_is_inline(sorted[i]->hash)) {
+            // copied to the end of the map of dst, if nothing is there yet
+            for (k=i; k<j; k++) {
+                size = cfs_file_read_inline(src, sorted[k]->hash, data);
+                memcpy(hash, sorted[k]->hash, HASH_LENGTH);
+                if (size < 0) {
+                    ret = -1;
+                    continue;
+                }
+                if (tail_len < 0 && s_lseek(dst->fd, 0, SEEK_END) == BLOCK_START + dst->total_blocks * (BLOCK_PAIR)) {
+                    memcpy(tail, data, size);
+                    tail_len = size;
+                } else {
+                    calculate_hash(data, size, hash);
+                    if (store_block_in(state->storage, cfs_file_region(state, dst), (unsigned char*)data, size, hash) < 0) {
+                        ret = -1;
+                        continue;
+                    }
+                }
+                memcpy(added + n_added * (BLOCK_PAIR), &sorted[k]->index, sizeof(off_t));
+                memcpy(added + n_added * (BLOCK_PAIR) + sizeof(off_t), hash, HASH_LENGTH);
+                n_added++;
+            }
+            continue;
+        }
+
+        if (block_add_ref(state->storage, sorted[i]->hash, j - i) <= 0) {
+            log_msg("\n CFS: cannot share a block of %s\n", src->path);
+            ret = -1;
+            continue;
+        }
+        for (k=i; k<j; k++) {
+            memcpy(added + n_added * (BLOCK_PAIR), &sorted[k]->index, sizeof(off_t));
+            memcpy(added + n_added * (BLOCK_PAIR) + sizeof(off_t), sorted[k]->hash, HASH_LENGTH);
+            n_added++;
+        }
+    }
+
+    if (n_added > 0) {
+        cfs_file_mark_unsynced(state, dst);
+        if (cfs_file_append_pairs(dst, added, n_added) < 0 || (tail_len >= 0 &&
+            s_pwrite(dst->fd, tail, tail_len, BLOCK_START + (dst->total_blocks + n_added) * (BLOCK_PAIR)) < 0)) {
+            ret = -1;
+        } else {
+            dst->total_blocks += n_added;
+        }
+    }
+
+    free(sorted);
+    free(added);
+
+    return ret;
+}
+
+
+/*
+    Point the blocks of *dst* from *off_out* on to the blocks *src* maps
+    from *off_in* on, for up to *len* bytes. Both offsets start a block.
+    A block *src* ends with short is only shared if it ends *dst* too.
+    Returns the bytes cloned, or -errno.
+*/
+static ssize_t cfs_file_clone_blocks(cfs_state_t* state, cfs_file_t* src, const off_t off_in, cfs_file_t* dst,
+    const off_t off_out, size_t len)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    cfs_mapping_t* maps;
+    off_t src_size, dst_size, first_in, first_out, count, index, pos, left;
+    size_t bytes, n = 0, k, i;
+    ssize_t bytes_read;
+    int ret;
+
+    maps = malloc(CFS_CLONE_BLOCKS * sizeof(cfs_mapping_t));
+    if (maps == NULL) {
+        return -ENOMEM;
+    }
+
+    cfs_lock_files(src, dst);
+    ret = cfs_file_settle(state, src);
+    if (dst != src) {
+        ret |= cfs_file_settle(state, dst);
+    }
+    src_size = cfs_file_size(src);
+    dst_size = cfs_file_size(dst);
+    len = off_in < src_size ? min(len, (size_t)(src_size - off_in)) : 0;
+    bytes = len / BLOCK_SIZE * BLOCK_SIZE;
+    if (bytes < len && off_in + len == src_size && off_out + len >= dst_size) {
+        // the short last block ends the copy in both files
+        bytes = len;
+    }
+    if (ret != 0 || bytes == 0) {
+        cfs_unlock_files(src, dst);
+        free(maps);
+        return ret != 0 ? -EIO : 0;
+    }
+
+    first_in = off_in / BLOCK_SIZE;
+    first_out = off_out / BLOCK_SIZE;
+    count = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // the blocks of dst in the way are dropped first, the clones are then
+    // appended without looking for pairs to replace
+    pthread_mutex_lock(&state->lock);
+    if (off_out < dst_size && cfs_file_unmap(state, dst, first_out, first_out + count) < 0) {
+        ret = -1;
+    }
+
+    pos = BLOCK_START;
+    left = src->total_blocks;
+    while (ret == 0 && left > 0) {
+        k = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(src->fd, pairs, k * (BLOCK_PAIR), pos);
+        k = bytes_read > 0 ? bytes_read / (BLOCK_PAIR) : 0;
+        if (k == 0) {
+            ret = bytes_read < 0 ? -1 : 0;
+            break;
+        }
+
+        for (i=0; ret == 0 && i<k; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index < first_in || index >= first_in + count) {
+                continue;
+            }
+            maps[n].index = index - first_in + first_out;
+            memcpy(maps[n].hash, pairs + i * (BLOCK_PAIR) + sizeof(off_t), HASH_LENGTH);
+            n++;
+            if (n == CFS_CLONE_BLOCKS) {
+                ret = cfs_file_append_clones(state, src, dst, maps, n, first_out - first_in);
+                n = 0;
+                // other files get a turn, these two stay locked
+                pthread_mutex_unlock(&state->lock);
+                pthread_mutex_lock(&state->lock);
+            }
+        }
+
+        pos += k * (BLOCK_PAIR);
+        left -= k;
+    }
+    if (ret == 0 && n > 0) {
+        ret = cfs_file_append_clones(state, src, dst, maps, n, first_out - first_in);
+    }
+
+    dst->size = max(dst->size, (off_t)(off_out + bytes));
+    if (cfs_file_write_header(dst) < 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&state->lock);
+    cfs_unlock_files(src, dst);
+    free(maps);
+
+    return ret < 0 ? -EIO : (ssize_t)bytes;
+}
+
+
+/*
+    Copy *len* bytes by reading and writing them.
+*/
+static ssize_t cfs_file_copy_bytes(cfs_state_t* state, cfs_file_t* src, const off_t off_in, cfs_file_t* dst,
+    const off_t off_out, const size_t len)
+{
+    char* buf;
+    size_t done = 0, n;
+    ssize_t ret = 0;
+
+    buf = malloc(min(len, CFS_COPY_BUFFER));
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    while (done < len) {
+        n = min(len - done, CFS_COPY_BUFFER);
+        ret = cfs_file_read(state, src, buf, n, off_in + done);
+        if (ret <= 0) {
+            break;
+        }
+        ret = cfs_file_write(state, dst, buf, ret, off_out + done);
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    free(buf);
+
+    return ret < 0 ? ret : (ssize_t)done;
+}
+
+
+/*
+    Copy *len* bytes at *off_in* of *src* to *off_out* of *dst*, like
+    copy_file_range(2). Whole blocks are not copied, *dst* just maps the
+    blocks of *src* as well. Only what doesn't fill a block is read and
+    written, or all of it when the offsets sit differently inside a block.
+    Returns the bytes copied, or -errno.
+*/
+ssize_t cfs_file_copy_range(cfs_state_t* state, cfs_file_t* src, const off_t off_in, cfs_file_t* dst, const off_t off_out,
+    size_t len)
+{
+    off_t src_size;
+    size_t head, done = 0;
+    ssize_t ret;
+
+    pthread_mutex_lock(&src->lock);
+    src_size = cfs_file_size(src);
+    pthread_mutex_unlock(&src->lock);
+    if (off_in >= src_size || len == 0) {
+        return 0;
+    }
+    len = min(len, (size_t)(src_size - off_in));
+    if (src == dst && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+        return -EINVAL;
+    }
+
+    if (off_in % BLOCK_SIZE != off_out % BLOCK_SIZE) {
+        return cfs_file_copy_bytes(state, src, off_in, dst, off_out, len);
+    }
+
+    head = min(len, (size_t)((BLOCK_SIZE - off_in % BLOCK_SIZE) % BLOCK_SIZE));
+    if (head > 0) {
+        ret = cfs_file_copy_bytes(state, src, off_in, dst, off_out, head);
+        if (ret < (ssize_t)head) {
+            return ret;
+        }
+        done = head;
+    }
+
+    ret = cfs_file_clone_blocks(state, src, off_in + done, dst, off_out + done, len - done);
+    if (ret < 0) {
+        return done > 0 ? (ssize_t)done : ret;
+    }
+    done += ret;
+
+    if (done < len) {
+        // the tail of a block that can't be shared
+        ret = cfs_file_copy_bytes(state, src, off_in + done, dst, off_out + done, len - done);
+        if (ret < 0) {
+            return done > 0 ? (ssize_t)done : ret;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
+
+/*
+    Make *dst* a copy of the file at *path*, sharing all of its blocks.
+    *uid* and *gid* must be allowed to read it, the daemon itself might
+    read anything. Supplementary groups are not looked at.
+    Returns 0 or -errno.
+*/
+int cfs_clone(cfs_state_t* state, const char* path, cfs_file_t* dst, const uid_t uid, const gid_t gid)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    size_t len;
+    int fd, ret;
+
+    // only files of this file system, never the block store
+    if (realpath(path, real) == NULL) {
+        return -errno;
+    }
+    len = strlen(state->root);
+    if (strncmp(real, state->root, len) != 0 || real[len] != '/' ||
+        strncmp(real, state->storage->blocks_path, strlen(state->storage->blocks_path)) == 0) {
+        return -EXDEV;
+    }
+
+    // the handle is shared with whoever else has the file open, they may write
+    fd = open(real, O_RDWR);
+    if (fd < 0 && errno == EACCES) {
+        fd = open(real, O_RDONLY);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -EINVAL;
+    }
+    if (uid != 0 && !(st.st_uid == uid ? st.st_mode & S_IRUSR :
+        st.st_gid == gid ? st.st_mode & S_IRGRP : st.st_mode & S_IROTH)) {
+        close(fd);
+        return -EACCES;
+    }
+    if (cfs_register_file(state, real, fd) < 0) {
+        close(fd);
+        return -EIO;
+    }
+    ret = cfs_file_clone(state, cfs_get_file(state, fd), dst);
+    cfs_release_file(state, fd);
+    close(fd);
+
+    return ret;
+}
+
+
+/*
+    Make *dst* a copy of *src*, sharing all of its blocks.
+    Returns 0 or -errno.
+*/
+int cfs_file_clone(cfs_state_t* state, cfs_file_t* src, cfs_file_t* dst)
+{
+    off_t size, done = 0;
+    ssize_t ret;
+
+    if (src == dst) {
+        return 0;
+    }
+
+    ret = cfs_file_truncate(state, dst, 0);
+    pthread_mutex_lock(&src->lock);
+    size = cfs_file_size(src);
+    pthread_mutex_unlock(&src->lock);
+    while (ret >= 0 && done < size) {
+        ret = cfs_file_copy_range(state, src, done, dst, done, size - done);
+        if (ret == 0) {
+            ret = -EIO;
+        }
+        done += ret > 0 ? ret : 0;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+
+/*
+    Smallest index in [from, end) of a block of *file* holding data, mapped,
+    buffered or in the pipeline, with one pass over the map. Returns *end*
+    if there is none, or -1 if the map can't be read.
+    Caller must hold the file lock, the pipeline lock and the state lock.
+*/
+static off_t cfs_file_next_mapped(cfs_state_t* state, cfs_file_t* file, const off_t from, const off_t end)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    off_t pos = BLOCK_START, left = file->total_blocks, next = end, index;
+    ssize_t bytes_read;
+    size_t n, i;
+
+    for (i=0; file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        index = file->dirty[i].block.index;
+        if (index >= from && index < next) {
+            next = index;
+        }
+    }
+    if (state->pipeline) {
+        next = pipeline_next(state->pipeline, file, from, next);
+    }
+
+    // the map is not ordered, only a block at *from* ends the scan early
+    while (left > 0 && next > from) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        if (bytes_read < 0) {
+            log_error("CFS: Scan pairs");
+            return -1;
+        }
+        n = bytes_read / (BLOCK_PAIR);
+        if (n == 0) {
+            break;
+        }
+
+        for (i=0; i<n; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index >= from && index < next) {
+                next = index;
+            }
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+
+    return next;
+}
+
+
+/*
+    Set bit i of *bits* if block *base* + i of *file* holds data, for the
+    CFS_RUN_WINDOW blocks from *base* on that are before *end*.
+    Returns 0, or -1 if the map can't be read.
+    Caller must hold the file lock, the pipeline lock and the state lock.
+*/
+static int cfs_file_mapped_window(cfs_state_t* state, cfs_file_t* file, const off_t base, const off_t end,
+    unsigned char* bits)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    const off_t stop = min(base + CFS_RUN_WINDOW, end);
+    off_t pos = BLOCK_START, left = file->total_blocks, index;
+    ssize_t bytes_read;
+    size_t n, i;
+
+    memset(bits, 0, CFS_RUN_WINDOW / 8);
+    for (i=0; file->n_dirty > 0 && i<CFS_DIRTY_BLOCKS; i++) {
+        index = file->dirty[i].block.index;
+        if (index >= base && index < stop) {
+            bits[(index - base) / 8] |= 1 << ((index - base) % 8);
+        }
+    }
+    for (index = base; state->pipeline && index < stop; index++) {
+        index = pipeline_next(state->pipeline, file, index, stop);
+        if (index < stop) {
+            bits[(index - base) / 8] |= 1 << ((index - base) % 8);
+        }
+    }
+
+    while (left > 0) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        if (bytes_read < 0) {
+            log_error("CFS: Scan pairs");
+            return -1;
+        }
+        n = bytes_read / (BLOCK_PAIR);
+        if (n == 0) {
+            break;
+        }
+
+        for (i=0; i<n; i++) {
+            memcpy(&index, pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            if (index >= base && index < stop) {
+                bits[(index - base) / 8] |= 1 << ((index - base) % 8);
+            }
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+
+    return 0;
+}
+
+
+static int cfs_bit_is_set(const unsigned char* bits, const off_t i)
+{
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+
+/*
+    List the runs of blocks of *file* holding data from *start* on, at most
+    *max* of them, in order. The first one starts at the block *start* falls
+    in at the earliest, the last one ends at the end of the file. Everything
+    between them is a hole and reads as zeroes. Buffered blocks and blocks
+    in the pipeline count as they will be mapped.
+    Returns the number of runs filled in, or -errno.
+*/
+ssize_t cfs_file_map_extents(cfs_state_t* state, cfs_file_t* file, const off_t start, cfs_map_extent_t* extents,
+    const size_t max)
+{
+    unsigned char bits[CFS_RUN_WINDOW / 8];
+    off_t size, end, index, i;
+    size_t filled = 0;
+    int ret = 0, full = 0;
+
+    pthread_mutex_lock(&file->lock);
+    if (state->pipeline) {
+        pthread_mutex_lock(&state->pipeline->lock);
+    }
+    pthread_mutex_lock(&state->lock);
+    size = cfs_file_size(file);
+    end = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // a window at a time, a run going on past one is followed into the next
+    index = cfs_file_next_mapped(state, file, start / BLOCK_SIZE, end);
+    while (index >= 0 && index < end && !full) {
+        if (cfs_file_mapped_window(state, file, index, end, bits) < 0) {
+            ret = -EIO;
+            break;
+        }
+        for (i=0; i<CFS_RUN_WINDOW && index + i < end; i++) {
+            if (!cfs_bit_is_set(bits, i)) {
+                continue;
+            }
+            if (filled > 0 && extents[filled - 1].offset + extents[filled - 1].length == (index + i) * BLOCK_SIZE) {
+                extents[filled - 1].length = min((index + i + 1) * BLOCK_SIZE, size) - extents[filled - 1].offset;
+                continue;
+            }
+            if (filled == max) {
+                full = 1;
+                break;
+            }
+            extents[filled].offset = (index + i) * BLOCK_SIZE;
+            extents[filled].length = min((index + i + 1) * BLOCK_SIZE, size) - extents[filled].offset;
+            filled++;
+        }
+        // stop at a full list unless its last run reaches the next window
+        full |= filled == max && !cfs_bit_is_set(bits, i - 1);
+        index = cfs_file_next_mapped(state, file, index + i, end);
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (state->pipeline) {
+        pthread_mutex_unlock(&state->pipeline->lock);
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    if (index < 0) {
+        return -EIO;
+    }
+    return ret < 0 ? ret : (ssize_t)filled;
+}
+
+
+/*
+    Answer CFS_IOC_MAP for *file*.
+    Returns 0 or -errno.
+*/
+int cfs_file_map(cfs_state_t* state, cfs_file_t* file, cfs_map_arg_t* map)
+{
+    ssize_t n;
+
+    if (map->start < 0) {
+        return -EINVAL;
+    }
+    n = cfs_file_map_extents(state, file, map->start, map->extents, CFS_MAP_EXTENTS);
+    if (n < 0) {
+        return n;
+    }
+    map->count = n;
+    pthread_mutex_lock(&file->lock);
+    map->size = cfs_file_size(file);
+    pthread_mutex_unlock(&file->lock);
+
+    return 0;
+}
+
+
+/*
+    Where the next data or hole of *file* at or after *offset* starts, for
+    lseek(2) with SEEK_DATA or SEEK_HOLE. The end of the file counts as a
+    hole. Buffered blocks and blocks in the pipeline are data already,
+    nothing is written back to answer.
+    Returns the offset, or -errno.
+*/
+off_t cfs_file_seek(cfs_state_t* state, cfs_file_t* file, const off_t offset, const int whence)
+{
+    unsigned char bits[CFS_RUN_WINDOW / 8];
+    off_t size, end, index, base, ret;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    if (offset < 0) {
+        return -ENXIO;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (state->pipeline) {
+        pthread_mutex_lock(&state->pipeline->lock);
+    }
+    pthread_mutex_lock(&state->lock);
+    size = cfs_file_size(file);
+    end = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    index = offset / BLOCK_SIZE;
+    if (offset >= size) {
+        ret = -ENXIO;
+    } else if (whence == SEEK_DATA) {
+        index = cfs_file_next_mapped(state, file, index, end);
+        ret = index < 0 ? -EIO : index == end ? -ENXIO : max(offset, index * BLOCK_SIZE);
+    } else {
+        // walk the run *offset* is in to its end, a window of it per pass
+        base = index;
+        do {
+            if (cfs_file_mapped_window(state, file, base, end, bits) < 0) {
+                index = -1;
+                break;
+            }
+            while (index < end && index - base < CFS_RUN_WINDOW && cfs_bit_is_set(bits, index - base)) {
+                index++;
+            }
+            base += CFS_RUN_WINDOW;
+        } while (index == base && index < end);
+        ret = index < 0 ? -EIO : max(offset, min(index * BLOCK_SIZE, size));
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (state->pipeline) {
+        pthread_mutex_unlock(&state->pipeline->lock);
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret;
+}
+
+
+static int cfs_hash_is_staged(const unsigned char* hash)
+{
+    return memcmp(hash, STAGED_MARK, STAGED_MARK_LEN) == 0;
+}
+
+
+static size_t cfs_staged_size(const unsigned char* hash)
+{
+    uint32_t size;
+
+    memcpy(&size, hash + STAGED_MARK_LEN, sizeof(size));
+    return size;
+}
+
+
+static void cfs_staged_hash(unsigned char* hash, const size_t size)
+{
+    uint32_t size_buf = size;
+
+    memcpy(hash, STAGED_MARK, STAGED_MARK_LEN);
+    memcpy(hash + STAGED_MARK_LEN, &size_buf, sizeof(size_buf));
+}
+
+
+static int cfs_hash_is_inline(const unsigned char* hash)
+{
+    return memcmp(hash, INLINE_MARK, INLINE_MARK_LEN) == 0;
+}
+
+
+static size_t cfs_inline_size(const unsigned char* hash)
+{
+    // the size sits where it does in a staged hash
+    return cfs_staged_size(hash);
+}
+
+
+static void cfs_inline_hash(unsigned char* hash, const size_t size)
+{
+    uint32_t size_buf = size;
+
+    memcpy(hash, INLINE_MARK, INLINE_MARK_LEN);
+    memcpy(hash + INLINE_MARK_LEN, &size_buf, sizeof(size_buf));
+}
+
+
+/*
+    Descriptor of the staging extent of *file*, opened on first use.
+    Caller must hold the file lock.
+*/
+static int cfs_file_stage_fd(cfs_state_t* state, cfs_file_t* file, const int create)
+{
+    if (file->stage_fd < 0) {
+        file->stage_fd = open_staging(state->storage, file->ino, O_RDWR | (create ? O_CREAT : 0));
+        if (file->stage_fd < 0 && create) {
+            log_error("CFS: Open staging extent");
+        }
+    }
+
+    return file->stage_fd;
+}
+
+
+/*
+    Offline mode write, data goes to the staging extent at its logical offset.
+    A stored block is copied to the extent whole on its first write, after that
+    only the written range is. The map is only touched when a block becomes
+    staged or grows.
+*/
+static ssize_t cfs_file_write_staged(cfs_state_t* state, cfs_file_t* file, const char* buf, const size_t size, const off_t offset)
+{
+    unsigned char block[BLOCK_SIZE];
+    unsigned char hash[HASH_LENGTH];
+    char found, staged;
+    off_t current_offset = offset;
+    off_t buffer_index = 0;
+    off_t left, right, index;
+    ssize_t old_size, ret = 0;
+
+    pthread_mutex_lock(&file->lock);
+    if (cfs_file_stage_fd(state, file, 1) < 0) {
+        pthread_mutex_unlock(&file->lock);
+        return -EIO;
+    }
+
+    while (current_offset < offset + size) {
+        index = current_offset / BLOCK_SIZE;
+        left = current_offset % BLOCK_SIZE;
+        right = min(BLOCK_SIZE, left + offset + size - current_offset);
+
+        pthread_mutex_lock(&state->lock);
+        ret = cfs_file_find_hashes(state, file, index, 1, hash, &found);
+        pthread_mutex_unlock(&state->lock);
+        if (ret < 0) {
+            break;
+        }
+        staged = found && cfs_hash_is_staged(hash);
+
+        if (staged) {
+            old_size = cfs_staged_size(hash);
+            ret = s_pwrite(file->stage_fd, buf + buffer_index, right - left, index * BLOCK_SIZE + left);
+        } else {
+            // first write since the block was stored, stage a whole image of it
+            old_size = 0;
+            if (found && cfs_hash_is_inline(hash)) {
+                pthread_mutex_lock(&state->lock);
+                old_size = cfs_file_read_inline(file, hash, (char*)block);
+                pthread_mutex_unlock(&state->lock);
+            } else if (found) {
+                old_size = load_block_range(state->storage, hash, block, 0, BLOCK_SIZE);
+            }
+            if (old_size < 0) {
+                ret = -1;
+                break;
+            }
+            memset(block + old_size, '\0', BLOCK_SIZE - old_size);
+            memcpy(block + left, buf + buffer_index, right - left);
+            ret = s_pwrite(file->stage_fd, block, BLOCK_SIZE, index * BLOCK_SIZE);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        if (!staged || right > old_size) {
+            cfs_staged_hash(hash, max(old_size, right));
+            pthread_mutex_lock(&state->lock);
+            ret = cfs_file_map_block(state, file, index, max(old_size, right), hash);
+            pthread_mutex_unlock(&state->lock);
+        }
+
+        current_offset += right - left;
+        buffer_index += right - left;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret < 0 ? -EIO : size;
+}
+
+
+/*
+    List the staged blocks of *file* into a new array, returns how many.
+*/
+int cfs_file_staged_blocks(cfs_state_t* state, cfs_file_t* file, off_t** indices)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    off_t pos = BLOCK_START;
+    off_t left;
+    ssize_t bytes_read;
+    size_t n, i, found = 0;
+    off_t* list;
+
+    pthread_mutex_lock(&state->lock);
+    left = file->total_blocks;
+    list = malloc(sizeof(off_t) * max(left, 1));
+    if (list == NULL) {
+        pthread_mutex_unlock(&state->lock);
+        return -1;
+    }
+
+    while (left > 0) {
+        n = min(left, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(file->fd, pairs, n * (BLOCK_PAIR), pos);
+        n = bytes_read > 0 ? bytes_read / (BLOCK_PAIR) : 0;
+        if (n == 0) {
+            break;
+        }
+
+        for (i=0; i<n; i++) {
+            if (cfs_hash_is_staged((unsigned char*)pairs + i * (BLOCK_PAIR) + sizeof(off_t))) {
+                memcpy(&list[found++], pairs + i * (BLOCK_PAIR), sizeof(off_t));
+            }
+        }
+
+        pos += n * (BLOCK_PAIR);
+        left -= n;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    *indices = list;
+    return found;
+}
+
+
+/*
+    Move block *index* of *file* from the staging extent to the block store.
+    Returns the bytes converted, 0 if the block is no longer staged.
+*/
+ssize_t cfs_file_dedup_block(cfs_state_t* state, cfs_file_t* file, const off_t index)
+{
+    cfs_block_t blk_buf;
+    unsigned char hash[HASH_LENGTH];
+    char found;
+    ssize_t ret;
+
+    pthread_mutex_lock(&file->lock);
+    pthread_mutex_lock(&state->lock);
+    ret = cfs_file_find_hashes(state, file, index, 1, hash, &found);
+    pthread_mutex_unlock(&state->lock);
+    if (ret <= 0 || !cfs_hash_is_staged(hash)) {
+        // rewritten or truncated meanwhile
+        pthread_mutex_unlock(&file->lock);
+        return ret;
+    }
+
+    blk_buf.index = index;
+    blk_buf.size = cfs_staged_size(hash);
+    blk_buf.data = buffers_get(&state->buffers);
+    if (blk_buf.data == NULL || cfs_file_stage_fd(state, file, 0) < 0 ||
+        s_pread(file->stage_fd, blk_buf.data, blk_buf.size, index * BLOCK_SIZE) < 0) {
+        pthread_mutex_unlock(&file->lock);
+        buffers_put(&state->buffers, blk_buf.data);
+        return -1;
+    }
+
+    ret = cfs_file_inline_block(state, file, index, blk_buf.data, blk_buf.size, cfs_file_size(file));
+    if (ret == 0) {
+        ret = cfs_file_register_block(state, file, index, blk_buf.data, blk_buf.size);
+    }
+    pthread_mutex_unlock(&file->lock);
+    buffers_put(&state->buffers, blk_buf.data);
+
+    return ret < 0 ? ret : blk_buf.size;
+}
+
+
+/*
+    Delete the staging extent of *file* once nothing is staged in it any more.
+    Left alone while other handles are open, their last release requeues the file.
+*/
+int cfs_file_drop_staging(cfs_state_t* state, cfs_file_t* file)
+{
+    off_t* indices;
+    int refs, n;
+
+    pthread_mutex_lock(&state->lock);
+    refs = file->refs;
+    pthread_mutex_unlock(&state->lock);
+    if (refs > 1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    n = cfs_file_staged_blocks(state, file, &indices);
+    if (n == 0) {
+        if (file->stage_fd >= 0) {
+            close(file->stage_fd);
+            file->stage_fd = -1;
+        }
+        remove_staging(state->storage, file->ino);
+    }
+    pthread_mutex_unlock(&file->lock);
+    if (n >= 0) {
+        free(indices);
+    }
+
+    return n == 0 ? 0 : -1;
+}
+
+
+/*
+    Write *size* bytes at *offset* from *buf*.
+    Whole blocks are staged right away. Partial blocks are patched in the
+    write-back buffer and only staged once a write reaches the end of a full
+    block, or when they are evicted or flushed.
+*/
+ssize_t cfs_file_write(cfs_state_t* state, cfs_file_t* file, const char* buf, const size_t size, const off_t offset)
+{
+    cfs_dirty_t* dirty;
+    size_t whole, i;
+    off_t current_offset = offset;
+    off_t buffer_index = 0;
+    off_t left, right; // helper indexes inside the current block
+    int ret = 0;
+
+    if (state->config.offline) {
+        return cfs_file_write_staged(state, file, buf, size, offset);
+    }
+
+    pthread_mutex_lock(&file->lock);
+    while (current_offset < offset + size) {
+        left = current_offset % BLOCK_SIZE;
+        right = min(BLOCK_SIZE, left + offset + size - current_offset);
+        dirty = cfs_dirty_find(file, current_offset / BLOCK_SIZE);
+
+        if (left == 0 && right == BLOCK_SIZE) {
+            // every whole block up to the end of the write is replaced, old
+            // contents don't matter. They are hashed straight from the caller's buffer.
+            whole = (offset + size - current_offset) / BLOCK_SIZE;
+            for (i=0; i<whole; i++) {
+                dirty = cfs_dirty_find(file, current_offset / BLOCK_SIZE + i);
+                if (dirty) {
+                    dirty->block.index = -1;
+                    file->n_dirty--;
+                }
+            }
+            ret = cfs_file_stage_blocks(state, file, current_offset / BLOCK_SIZE, buf + buffer_index, whole);
+            right = whole * BLOCK_SIZE;
+        } else {
+            if (dirty == NULL) {
+                dirty = cfs_dirty_get(state, file, current_offset / BLOCK_SIZE);
+                if (dirty == NULL) {
+                    ret = -1;
+                    break;
+                }
+            }
+            memcpy(dirty->block.data + left, buf + buffer_index, right - left);
+            dirty->block.size = max(dirty->block.size, (size_t)right); // Careful here, dont remove leading hole
+            dirty->used = ++file->dirty_clock;
+
+            if (right == BLOCK_SIZE && dirty->block.size == BLOCK_SIZE) {
+                // block is complete
+                ret = cfs_dirty_store(state, file, dirty);
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        log_msg("\n CFS: write block: left %d, right %d, crnt_off: %d, buff_idx: %d\n",
+            left, right, current_offset, buffer_index);
+
+        current_offset += right - left;
+        buffer_index += right - left;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    return ret < 0 ? -EIO : size;
+}
+
+
+/*
+    Copy *len* bytes at *offset* of an in memory block, past its end reads as zeroes.
+*/
+static void cfs_copy_block(char* dst, const cfs_block_t* block, const off_t offset, const size_t len)
+{
+    size_t avail = block->size > offset ? block->size - offset : 0;
+
+    avail = min(avail, len);
+    memcpy(dst, block->data + offset, avail);
+    memset(dst + avail, '\0', len - avail);
+}
+
+
+typedef struct {
+    const cfs_blk_store_t* storage;
+    unsigned char hash[HASH_LENGTH];
+    int stage_fd; /* set when the block is still in the staging extent */
+    off_t stage_pos;
+    int placed; /* read straight from its region at loc, len may span several blocks */
+    cfs_block_loc_t loc;
+    cfs_buffers_t* buffers; /* set for a direct store, the whole block is loaded into one of these */
+    cfs_cache_t* cache; /* takes the loaded block, or NULL */
+    int fd; /* left in this file at pos instead of being loaded, or -1 */
+    off_t pos;
+    char* dst;
+    off_t offset; /* offset inside the block */
+    size_t len;
+    cfs_batch_t* batch;
+} cfs_read_job_t;
+
+
+/*
+    Load the whole block of *job* into an aligned buffer, which a direct
+    store reads with O_DIRECT, and copy its range out. The block is then
+    left in the cache, if there is one.
+    Returns the bytes of the range the block holds, or -1.
+*/
+static ssize_t cfs_read_job_direct(cfs_read_job_t* job)
+{
+    char* data;
+    size_t avail;
+    ssize_t ret;
+
+    data = buffers_get(job->buffers);
+    if (data == NULL) {
+        return load_block_range(job->storage, job->hash, (unsigned char*)job->dst, job->offset, job->len);
+    }
+
+    if (job->placed) {
+        ret = load_region_range(job->storage, &job->loc, (unsigned char*)data, 0, BLOCK_SIZE);
+        ret = ret < 0 ? ret : min(ret, (ssize_t)job->loc.size);
+    } else {
+        ret = load_block_range(job->storage, job->hash, (unsigned char*)data, 0, BLOCK_SIZE);
+    }
+    if (ret >= 0) {
+        avail = ret > job->offset ? min((size_t)(ret - job->offset), job->len) : 0;
+        memcpy(job->dst, data + job->offset, avail);
+        if (job->cache) {
+            cache_insert(job->cache, job->hash, &data, ret);
+        }
+        ret = avail;
+    }
+    buffers_put(job->buffers, data);
+
+    return ret;
+}
+
+
+static void cfs_read_job(void* arg)
+{
+    cfs_read_job_t* job = (cfs_read_job_t*)arg;
+    size_t staged_size;
+    ssize_t ret;
+
+    if (job->stage_fd >= 0) {
+        staged_size = cfs_staged_size(job->hash);
+        staged_size = staged_size > job->offset ? staged_size - job->offset : 0;
+        ret = s_pread(job->stage_fd, job->dst, min(staged_size, job->len), job->stage_pos + job->offset);
+    } else if (job->buffers) {
+        ret = cfs_read_job_direct(job);
+    } else if (job->placed) {
+        ret = load_region_range(job->storage, &job->loc, (unsigned char*)job->dst, job->offset, job->len);
+    } else {
+        ret = load_block_range(job->storage, job->hash, (unsigned char*)job->dst, job->offset, job->len);
+    }
+    if (ret >= 0 && ret < job->len) {
+        // short block, the rest reads as zeroes
+        memset(job->dst + ret, '\0', job->len - ret);
+    }
+
+
+    batch_done(job->batch, ret < 0 ? -EIO : 0);
+}
+
+
+/*
+    Readahead state of *file*, created on first use. NULL if disabled.
+    Caller must hold the file lock.
+*/
+static cfs_readahead_t* cfs_file_readahead(cfs_state_t* state, cfs_file_t* file)
+{
+    cfs_readahead_t* ra;
+
+    if (file->ra == NULL && state->config.readahead > 0) {
+        ra = malloc(sizeof(cfs_readahead_t));
+        if (ra && readahead_init(ra, state->storage, &state->ra_pool, &state->buffers, state->config.readahead) < 0) {
+            free(ra);
+            ra = NULL;
+        }
+        // stats walk the files under the state lock
+        pthread_mutex_lock(&state->lock);
+        file->ra = ra;
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    return file->ra;
+}
+
+
+/*
+    Prefetch the stored blocks ahead of a read of [first, first + count), if
+    the reader is sequential.
+*/
+static void cfs_file_prefetch(cfs_state_t* state, cfs_file_t* file, cfs_readahead_t* ra,
+    const off_t first, const size_t count)
+{
+    unsigned char* hashes;
+    char* found;
+    off_t start;
+    size_t n, i;
+    int ret;
+
+    n = readahead_access(ra, first, count, &start);
+    if (n == 0) {
+        return;
+    }
+
+    hashes = malloc(n * HASH_LENGTH);
+    found = malloc(n);
+    if (hashes == NULL || found == NULL) {
+        free(hashes);
+        free(found);
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    ret = cfs_file_find_hashes(state, file, start, n, hashes, found);
+    pthread_mutex_unlock(&state->lock);
+
+    for (i=0; ret >= 0 && i<n; i++) {
+        if (found[i] && !cfs_hash_is_staged(hashes + i * HASH_LENGTH) && !cfs_hash_is_inline(hashes + i * HASH_LENGTH)) {
+            readahead_fetch(ra, start + i, hashes + i * HASH_LENGTH);
+        }
+    }
+
+    free(hashes);
+    free(found);
+}
+
+
+/*
+    Open the file *job* would load from, if its whole range is in there.
+    Returns 0 with job->fd and job->pos set, -1 to load it instead.
+*/
+static int cfs_read_job_open(cfs_read_job_t* job)
+{
+    struct stat st;
+    int fd;
+
+    if (job->stage_fd >= 0) {
+        if (cfs_staged_size(job->hash) < job->offset + job->len || (fd = dup(job->stage_fd)) < 0) {
+            return -1;
+        }
+        job->pos = job->stage_pos;
+    } else {
+        fd = open_block_data(job->storage, job->hash, job->placed ? &job->loc : NULL, &job->pos);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    // short blocks read as zeroes past their end, a file can't splice those
+    job->pos += job->offset;
+    if (fstat(fd, &st) < 0 || st.st_size < job->pos + job->len) {
+        close(fd);
+        return -1;
+    }
+    job->fd = fd;
+
+    return 0;
+}
+
+
+/*
+    Read *size* bytes at *offset* into *buf*.
+    All hashes of the range are resolved under one lock acquisition, then the
+    blocks are loaded concurrently, straight into *buf*. Holes read as zeroes.
+    Consecutive blocks stored back to back in one region are loaded with a
+    single read, unless the store is direct: its blocks are loaded whole and
+    kept in the block cache. Blocks a sequential reader will want next are
+    prefetched meanwhile.
+    With *extents*, ranges of at least a block that sit whole in one file are
+    left there instead and returned as descriptors, the caller splices them.
+*/
+static ssize_t cfs_file_read_range(cfs_state_t* state, cfs_file_t* file, char* buf, const size_t size, const off_t offset,
+    cfs_extent_t** extents, size_t* n_extents)
+{
+    off_t first, block_start, left, right;
+    size_t count, i;
+    unsigned char* hashes;
+    char* found;
+    cfs_read_job_t* jobs;
+    cfs_batch_t batch;
+    cfs_dirty_t* dirty;
+    cfs_stage_t* staged;
+    cfs_readahead_t* ra;
+    cfs_extent_t* ext = NULL;
+    size_t n_jobs = 0, n_ext = 0, done = 0;
+    ssize_t run = -1, last = -1;
+    int ret, stage_fd = -1;
+
+    if (size == 0) {
+        if (extents) {
+            *extents = NULL;
+            *n_extents = 0;
+        }
+        return 0;
+    }
+
+    first = offset / BLOCK_SIZE;
+    count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+
+    hashes = malloc(count * HASH_LENGTH);
+    found = malloc(count);
+    jobs = malloc(count * sizeof(cfs_read_job_t));
+    if (extents) {
+        // one extent per block at most, neighbouring memory ones are merged
+        ext = malloc((count + 1) * sizeof(cfs_extent_t));
+    }
+    if (hashes == NULL || found == NULL || jobs == NULL || (extents && ext == NULL)) {
+        free(hashes);
+        free(found);
+        free(jobs);
+        free(ext);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (state->pipeline) {
+        // staged blocks must stay put until they are overlaid
+        pthread_mutex_lock(&state->pipeline->lock);
+    }
+    pthread_mutex_lock(&state->lock);
+    ret = cfs_file_find_hashes(state, file, first, count, hashes, found);
+    for (i=0; ret > 0 && i<count; i++) {
+        if (found[i]) {
+            cfs_file_cache_hash(file, first + i, hashes + i * HASH_LENGTH);
+        }
+        // the map moves it as pairs are added, so it is read right away
+        if (found[i] && cfs_hash_is_inline(hashes + i * HASH_LENGTH)) {
+            block_start = (first + i) * BLOCK_SIZE;
+            left = max(offset, block_start);
+            right = min((off_t)(offset + size), block_start + BLOCK_SIZE);
+            if (cfs_file_read_inline_range(file, hashes + i * HASH_LENGTH, buf + (left - offset),
+                left - block_start, right - left) < 0) {
+                ret = -1;
+                break;
+            }
+            found[i] = 2;
+        }
+    }
+    // the blocks must outlive their mapping until they are loaded
+    file->readers++;
+    pthread_mutex_unlock(&state->lock);
+
+    for (i=0; ret >= 0 && state->pipeline && i<count; i++) {
+        staged = pipeline_find(state->pipeline, file, first + i);
+        if (staged) {
+            block_start = (first + i) * BLOCK_SIZE;
+            left = max(offset, block_start);
+            right = min((off_t)(offset + size), block_start + BLOCK_SIZE);
+            cfs_copy_block(buf + (left - offset), &staged->block, left - block_start, right - left);
+            found[i] = 2;
+        }
+    }
+    if (state->pipeline) {
+        pthread_mutex_unlock(&state->pipeline->lock);
+    }
+    if (ret < 0) {
+        pthread_mutex_lock(&state->lock);
+        cfs_file_unpin(state, file);
+        pthread_mutex_unlock(&state->lock);
+        pthread_mutex_unlock(&file->lock);
+        free(hashes);
+        free(found);
+        free(jobs);
+        free(ext);
+        return -EIO;
+    }
+
+    // buffered blocks are newer than anything staged or stored
+    for (i=0; i<count; i++) {
+        if (found[i] == 1 && cfs_hash_is_staged(hashes + i * HASH_LENGTH)) {
+            stage_fd = cfs_file_stage_fd(state, file, 0);
+        }
+        dirty = cfs_dirty_find(file, first + i);
+        if (dirty) {
+            block_start = (first + i) * BLOCK_SIZE;
+            left = max(offset, block_start);
+            right = min((off_t)(offset + size), block_start + BLOCK_SIZE);
+            cfs_copy_block(buf + (left - offset), &dirty->block, left - block_start, right - left);
+            found[i] = 2;
+        }
+    }
+    ra = cfs_file_readahead(state, file);
+    pthread_mutex_unlock(&file->lock);
+
+    batch_init(&batch);
+    for (i=0; i<count; i++) {
+        block_start = (first + i) * BLOCK_SIZE;
+        left = max(offset, block_start);
+        right = min((off_t)(offset + size), block_start + BLOCK_SIZE);
+        jobs[i].batch = NULL;
+        jobs[i].fd = -1;
+
+        if (found[i] == 2) {
+            // already served from the write-back buffer
+            continue;
+        } else if (!found[i]) {
+            // No block at this index
+            memset(buf + (left - offset), '\0', right - left);
+            continue;
+        }
+
+        jobs[i].storage = state->storage;
+        memcpy(jobs[i].hash, hashes + i * HASH_LENGTH, HASH_LENGTH);
+        jobs[i].stage_fd = cfs_hash_is_staged(jobs[i].hash) ? stage_fd : -1;
+        jobs[i].stage_pos = block_start;
+        if (jobs[i].stage_fd < 0 && cfs_hash_is_staged(jobs[i].hash)) {
+            // staging extent is missing, nothing to read
+            memset(buf + (left - offset), '\0', right - left);
+            continue;
+        }
+        jobs[i].dst = buf + (left - offset);
+        jobs[i].offset = left - block_start;
+        jobs[i].len = right - left;
+        jobs[i].buffers = jobs[i].stage_fd < 0 && state->storage->direct ? &state->buffers : NULL;
+        jobs[i].cache = state->cache;
+        if (jobs[i].buffers && state->cache &&
+            cache_copy(state->cache, jobs[i].hash, jobs[i].dst, jobs[i].offset, jobs[i].len)) {
+            continue;
+        }
+        if (ra && jobs[i].stage_fd < 0 &&
+            readahead_copy(ra, first + i, jobs[i].hash, jobs[i].dst, jobs[i].offset, jobs[i].len)) {
+            continue;
+        }
+
+        jobs[i].placed = jobs[i].stage_fd < 0 && block_locate(state->storage, jobs[i].hash, &jobs[i].loc) == 1;
+        if (jobs[i].placed && !jobs[i].buffers && last >= 0 && last == (ssize_t)i - 1 && jobs[last].placed &&
+            strcmp(jobs[i].loc.region, jobs[last].loc.region) == 0 &&
+            jobs[i].loc.offset == jobs[last].loc.offset + BLOCK_SIZE) {
+            // stored right after the previous block, load both with one read
+            jobs[run].len += jobs[i].len;
+            last = i;
+            continue;
+        }
+        run = last = i;
+        jobs[i].batch = &batch;
+        n_jobs++;
+    }
+
+    for (i=0; ext && i<count; i++) {
+        // a direct store keeps its blocks out of the page cache, which splicing would fill
+        if (jobs[i].batch && !jobs[i].buffers && jobs[i].len >= BLOCK_SIZE && cfs_read_job_open(&jobs[i]) == 0) {
+            jobs[i].batch = NULL;
+            n_jobs--;
+        }
+        if (jobs[i].fd < 0) {
+            continue;
+        }
+        if (jobs[i].dst > buf + done) {
+            ext[n_ext].fd = -1;
+            ext[n_ext].mem = buf + done;
+            ext[n_ext].len = jobs[i].dst - (buf + done);
+            ext[n_ext].own = 0;
+            n_ext++;
+        }
+        ext[n_ext].fd = jobs[i].fd;
+        ext[n_ext].pos = jobs[i].pos;
+        ext[n_ext].mem = NULL;
+        ext[n_ext].len = jobs[i].len;
+        // the pin keeps a block's file linked, regions and the staging extent are reused
+        ext[n_ext].own = jobs[i].stage_fd < 0 && !jobs[i].placed;
+        n_ext++;
+        done = jobs[i].dst + jobs[i].len - buf;
+    }
+    if (ext && done < size) {
+        ext[n_ext].fd = -1;
+        ext[n_ext].mem = buf + done;
+        ext[n_ext].len = size - done;
+        ext[n_ext].own = 0;
+        n_ext++;
+    }
+
+    for (i=0; i<count; i++) {
+        if (jobs[i].batch == NULL) {
+            continue;
+        }
+        batch_add(&batch);
+        if (n_jobs == 1) {
+            // nothing to overlap with, skip the hand-off
+            cfs_read_job(&jobs[i]);
+        } else {
+            pool_submit(&state->io_pool, cfs_read_job, &jobs[i]);
+        }
+    }
+    if (ra) {
+        cfs_file_prefetch(state, file, ra, first, count);
+    }
+    ret = batch_wait(&batch);
+    batch_destroy(&batch);
+
+    free(hashes);
+    free(found);
+    free(jobs);
+
+    if (ext) {
+        // answering the read lets the last handle go, the extents keep the file
+        pthread_mutex_lock(&state->lock);
+        file->refs++;
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (ext && ret < 0) {
+        cfs_extents_release(state, file, ext, n_ext);
+    } else if (ext) {
+        // the extents still read from the blocks, they unpin when released
+        *extents = ext;
+        *n_extents = n_ext;
+    } else {
+        pthread_mutex_lock(&state->lock);
+        cfs_file_unpin(state, file);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    return ret < 0 ? ret : size;
+}
+
+
+ssize_t cfs_file_read(cfs_state_t* state, cfs_file_t* file, char* buf, const size_t size, const off_t offset)
+{
+    return cfs_file_read_range(state, file, buf, size, offset, NULL, NULL);
+}
+
+
+/*
+    Read like cfs_file_read(), but describe the result as *extents* the
+    caller can splice from. Memory extents point into *buf*, the rest is left
+    in block store files. The blocks stay pinned and the file open until the
+    extents are released with cfs_extents_release() once sent, do so
+    promptly: writes keep references to replaced blocks meanwhile.
+*/
+ssize_t cfs_file_read_extents(cfs_state_t* state, cfs_file_t* file, char* buf, const size_t size, const off_t offset,
+    cfs_extent_t** extents, size_t* n_extents)
+{
+    return cfs_file_read_range(state, file, buf, size, offset, extents, n_extents);
+}
+
+
+/*
+    Close the *extents* a read of *file* returned, unpin its blocks and drop
+    the reference they held, which may close the file.
+    A descriptor whose extent is marked own may be taken over before, by
+    setting its fd to -1.
+*/
+void cfs_extents_release(cfs_state_t* state, cfs_file_t* file, cfs_extent_t* extents, const size_t n_extents)
+{
+    size_t i;
+
+    for (i=0; i<n_extents; i++) {
+        if (extents[i].fd >= 0) {
+            close(extents[i].fd);
+        }
+    }
+    free(extents);
+
+    pthread_mutex_lock(&state->lock);
+    cfs_file_unpin(state, file);
+    pthread_mutex_unlock(&state->lock);
+    cfs_put_file(state, file);
+}
+
+
+/*
+    Print dedup bypass counters to *buf*, like snprintf.
+    Hashing time saved is estimated from what the pipeline spent per byte.
+*/
+static int cfs_bypass_stats(cfs_state_t* state, char* buf, size_t size)
+{
+    cfs_bypass_stats_t stats;
+    unsigned long long hash_ns = 0, hashed_bytes = 0;
+    size_t i, j, files = 0;
+
+    pthread_mutex_lock(&state->lock);
+    stats = state->bypass_stats;
+    for (i=0; i<state->fds_cap; i++) {
+        if (state->files[i] == NULL || !state->files[i]->bypass) {
+            continue;
+        }
+        // count files, not handles
+        for (j=0; j<i && state->files[j] != state->files[i]; j++);
+        files += j == i;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    if (state->pipeline) {
+        pthread_mutex_lock(&state->pipeline->lock);
+        hash_ns = state->pipeline->stats.hash_ns;
+        hashed_bytes = state->pipeline->stats.hashed_bytes;
+        pthread_mutex_unlock(&state->pipeline->lock);
+    }
+
+    return snprintf(buf, size,
+        "bypass_files %zu\n"
+        "bypass_switches %zu\n"
+        "bypass_blocks %zu\n"
+        "bypass_bytes %zu\n"
+        "bypass_hash_saved_us %llu\n",
+        files, stats.switches, stats.blocks, stats.bytes,
+        hashed_bytes ? (unsigned long long)((double)stats.bytes * hash_ns / hashed_bytes / 1000) : 0);
+}
+
+
+/*
+    Print readahead counters of closed and open files to *buf*, like snprintf.
+*/
+static int cfs_readahead_stats(cfs_state_t* state, char* buf, size_t size)
+{
+    cfs_readahead_stats_t stats;
+    size_t i, j;
+
+    pthread_mutex_lock(&state->lock);
+    stats = state->ra_stats;
+    for (i=0; i<state->fds_cap; i++) {
+        if (state->files[i] == NULL || state->files[i]->ra == NULL) {
+            continue;
+        }
+        for (j=0; j<i && state->files[j] != state->files[i]; j++);
+        if (j == i) {
+            readahead_stats_add(&stats, state->files[i]->ra);
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return snprintf(buf, size,
+        "readahead_sequential %zu\n"
+        "readahead_stopped %zu\n"
+        "readahead_prefetched %zu\n"
+        "readahead_hits %zu\n"
+        "readahead_waits %zu\n"
+        "readahead_wasted %zu\n",
+        stats.sequential, stats.stopped, stats.prefetched,
+        stats.hits, stats.waits, stats.wasted);
+}
+
+
+/*
+    Print runtime counters of the file system to *buf*, like snprintf, but
+    returns the length actually printed: counters that do not fit in *size*
+    are cut.
+*/
+int cfs_stats(cfs_state_t* state, char* buf, size_t size)
+{
+    int ret = 0;
+
+    if (state->pipeline) {
+        ret += pipeline_stats(state->pipeline, buf, size);
+    }
+    if (state->dedup && ret < size) {
+        ret += dedup_stats(state->dedup, buf + ret, size - ret);
+    }
+    if (ret < size) {
+        ret += cfs_bypass_stats(state, buf + ret, size - ret);
+    }
+    if (ret < size) {
+        pthread_mutex_lock(&state->lock);
+        ret += snprintf(buf + ret, size - ret,
+            "unchanged_blocks %zu\n"
+            "inline_blocks %zu\n",
+            state->unchanged_blocks, state->inline_blocks);
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (ret < size) {
+        ret += cfs_readahead_stats(state, buf + ret, size - ret);
+    }
+    if (ret < size) {
+        ret += buffers_stats(&state->buffers, buf + ret, size - ret);
+    }
+    if (state->cache && ret < size) {
+        ret += cache_stats(state->cache, buf + ret, size - ret);
+    }
+    if (ret < size) {
+        pthread_mutex_lock(&state->sync_lock);
+        ret += snprintf(buf + ret, size - ret,
+            "store_syncs %zu\n"
+            "store_syncs_saved %zu\n",
+            state->store_syncs, state->store_syncs_saved);
+        pthread_mutex_unlock(&state->sync_lock);
+    }
+    if (ret < size) {
+        pthread_mutex_lock(&state->stat_lock);
+        ret += snprintf(buf + ret, size - ret,
+            "stat_cache_hits %zu\n"
+            "stat_cache_misses %zu\n",
+            state->stat_hits, state->stat_misses);
+        pthread_mutex_unlock(&state->stat_lock);
+    }
+    if (ret >= size) {
+        // callers copy the text out of buf
+        ret = size > 0 ? size - 1 : 0;
+    }
+
+    return ret;
+}
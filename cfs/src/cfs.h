@@ -3,56 +3,317 @@
 
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <openssl/sha.h>
 #include <pthread.h>
 
 #include "storage.h"
+#include "pool.h"
+#include "buffers.h"
+#include "cache.h"
 
 #define FDS_STORE_INITIAL 20
+#define CFS_IO_THREADS 8 /* workers used to load the blocks of one read concurrently */
+#define CFS_SCAN_PAIRS 256 /* index-hash pairs read per syscall while scanning a file */
+#define CFS_RUN_WINDOW 32768 /* blocks a pass over the map follows a run of mapped blocks for */
+#define CFS_DIRTY_BLOCKS 8 /* partially written blocks buffered per file */
+#define CFS_STAT_CACHE 65536 /* closed files whose logical size is remembered */
+#define CFS_CLONE_BLOCKS 65536 /* pairs appended per metadata update while cloning */
+#define CFS_COPY_BUFFER (1024 * 1024) /* bytes read and written at a time where blocks can't be shared */
+#define CFS_INDEX_MAX ((off_t)(~0ULL >> 1)) /* past every block index */
+#define CFS_SNAPSHOT_THREADS 8 /* files copied, or blocks released, in parallel by a snapshot */
+#define CFS_HASH_CACHE 1024 /* hashes of mapped blocks remembered per open file, to spot unchanged rewrites */
+#define CFS_INLINE_MAX 2048 /* last blocks of files smaller than this are kept in the block map */
 
-#define MAGIC "CFS0.1"
+#define CFS_DEDUP_BUDGET (32 * 1024 * 1024) /* bytes per second the offline deduplicator may read */
+#define CFS_BYPASS_WINDOW 1024 /* blocks written before deciding whether a file dedups at all */
+#define CFS_BYPASS_SAMPLE 64 /* while bypassing, hash one in this many blocks */
+#define CFS_BYPASS_SAMPLES 16 /* samples taken before deciding to dedup again */
+#define CFS_BYPASS_MIN_HITS 1 /* percent of blocks that must dedup to keep hashing */
+
+/*
+    Hash of a block whose data still lives in the file's staging extent.
+    The mark fills the first STAGED_MARK_LEN bytes, the rest holds the block size.
+*/
+#define STAGED_MARK "CFS-STAGED-DATA"
+#define STAGED_MARK_LEN sizeof(STAGED_MARK)
+
+/*
+    Hash of a block whose data follows the index-hash pairs in the block map
+    itself, a file has one at most. Same layout as STAGED_MARK.
+*/
+#define INLINE_MARK "CFS-INLINE-DATA"
+#define INLINE_MARK_LEN sizeof(INLINE_MARK)
+
+#define CFS_XATTR_STATS "user.cfs.stats" /* read-only, runtime counters of the whole mount */
+
+/*
+    ioctl on an open file: replace its contents with those of the file at
+    *path*, relative to the root of the mount, sharing every block.
+*/
+typedef struct {
+    char path[PATH_MAX];
+} cfs_clone_arg_t;
+
+#define CFS_IOC_CLONE _IOW('C', 1, cfs_clone_arg_t)
+
+/*
+    ioctls on a directory: capture the tree under it as snapshot *name*, or
+    delete snapshot *name*. Snapshots are read-only copies of the block maps
+    under CFS_SNAPSHOTS_DIRECTORY, sharing every block.
+*/
+typedef struct {
+    char name[NAME_MAX + 1];
+} cfs_snapshot_arg_t;
+
+#define CFS_IOC_SNAPSHOT _IOW('C', 2, cfs_snapshot_arg_t)
+#define CFS_IOC_SNAPSHOT_DELETE _IOW('C', 3, cfs_snapshot_arg_t)
+#define CFS_SNAPSHOTS_DIRECTORY ".snapshots" /* under the root */
+
+/* A run of mapped blocks, see cfs_file_map_extents() */
+typedef struct {
+    off_t offset;
+    off_t length;
+} cfs_map_extent_t;
+
+/*
+    ioctl on an open file: list the runs of mapped blocks from *start* on,
+    everything between them reads as zeroes. Fewer than CFS_MAP_EXTENTS
+    runs means the list reached the end of the file, otherwise ask again
+    from the end of the last one.
+*/
+#define CFS_MAP_EXTENTS 1000 /* the argument must fit the 14 bit size of an ioctl */
+
+typedef struct {
+    off_t start; /* in */
+    off_t size; /* out, of the file */
+    unsigned int count; /* out */
+    cfs_map_extent_t extents[CFS_MAP_EXTENTS];
+} cfs_map_arg_t;
+
+#define CFS_IOC_MAP _IOWR('C', 4, cfs_map_arg_t)
+
+/*
+    Block maps may carry inline data since CFS0.2, builds reading only CFS0.1
+    would take a map holding some for a plain file. Older maps are still read,
+    their header is rewritten with the current magic on the first change.
+*/
+#define MAGIC "CFS0.2"
+#define MAGIC_V1 "CFS0.1"
 #define SIZE_START sizeof(MAGIC)
 #define TOTAL_BLOCKS_START SIZE_START + sizeof(off_t)
 #define BLOCK_START sizeof(off_t) * 2 + sizeof(MAGIC)
 #define BLOCK_PAIR sizeof(off_t) + SHA_DIGEST_LENGTH
 
 typedef struct {
-    char path[PATH_MAX];
-    off_t offset;
-    off_t size;
-    off_t total_blocks;
-    int fd;
-} cfs_file_t;
+    off_t index;
+    size_t size;
+    char* data; /* BLOCK_SIZE bytes from the block buffers of the state */
+} cfs_block_t ;
 
+/* Where one block of a file now points, see cfs_file_map_blocks() */
 typedef struct {
     off_t index;
     size_t size;
-    char data[4096];
-} cfs_block_t ;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} cfs_mapping_t;
+
+/* The block an index was last seen mapped to */
+typedef struct {
+    off_t index; /* -1 when the entry is free */
+    unsigned char hash[SHA_DIGEST_LENGTH];
+} cfs_cached_hash_t;
+
+/* A partially written block, kept in memory until it is complete */
+typedef struct {
+    cfs_block_t block; /* index is -1 when the slot is free */
+    unsigned long used; /* last access, for eviction */
+} cfs_dirty_t;
+
+/* A piece of a read, either in memory or left in a file to be spliced from */
+typedef struct {
+    int fd; /* -1 when the data is at mem */
+    off_t pos;
+    char* mem;
+    size_t len;
+    int own; /* fd is a block's own file, its data outlives cfs_extents_release() */
+} cfs_extent_t;
+
+typedef struct cfs_pipeline cfs_pipeline_t;
+typedef struct cfs_dedup cfs_dedup_t;
+typedef struct cfs_readahead cfs_readahead_t;
+
+typedef struct {
+    int offline; /* write plain staging extents, deduplicate them in the background */
+    size_t dedup_budget; /* bytes per second, 0 for unlimited */
+    size_t bypass_window; /* blocks, 0 never bypasses dedup */
+    size_t bypass_sample;
+    size_t readahead; /* most blocks prefetched for a sequential reader, 0 never prefetches */
+    int regions; /* place the new blocks of each open file in its own region */
+    size_t stat_cache; /* entries, 0 reads the header of every closed file stat'ed */
+    size_t inline_max; /* bytes, a smaller last block is kept in the block map, 0 never inlines */
+    int huge_pages; /* back the block buffers with huge pages where the system has them */
+    int direct_store; /* read and write region slots with O_DIRECT, hot blocks are cached by CFS */
+    size_t block_cache; /* blocks cached with a direct store, 0 caches none */
+    char* blocks_dir; /* block store, NULL keeps it in BLOCKS_DIRECTORY under the root */
+} cfs_config_t;
+
+/* Logical size of a closed file, valid while its block map is unchanged */
+typedef struct {
+    dev_t dev;
+    ino_t ino; /* of the block map, 0 when the entry is free */
+    struct timespec mtime;
+    off_t map_size;
+    off_t size;
+    off_t total_blocks;
+} cfs_stat_entry_t;
+
+typedef struct {
+    size_t blocks;
+    size_t bytes;
+    size_t switches; /* times a file stopped deduplicating */
+} cfs_bypass_stats_t;
+
+typedef struct {
+    size_t sequential; /* reads that followed the previous one */
+    size_t stopped; /* prefetching stopped by a random read */
+    size_t prefetched; /* blocks loaded ahead */
+    size_t hits; /* block reads served from prefetched blocks */
+    size_t waits; /* hits that still had to wait for the load */
+    size_t wasted; /* prefetched blocks dropped unread */
+} cfs_readahead_stats_t;
+
+typedef struct cfs_file {
+    char path[PATH_MAX]; /* as first opened, for logging, renames don't update it */
+    off_t offset;
+    off_t size;
+    off_t total_blocks;
+    int fd; /* private duplicate, shared by every open handle of this file */
+    int refs;
+    int closing; /* 1 while the last release syncs it, 2 once reopened meanwhile, state lock */
+    struct cfs_file* next; /* in the list of open files */
+    dev_t dev; /* of the block map, open handles are matched by it and ino */
+    ino_t ino;
+    int stage_fd; /* staging extent, -1 until needed */
+    int unlinked; /* its last link is gone, the last release removes the staging extent, state lock */
+    cfs_readahead_t* ra; /* created by the first read */
+    cfs_region_t* region; /* where new blocks are placed, opened by the first store */
+
+    /* write-back buffer */
+    cfs_dirty_t* dirty;
+    size_t n_dirty;
+    unsigned long dirty_clock;
+
+    /* dedup yield, protected by the state lock */
+    size_t window_blocks;
+    size_t window_hits;
+    int bypass; /* low yield, blocks go to the staging extent unhashed */
+    int bypassing; /* write side view of bypass, protected by the file lock */
+    size_t bypass_count; /* blocks bypassed since the last sample, file lock */
+
+    /* recently mapped or read, by index modulo CFS_HASH_CACHE, protected by the state lock */
+    cfs_cached_hash_t* hashes; /* created by the first one */
+
+    /* blocks unmapped while reads still load them, protected by the state lock */
+    size_t readers;
+    unsigned char* released; /* hashes, their references are dropped after the last reader */
+    size_t n_released;
+    size_t released_cap;
+
+    unsigned long store_gen; /* of the last block mapped, its fsync syncs the store up to it, state lock */
+
+    /* blocks handed to the pipeline, protected by its lock */
+    size_t pending;
+    off_t staged_end;
+    int error;
+
+    pthread_mutex_t lock;
+} cfs_file_t;
 
 typedef struct {
     char *root;
+    cfs_config_t config;
     long max_fds;
     cfs_blk_store_t* storage;
+    cfs_pool_t io_pool;
+    cfs_buffers_t buffers; /* of every block held in memory */
+    cfs_cache_t* cache; /* of a direct store, NULL otherwise */
+    cfs_pipeline_t* pipeline; /* NULL when blocks are stored synchronously */
+    cfs_dedup_t* dedup; /* offline mode only */
+    cfs_bypass_stats_t bypass_stats;
+    size_t unchanged_blocks; /* rewritten with the data they held, nothing stored, state lock */
+    size_t inline_blocks; /* kept in their block map instead of the store, state lock */
+
+    /* block store durability, see cfs_file_fsync() */
+    unsigned long store_gen; /* bumped by every block mapped, state lock */
+    unsigned long closed_gen; /* highest store_gen of the files closed so far, state lock */
+    unsigned long synced_gen; /* covered by the last store sync, sync lock */
+    size_t store_syncs; /* fsyncs that synced the store, sync lock */
+    size_t store_syncs_saved; /* fsyncs whose blocks an earlier store sync covered, sync lock */
+    pthread_mutex_t sync_lock;
+    cfs_pool_t ra_pool; /* prefetches, kept apart from the reads waiting on io_pool */
+    cfs_readahead_stats_t ra_stats; /* of files no longer open */
+
+    /* sizes of closed files by inode, see cfs_file_stat() */
+    cfs_stat_entry_t* stat_cache; /* NULL when disabled */
+    size_t stat_hits;
+    size_t stat_misses;
+    pthread_mutex_t stat_lock;
 
-    /* file state */
-    cfs_file_t* files;
+    /* file state, handles of the same file share one cfs_file_t */
+    cfs_file_t** files;
     int* fds;
     size_t n_fds;
     size_t fds_cap; /* current size of dynamic array */
+    cfs_file_t* open_files; /* every file with a reference, handle or not, until it is closed */
     /* ----------- */
 
     pthread_mutex_t lock;
 } cfs_state_t;
 
-int cfs_init(cfs_state_t *state, const char* rootdir);
+void cfs_default_config(cfs_config_t* config);
+int cfs_init(cfs_state_t *state, const char* rootdir, const cfs_config_t* config);
 int cfs_destroy(cfs_state_t* state);
 cfs_file_t* cfs_get_file(cfs_state_t* state, int fd);
-int cfs_file_stat(cfs_state_t* state, const char* path, cfs_file_t* stat_buf);
+int cfs_file_stat(cfs_state_t* state, const char* path, const struct stat* st, cfs_file_t* stat_buf);
+void cfs_stat_forget(cfs_state_t* state, const struct stat* st);
+void cfs_unlinked(cfs_state_t* state, const struct stat* st);
 int cfs_create_file(cfs_state_t* state, const char* path, mode_t mode);
+int cfs_create_open(cfs_state_t* state, const char* path, mode_t mode);
 int cfs_register_file(cfs_state_t* state, const char* path, const int fd);
 int cfs_release_file(cfs_state_t* state, const int fd);
+int cfs_file_find_hashes(const cfs_state_t* state, const cfs_file_t* file, const off_t first, const size_t count,
+    unsigned char* hashes, char* found);
+ssize_t cfs_file_read(cfs_state_t* state, cfs_file_t* file, char* buf, const size_t size, const off_t offset);
+ssize_t cfs_file_read_extents(cfs_state_t* state, cfs_file_t* file, char* buf, const size_t size, const off_t offset,
+    cfs_extent_t** extents, size_t* n_extents);
+void cfs_extents_release(cfs_state_t* state, cfs_file_t* file, cfs_extent_t* extents, const size_t n_extents);
+ssize_t cfs_file_write(cfs_state_t* state, cfs_file_t* file, const char* buf, const size_t size, const off_t offset);
+int cfs_file_flush(cfs_state_t* state, cfs_file_t* file);
+int cfs_file_sync(cfs_state_t* state, cfs_file_t* file);
+int cfs_file_fsync(cfs_state_t* state, cfs_file_t* file);
+int cfs_file_truncate(cfs_state_t* state, cfs_file_t* file, const off_t size);
+int cfs_truncate(cfs_state_t* state, const char* path, const off_t size);
+int cfs_file_fallocate(cfs_state_t* state, cfs_file_t* file, const int mode, const off_t offset, const off_t len);
+ssize_t cfs_file_copy_range(cfs_state_t* state, cfs_file_t* src, const off_t off_in, cfs_file_t* dst, const off_t off_out,
+    size_t len);
+int cfs_file_clone(cfs_state_t* state, cfs_file_t* src, cfs_file_t* dst);
+ssize_t cfs_file_map_extents(cfs_state_t* state, cfs_file_t* file, const off_t start, cfs_map_extent_t* extents,
+    const size_t max);
+off_t cfs_file_seek(cfs_state_t* state, cfs_file_t* file, const off_t offset, const int whence);
+int cfs_file_map(cfs_state_t* state, cfs_file_t* file, cfs_map_arg_t* map);
+int cfs_open_under(cfs_state_t* state, const char* dir);
+int cfs_clone(cfs_state_t* state, const char* path, cfs_file_t* dst, const uid_t uid, const gid_t gid);
+int cfs_stats(cfs_state_t* state, char* buf, size_t size);
 int cfs_file_read_block(cfs_state_t* state, cfs_file_t* file, const off_t index, cfs_block_t* buff);
-int cfs_file_register_block(cfs_state_t* state, cfs_file_t* file, const cfs_block_t* block);
+int cfs_file_register_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const char* data, const size_t size);
+int cfs_file_register_blocks(cfs_state_t* state, cfs_file_t* file, const off_t first, const char* data, const size_t count);
+int cfs_file_staged_blocks(cfs_state_t* state, cfs_file_t* file, off_t** indices);
+ssize_t cfs_file_dedup_block(cfs_state_t* state, cfs_file_t* file, const off_t index);
+int cfs_file_drop_staging(cfs_state_t* state, cfs_file_t* file);
+void cfs_file_account(cfs_state_t* state, cfs_file_t* file, const int hit, const int sampled);
+int cfs_file_unchanged(cfs_state_t* state, cfs_file_t* file, const off_t index, const unsigned char* hash);
+int cfs_file_map_block(cfs_state_t* state, cfs_file_t* file, const off_t index, const size_t size, const unsigned char* hash);
+int cfs_file_map_blocks(cfs_state_t* state, cfs_file_t* file, const cfs_mapping_t* maps, const size_t n);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "storage.h"
@@ -14,6 +15,10 @@ int main(int argc, char* argv[]) {
     char* root;
     char file[PATH_MAX];
     char hex_buf[HASH_LENGTH * 2 + 1];
+    char data[BLOCK_SIZE];
+    char data_hex[BLOCK_SIZE * 2 + 1];
+    ssize_t data_len;
+    uint32_t size;
     int fd;
     int i;
     cfs_state_t state;
@@ -24,7 +29,7 @@ int main(int argc, char* argv[]) {
     unsigned char hash_buf[HASH_LENGTH];
 
     root = realpath(argv[1], NULL);
-    cfs_init(&state, root);
+    cfs_init(&state, root, NULL);
     log = log_open(); 
 
     combine(file, root, argv[2]);
@@ -41,8 +46,24 @@ int main(int argc, char* argv[]) {
     for (i=0; i<cfs_file->total_blocks; i++) {
         s_read(fd, (void*)&index_buf, sizeof(off_t));
         s_read(fd, (void*)hash_buf, HASH_LENGTH);
-        hexify(hash_buf, HASH_LENGTH, hex_buf, HASH_LENGTH*2 + 1);
-        printf("\t%d -> %s\n", index_buf, hex_buf);
+        // marks carry the block size where the hash would be
+        if (memcmp(hash_buf, STAGED_MARK, STAGED_MARK_LEN) == 0) {
+            memcpy(&size, hash_buf + STAGED_MARK_LEN, sizeof(size));
+            printf("\t%d -> staged, %u bytes\n", index_buf, size);
+        } else if (memcmp(hash_buf, INLINE_MARK, INLINE_MARK_LEN) == 0) {
+            memcpy(&size, hash_buf + INLINE_MARK_LEN, sizeof(size));
+            printf("\t%d -> inline, %u bytes\n", index_buf, size);
+        } else {
+            hexify(hash_buf, HASH_LENGTH, hex_buf, HASH_LENGTH*2 + 1);
+            printf("\t%d -> %s\n", index_buf, hex_buf);
+        }
+    }
+
+    // the inline block's data follows the last pair
+    data_len = s_pread(fd, data, BLOCK_SIZE, BLOCK_START + cfs_file->total_blocks * (BLOCK_PAIR));
+    if (data_len > 0) {
+        hexify((unsigned char*)data, data_len, data_hex, sizeof(data_hex));
+        printf(" INLINE DATA:\n\t%s\n", data_hex);
     }
 
 
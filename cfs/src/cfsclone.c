@@ -0,0 +1,83 @@
+/*
+    cfsclone SOURCE DEST
+
+    Make DEST a copy of SOURCE on a mounted CFS without copying any data,
+    DEST ends up sharing every block of SOURCE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cfs.h"
+
+/*
+    Find the mount point *path* lives under, the last parent on its device.
+    Returns the length of the mount point prefix of *path*, or -1.
+*/
+static int mount_prefix(const char* path)
+{
+    char parent[PATH_MAX];
+    struct stat st, up;
+    char* slash;
+    int len;
+
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    len = strlen(path);
+    strcpy(parent, path);
+    while ((slash = strrchr(parent, '/')) != NULL) {
+        *slash = '\0';
+        if (stat(slash == parent ? "/" : parent, &up) < 0 || up.st_dev != st.st_dev) {
+            break;
+        }
+        len = slash - parent;
+    }
+
+    return len;
+}
+
+int main(int argc, char* argv[]) {
+    cfs_clone_arg_t arg;
+    char* source;
+    int prefix;
+    int fd;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SOURCE DEST\n", argv[0]);
+        return 2;
+    }
+
+    source = realpath(argv[1], NULL);
+    prefix = source ? mount_prefix(source) : -1;
+    if (prefix < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (source[prefix] == '\0') {
+        fprintf(stderr, "%s: not a file\n", argv[1]);
+        return 1;
+    }
+    memset(&arg, 0, sizeof(arg));
+    strcpy(arg.path, source + prefix + 1);
+
+    fd = open(argv[2], O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (ioctl(fd, CFS_IOC_CLONE, &arg) < 0) {
+        fprintf(stderr, "%s: cannot clone %s: %s\n", argv[2], argv[1], strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    return close(fd) < 0;
+}
@@ -0,0 +1,55 @@
+/*
+    cfsmap FILE
+
+    List the data of FILE on a mounted CFS, one run of mapped blocks per
+    line as OFFSET LENGTH in bytes. The gaps between them are holes.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "cfs.h"
+
+int main(int argc, char* argv[]) {
+    cfs_map_arg_t* map;
+    unsigned int i;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 2;
+    }
+
+    map = calloc(1, sizeof(cfs_map_arg_t));
+    if (map == NULL) {
+        perror(argv[0]);
+        return 1;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    do {
+        if (ioctl(fd, CFS_IOC_MAP, map) < 0) {
+            fprintf(stderr, "%s: cannot map: %s\n", argv[1], strerror(errno));
+            close(fd);
+            return 1;
+        }
+        for (i=0; i<map->count; i++) {
+            printf("%lld %lld\n", (long long)map->extents[i].offset, (long long)map->extents[i].length);
+        }
+        if (map->count > 0) {
+            map->start = map->extents[map->count - 1].offset + map->extents[map->count - 1].length;
+        }
+    } while (map->count == CFS_MAP_EXTENTS);
+
+    free(map);
+    return close(fd) < 0;
+}
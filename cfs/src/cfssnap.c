@@ -0,0 +1,53 @@
+/*
+    cfssnap DIR NAME
+    cfssnap -d DIR NAME
+
+    Capture the tree under DIR, on a mounted CFS, as the read-only snapshot
+    .snapshots/NAME of that mount, or delete snapshot NAME of the mount DIR
+    is on.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "cfs.h"
+
+int main(int argc, char* argv[]) {
+    cfs_snapshot_arg_t arg;
+    const char* dir;
+    const char* name;
+    int delete, fd;
+
+    delete = argc == 4 && strcmp(argv[1], "-d") == 0;
+    if (argc != 3 + delete) {
+        fprintf(stderr, "usage: %s [-d] DIR NAME\n", argv[0]);
+        return 2;
+    }
+    dir = argv[1 + delete];
+    name = argv[2 + delete];
+    if (strlen(name) >= sizeof(arg.name)) {
+        fprintf(stderr, "%s: name too long\n", name);
+        return 1;
+    }
+    memset(&arg, 0, sizeof(arg));
+    strcpy(arg.name, name);
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror(dir);
+        return 1;
+    }
+    if (ioctl(fd, delete ? CFS_IOC_SNAPSHOT_DELETE : CFS_IOC_SNAPSHOT, &arg) < 0) {
+        fprintf(stderr, "%s: cannot %s snapshot %s: %s\n", dir, delete ? "delete" : "take", name, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,294 @@
+/*
+    Offline (post-process) deduplication.
+
+    In offline mode writes land in a plain staging extent per file and the
+    block map marks those blocks as staged. This thread later hashes them,
+    stores them in the block store and maps the real hash, reading no more
+    than config.dedup_budget bytes per second.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dedup.h"
+#include "storage.h"
+#include "log.h"
+
+
+/* nftw() takes no context */
+static cfs_dedup_t* recovering;
+
+
+static int dedup_recover_file(const char* path, const struct stat* sb, int flag, struct FTW* ftwbuf)
+{
+    int fd;
+
+    if (flag == FTW_D && is_block_store(recovering->state->storage, sb)) {
+        return FTW_SKIP_SUBTREE;
+    }
+    if (flag != FTW_F) {
+        return FTW_CONTINUE;
+    }
+
+    fd = open_staging(recovering->state->storage, sb->st_ino, O_RDONLY);
+    if (fd >= 0) {
+        close(fd);
+        dedup_notify(recovering, path);
+    }
+
+    return FTW_CONTINUE;
+}
+
+
+/*
+    Queue the files whose staging extents survived the last unmount.
+*/
+static void dedup_recover(cfs_dedup_t* dedup)
+{
+    DIR* dp;
+    struct dirent* de;
+    int empty = 1;
+
+    dp = opendir(dedup->state->storage->staging_path);
+    if (dp == NULL) {
+        return;
+    }
+    while (empty && (de = readdir(dp)) != NULL) {
+        empty = de->d_name[0] == '.';
+    }
+    closedir(dp);
+
+    if (!empty) {
+        recovering = dedup;
+        nftw(dedup->state->root, dedup_recover_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+        recovering = NULL;
+    }
+}
+
+
+/*
+    Sleep as long as needed to keep the average rate under the budget.
+*/
+static void dedup_throttle(cfs_dedup_t* dedup, const struct timespec* start, size_t bytes)
+{
+    struct timespec now, pause;
+    double elapsed, allowed;
+
+    if (dedup->state->config.dedup_budget == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    allowed = (double)bytes / dedup->state->config.dedup_budget;
+    if (allowed > elapsed) {
+        pause.tv_sec = (time_t)(allowed - elapsed);
+        pause.tv_nsec = (long)((allowed - elapsed - pause.tv_sec) * 1e9);
+        pthread_mutex_lock(&dedup->lock);
+        dedup->stats.throttled++;
+        pthread_mutex_unlock(&dedup->lock);
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+/*
+    Convert every staged block of *path*.
+*/
+static void dedup_file(cfs_dedup_t* dedup, const char* path)
+{
+    cfs_state_t* state = dedup->state;
+    cfs_file_t* file;
+    struct timespec start;
+    off_t* indices = NULL;
+    ssize_t ret;
+    size_t bytes = 0;
+    int fd, n, i;
+
+    // register like any other handle, so open handles see the conversion
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        log_msg("\n CFS: Dedup: %s is gone\n", path);
+        return;
+    }
+    if (cfs_register_file(state, path, fd) < 0) {
+        close(fd);
+        return;
+    }
+    file = cfs_get_file(state, fd);
+
+    n = cfs_file_staged_blocks(state, file, &indices);
+    log_msg("\n CFS: Dedup: %s has %d staged blocks\n", path, n);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<n && !dedup->stop; i++) {
+        ret = cfs_file_dedup_block(state, file, indices[i]);
+        if (ret < 0) {
+            log_msg("\n CFS: Dedup: cannot convert block [%lld] of %s\n", indices[i], path);
+            break;
+        }
+        bytes += ret;
+
+        pthread_mutex_lock(&dedup->lock);
+        dedup->stats.blocks++;
+        dedup->stats.bytes += ret;
+        pthread_mutex_unlock(&dedup->lock);
+
+        dedup_throttle(dedup, &start, bytes);
+    }
+    free(indices);
+
+    if (i == n) {
+        cfs_file_drop_staging(state, file);
+        pthread_mutex_lock(&dedup->lock);
+        dedup->stats.files++;
+        pthread_mutex_unlock(&dedup->lock);
+    }
+
+    cfs_release_file(state, fd);
+    close(fd);
+}
+
+
+static void* dedup_worker(void* arg)
+{
+    cfs_dedup_t* dedup = (cfs_dedup_t*)arg;
+    cfs_dedup_entry_t* entry;
+
+    dedup_recover(dedup);
+
+    pthread_mutex_lock(&dedup->lock);
+    while (1) {
+        while (dedup->head == NULL && !dedup->stop) {
+            pthread_cond_wait(&dedup->cond, &dedup->lock);
+        }
+        if (dedup->stop) {
+            // whatever is left is recovered on the next mount
+            break;
+        }
+
+        entry = dedup->head;
+        dedup->head = entry->next;
+        if (dedup->head == NULL) {
+            dedup->tail = NULL;
+        }
+        dedup->queued--;
+        pthread_mutex_unlock(&dedup->lock);
+
+        dedup_file(dedup, entry->path);
+        free(entry->path);
+        free(entry);
+
+        pthread_mutex_lock(&dedup->lock);
+    }
+    pthread_mutex_unlock(&dedup->lock);
+
+    return NULL;
+}
+
+
+int dedup_init(cfs_dedup_t* dedup, cfs_state_t* state)
+{
+    memset(dedup, 0, sizeof(*dedup));
+    dedup->state = state;
+    pthread_mutex_init(&dedup->lock, NULL);
+    pthread_cond_init(&dedup->cond, NULL);
+
+    if (pthread_create(&dedup->thread, NULL, dedup_worker, dedup) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void dedup_destroy(cfs_dedup_t* dedup)
+{
+    cfs_dedup_entry_t* entry;
+
+    pthread_mutex_lock(&dedup->lock);
+    dedup->stop = 1;
+    pthread_cond_broadcast(&dedup->cond);
+    pthread_mutex_unlock(&dedup->lock);
+
+    pthread_join(dedup->thread, NULL);
+
+    while (dedup->head) {
+        entry = dedup->head;
+        dedup->head = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+    pthread_mutex_destroy(&dedup->lock);
+    pthread_cond_destroy(&dedup->cond);
+}
+
+
+/*
+    Queue *path* for conversion, unless it is already queued.
+*/
+int dedup_notify(cfs_dedup_t* dedup, const char* path)
+{
+    cfs_dedup_entry_t* entry;
+
+    pthread_mutex_lock(&dedup->lock);
+    for (entry = dedup->head; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            pthread_mutex_unlock(&dedup->lock);
+            return 0;
+        }
+    }
+
+    entry = malloc(sizeof(cfs_dedup_entry_t));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        pthread_mutex_unlock(&dedup->lock);
+        return -1;
+    }
+    entry->next = NULL;
+    if (dedup->tail) {
+        dedup->tail->next = entry;
+    } else {
+        dedup->head = entry;
+    }
+    dedup->tail = entry;
+    dedup->queued++;
+
+    pthread_cond_signal(&dedup->cond);
+    pthread_mutex_unlock(&dedup->lock);
+
+    return 0;
+}
+
+
+/*
+    Print deduplicator counters to *buf*, like snprintf.
+*/
+int dedup_stats(cfs_dedup_t* dedup, char* buf, size_t size)
+{
+    cfs_dedup_stats_t stats;
+    size_t queued;
+
+    pthread_mutex_lock(&dedup->lock);
+    stats = dedup->stats;
+    queued = dedup->queued;
+    pthread_mutex_unlock(&dedup->lock);
+
+    return snprintf(buf, size,
+        "dedup_queued_files %zu\n"
+        "dedup_files %zu\n"
+        "dedup_blocks %zu\n"
+        "dedup_bytes %zu\n"
+        "dedup_throttled %zu\n",
+        queued, stats.files, stats.blocks, stats.bytes, stats.throttled);
+}
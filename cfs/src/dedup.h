@@ -0,0 +1,44 @@
+#ifndef __CFS_DEDUP__
+#define __CFS_DEDUP__
+
+#include <pthread.h>
+
+#include "cfs.h"
+
+typedef struct cfs_dedup_entry {
+    char* path;
+    struct cfs_dedup_entry* next;
+} cfs_dedup_entry_t;
+
+typedef struct {
+    size_t files;
+    size_t blocks;
+    size_t bytes;
+    size_t throttled; /* times the budget made the deduplicator sleep */
+} cfs_dedup_stats_t;
+
+/*
+    Background deduplicator of offline mode.
+    Files with staging extents are queued when their last handle is released,
+    one thread converts their staged blocks into stored blocks.
+*/
+struct cfs_dedup {
+    cfs_state_t* state;
+    cfs_dedup_entry_t* head;
+    cfs_dedup_entry_t* tail;
+    size_t queued;
+    int stop;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    cfs_dedup_stats_t stats;
+};
+
+int dedup_init(cfs_dedup_t* dedup, cfs_state_t* state);
+void dedup_destroy(cfs_dedup_t* dedup);
+int dedup_notify(cfs_dedup_t* dedup, const char* path);
+int dedup_stats(cfs_dedup_t* dedup, char* buf, size_t size);
+
+#endif
@@ -9,7 +9,7 @@ int file_exists(const char* path) {
 }
 
 off_t s_lseek(int fd, off_t offset, int whence){
-    int ret;
+    off_t ret;
     do {
         ret = lseek(fd, offset, whence);
         if( ret == -1 ){
@@ -66,4 +66,46 @@ ssize_t s_write(int fd, void *buf, size_t count){
     return bytes_written;
 }
 
+ssize_t s_pread(int fd, void *buf, size_t count, off_t offset){
+    ssize_t bytes_read = 0;
+    ssize_t bytes_left = count;
+
+    do {
+        bytes_read = pread(fd, buf, bytes_left, offset);
+        if (bytes_read == -1){
+            if (errno == EINTR) {
+                continue;
+            } else {
+                return -1;
+            }
+        } else {
+            bytes_left -= bytes_read;
+            buf += bytes_read;
+            offset += bytes_read;
+        }
+     } while(bytes_left > 0 && bytes_read != 0);
+
+    return count-bytes_left;
+}
 
+ssize_t s_pwrite(int fd, const void *buf, size_t count, off_t offset){
+    ssize_t bytes_written;
+    ssize_t bytes_left = count;
+
+    do {
+        bytes_written = pwrite(fd, buf, bytes_left, offset);
+        if( bytes_written == -1 ){
+            if (errno == EINTR) {
+                continue;
+            } else {
+                return -1;
+            }
+        } else{
+            bytes_left -= bytes_written;
+            buf += bytes_written;
+            offset += bytes_written;
+        }
+    } while( bytes_left > 0 );
+
+    return count;
+}
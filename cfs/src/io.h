@@ -5,9 +5,11 @@
 #include <unistd.h>
 #include <errno.h>
 
-off_t s_lseek(int fd, int offset, int whence);
+off_t s_lseek(int fd, off_t offset, int whence);
 ssize_t s_read(int fd, void *buf, size_t count);
 ssize_t s_write(int fd, void *buf, size_t count);
+ssize_t s_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t s_pwrite(int fd, const void *buf, size_t count, off_t offset);
 int file_exists(const char* path);
 
 #endif
\ No newline at end of file
@@ -25,6 +25,9 @@
 
 #include "log.h"
 
+// the FUSE context is not there in worker threads, nor in the low-level API
+static FILE *log_file;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -39,6 +42,7 @@ FILE *log_open()
     
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
+    log_file = logfile;
 
     return logfile;
 }
@@ -48,7 +52,7 @@ void log_msg(const char *format, ...)
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(BB_DATA->logfile, format, ap);
+    vfprintf(log_file, format, ap);
 }
 
 // Report errors to logfile and give -errno to caller
@@ -108,9 +112,11 @@ void log_conn(struct fuse_conn_info *conn)
     // unsigned proto_minor;
     log_struct(conn, proto_minor, %d, );
 
+#if FUSE_USE_VERSION < 30
     /** Is asynchronous read supported (read-write) */
     // unsigned async_read;
     log_struct(conn, async_read, %d, );
+#endif
 
     /** Maximum size of the write buffer */
     // unsigned max_write;
@@ -152,9 +158,11 @@ void log_fi (struct fuse_file_info *fi)
     //	int flags;
 	log_struct(fi, flags, 0x%08x, );
 	
+#if FUSE_USE_VERSION < 30
     /** Old file handle, don't use */
     //	unsigned long fh_old;	
 	log_struct(fi, fh_old, 0x%08lx,  );
+#endif
 
     /** In case of a write operation indicates if this was caused by a
         writepage */
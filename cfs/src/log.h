@@ -9,6 +9,7 @@
 #define _LOG_H_
 #include <stdio.h>
 #include <fuse.h>
+#include <utime.h>
 
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
@@ -13,8 +13,11 @@
 
 // The FUSE API has been changed a number of times.  So, our code
 // needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 26
+// writing, the most current API version is 26.  The FUSE 3 low-level
+// build (bbfs_ll.c) sets its own version on the command line.
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 
 // need this to get pwrite().  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
@@ -22,6 +25,7 @@
 
 // maintain bbfs state in here
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "cfs.h"
@@ -30,8 +34,55 @@ struct bb_state {
     FILE *logfile;
     char *rootdir;
     cfs_state_t *cfs_state;
+    cfs_config_t config;
+
+    // low-level build only, the high-level library keeps its own
+    double entry_timeout;
+    double attr_timeout;
+    int kernel_cache;
 };
 
+// Largest write requested from the kernel.  FUSE 2 kernels cap it at
+// 128 KiB, FUSE 3 ones negotiate up to this many pages (max_pages).
+#define BB_MAX_WRITE (1024 * 1024)
+
+// Largest copy_file_range() answered at once, the reply counts in 32 bits
+#define BB_COPY_MAX ((size_t) 1 << 30)
+
+// CFS mount options, shared by both builds
+#define BB_OPT(t, p, v) { t, offsetof(struct bb_state, p), v }
+
+#define BB_CFS_OPTS \
+    BB_OPT("dedup=inline", config.offline, 0), \
+    BB_OPT("dedup=offline", config.offline, 1), \
+    BB_OPT("dedup_budget=%lu", config.dedup_budget, 0), \
+    BB_OPT("bypass_window=%lu", config.bypass_window, 0), \
+    BB_OPT("bypass_sample=%lu", config.bypass_sample, 0), \
+    BB_OPT("readahead=%lu", config.readahead, 0), \
+    BB_OPT("placement=stream", config.regions, 1), \
+    BB_OPT("placement=hash", config.regions, 0), \
+    BB_OPT("stat_cache=%lu", config.stat_cache, 0), \
+    BB_OPT("inline_max=%lu", config.inline_max, 0), \
+    BB_OPT("huge_pages", config.huge_pages, 1), \
+    BB_OPT("direct_store", config.direct_store, 1), \
+    BB_OPT("block_cache=%lu", config.block_cache, 0), \
+    BB_OPT("blocks=%s", config.blocks_dir, 0)
+
+#define BB_CFS_USAGE \
+    "CFS options:\n" \
+    "    -o dedup=inline|offline  deduplicate on write (default) or in the background\n" \
+    "    -o dedup_budget=N        offline dedup I/O budget in bytes/s, 0 for unlimited\n" \
+    "    -o bypass_window=N       stop hashing files with no duplicates in N blocks, 0 never does\n" \
+    "    -o bypass_sample=N       while bypassing, still hash 1 in N blocks\n" \
+    "    -o readahead=N           prefetch up to N blocks for sequential readers, 0 disables\n" \
+    "    -o placement=hash|stream store the new blocks of a file apart (default) or together\n" \
+    "    -o stat_cache=N          remember the size of N closed files, 0 disables\n" \
+    "    -o inline_max=N          keep a last block under N bytes in the block map, 0 disables\n" \
+    "    -o huge_pages            back the in-memory block buffers with huge pages\n" \
+    "    -o direct_store          bypass the page cache for placement=stream, CFS caches hot blocks\n" \
+    "    -o block_cache=N         blocks cached with direct_store, 0 disables\n" \
+    "    -o blocks=DIR            keep the block store in DIR instead of rootDir/" BLOCKS_DIRECTORY "\n"
+
 #define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
 #define CFS_STATE (BB_DATA->cfs_state)
 
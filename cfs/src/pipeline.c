@@ -0,0 +1,465 @@
+/*
+    Asynchronous dedup pipeline.
+
+    write() only copies blocks into the stage ring, or hands the buffers of
+    completed partial blocks over, and returns. Worker threads
+    hash and store them, then map them into their files in submission order.
+    A full ring blocks the writer until a slot frees up, fsync waits until
+    every staged block of the file has been mapped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "storage.h"
+#include "log.h"
+
+
+static unsigned long long elapsed_ns(const struct timespec* since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+
+/*
+    Map every stored block at the head of the ring into its file.
+    Up to CFS_COMMIT_BATCH of them are mapped per acquisition of the state
+    lock, consecutive blocks of one file with a single metadata update.
+    Called with the pipeline lock held, only one thread commits at a time.
+*/
+static void pipeline_commit(cfs_pipeline_t* pipe)
+{
+    cfs_mapping_t maps[CFS_COMMIT_BATCH];
+    cfs_stage_t* slot;
+    cfs_stage_t* run;
+    cfs_state_t* state = pipe->state;
+    unsigned long long ns;
+    size_t n, i, j, k;
+
+    pipe->committing = 1;
+    while (pipe->count > 0 && pipe->slots[pipe->head % pipe->cap].status == STAGE_STORED) {
+        n = 0;
+        while (n < pipe->count && n < CFS_COMMIT_BATCH &&
+            pipe->slots[(pipe->head + n) % pipe->cap].status == STAGE_STORED) {
+            n++;
+        }
+
+        // the slots stay visible to readers until they are mapped
+        pthread_mutex_unlock(&pipe->lock);
+        pthread_mutex_lock(&state->lock);
+        for (i=0; i<n; i=j) {
+            run = &pipe->slots[(pipe->head + i) % pipe->cap];
+            for (j=i, k=0; j<n; j++) {
+                slot = &pipe->slots[(pipe->head + j) % pipe->cap];
+                if (slot->file != run->file) {
+                    break;
+                }
+                if (slot->unchanged) {
+                    cfs_file_account(state, slot->file, 1, 0);
+                    continue;
+                }
+                if (slot->error) {
+                    continue;
+                }
+                maps[k].index = slot->block.index;
+                maps[k].size = slot->block.size;
+                memcpy(maps[k].hash, slot->hash, HASH_LENGTH);
+                k++;
+                cfs_file_account(state, slot->file, slot->hit, 0);
+            }
+            if (cfs_file_map_blocks(state, run->file, maps, k) < 0) {
+                for (; i<j; i++) {
+                    pipe->slots[(pipe->head + i) % pipe->cap].error = 1;
+                }
+            }
+        }
+        pthread_mutex_unlock(&state->lock);
+        pthread_mutex_lock(&pipe->lock);
+
+        for (i=0; i<n; i++) {
+            slot = &pipe->slots[pipe->head % pipe->cap];
+            if (slot->error) {
+                log_msg("\n CFS: Pipeline: cannot commit block [%lld] of %s\n", slot->block.index, slot->file->path);
+                slot->file->error = -EIO;
+            }
+            ns = elapsed_ns(&slot->queued);
+            pipe->stats.total_ns += ns;
+            pipe->stats.max_ns = max(pipe->stats.max_ns, ns);
+            pipe->stats.committed++;
+
+            slot->file->pending--;
+            slot->status = STAGE_FREE;
+            pipe->head++;
+            pipe->count--;
+        }
+        pipe->stats.commits++;
+        pthread_cond_broadcast(&pipe->space);
+    }
+    pipe->committing = 0;
+}
+
+
+/*
+    Whether *slot* rewrites a block of its file with the data it holds, so
+    it needs neither storing nor mapping. Not so while an earlier copy of
+    the block is still to be mapped.
+    Called with the pipeline lock held.
+*/
+static int pipeline_unchanged(cfs_pipeline_t* pipe, cfs_stage_t* slot)
+{
+    cfs_stage_t* earlier;
+    size_t i;
+    int ret;
+
+    for (i=pipe->head; (earlier = &pipe->slots[i % pipe->cap]) != slot; i++) {
+        if (earlier->file == slot->file && earlier->block.index == slot->block.index) {
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&pipe->state->lock);
+    ret = cfs_file_unchanged(pipe->state, slot->file, slot->block.index, slot->hash);
+    pthread_mutex_unlock(&pipe->state->lock);
+
+    return ret;
+}
+
+
+static void* pipeline_worker(void* arg)
+{
+    cfs_pipeline_t* pipe = (cfs_pipeline_t*)arg;
+    cfs_stage_t* slot;
+    struct timespec hash_start;
+    unsigned long long hash_ns;
+    int ret = 0;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (1) {
+        while (!pipe->stop && pipe->next == pipe->head + pipe->count) {
+            pthread_cond_wait(&pipe->work, &pipe->lock);
+        }
+        if (pipe->next == pipe->head + pipe->count) {
+            // stopping and drained
+            break;
+        }
+
+        slot = &pipe->slots[pipe->next % pipe->cap];
+        pipe->next++;
+        slot->status = STAGE_HASHING;
+        pipe->stats.wait_ns += elapsed_ns(&slot->queued);
+        pthread_mutex_unlock(&pipe->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &hash_start);
+        calculate_hash(slot->block.data, slot->block.size, slot->hash);
+        hash_ns = elapsed_ns(&hash_start);
+
+        pthread_mutex_lock(&pipe->lock);
+        slot->unchanged = pipeline_unchanged(pipe, slot);
+        if (!slot->unchanged) {
+            pthread_mutex_unlock(&pipe->lock);
+            ret = store_block_in(pipe->state->storage, slot->file->region, (unsigned char*)slot->block.data, slot->block.size, slot->hash);
+            pthread_mutex_lock(&pipe->lock);
+        }
+
+        pipe->stats.hash_ns += hash_ns;
+        pipe->stats.hashed_bytes += slot->block.size;
+        slot->error = !slot->unchanged && ret < 0;
+        slot->hit = slot->unchanged || ret == 0;
+        slot->status = STAGE_STORED;
+        if (!pipe->committing) {
+            pipeline_commit(pipe);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+
+static void pipeline_free_slots(cfs_pipeline_t* pipe)
+{
+    size_t i;
+
+    for (i=0; i<pipe->cap; i++) {
+        buffers_put(&pipe->state->buffers, pipe->slots[i].block.data);
+    }
+    free(pipe->slots);
+}
+
+
+int pipeline_init(cfs_pipeline_t* pipe, cfs_state_t* state, size_t slots, size_t n_workers)
+{
+    size_t i;
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->state = state;
+    pipe->cap = slots;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->work, NULL);
+    pthread_cond_init(&pipe->space, NULL);
+
+    pipe->slots = calloc(slots, sizeof(cfs_stage_t));
+    pipe->workers = malloc(sizeof(pthread_t) * n_workers);
+    if (pipe->slots == NULL || pipe->workers == NULL) {
+        free(pipe->slots);
+        free(pipe->workers);
+        return -1;
+    }
+    for (i=0; i<slots; i++) {
+        pipe->slots[i].block.data = buffers_get(&state->buffers);
+        if (pipe->slots[i].block.data == NULL) {
+            pipeline_free_slots(pipe);
+            free(pipe->workers);
+            return -1;
+        }
+    }
+
+    for (i=0; i<n_workers; i++) {
+        if (pthread_create(&pipe->workers[i], NULL, pipeline_worker, pipe) != 0) {
+            break;
+        }
+    }
+    pipe->n_workers = i;
+    if (i == 0) {
+        pipeline_free_slots(pipe);
+        free(pipe->workers);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+    Drain every staged block and stop the workers.
+*/
+void pipeline_destroy(cfs_pipeline_t* pipe)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = 1;
+    pthread_cond_broadcast(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+
+    for (i=0; i<pipe->n_workers; i++) {
+        pthread_join(pipe->workers[i], NULL);
+    }
+
+    pipeline_free_slots(pipe);
+    free(pipe->workers);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->work);
+    pthread_cond_destroy(&pipe->space);
+}
+
+
+/*
+    Wait for a free slot and claim it for block *index* of *file*, its data
+    is left to the caller.
+    Returns with the pipeline lock held.
+*/
+static cfs_stage_t* pipeline_claim(cfs_pipeline_t* pipe, cfs_file_t* file, const off_t index, const size_t size)
+{
+    cfs_stage_t* slot;
+
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->count == pipe->cap) {
+        pipe->stats.stalls++;
+        while (pipe->count == pipe->cap) {
+            pthread_cond_wait(&pipe->space, &pipe->lock);
+        }
+    }
+
+    slot = &pipe->slots[(pipe->head + pipe->count) % pipe->cap];
+    slot->file = file;
+    slot->error = 0;
+    slot->block.index = index;
+    slot->block.size = size;
+
+    return slot;
+}
+
+
+/*
+    Queue the slot claimed last, then drop the pipeline lock.
+*/
+static void pipeline_queue(cfs_pipeline_t* pipe, cfs_stage_t* slot)
+{
+    cfs_file_t* file = slot->file;
+
+    clock_gettime(CLOCK_MONOTONIC, &slot->queued);
+    slot->status = STAGE_QUEUED;
+
+    pipe->count++;
+    pipe->stats.submitted++;
+    pipe->stats.max_depth = max(pipe->stats.max_depth, pipe->count);
+    file->pending++;
+    file->staged_end = max(file->staged_end, (off_t)(slot->block.index * BLOCK_SIZE + slot->block.size));
+
+    pthread_cond_signal(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+
+/*
+    Stage a copy of *size* bytes of *data* as block *index* of *file*,
+    waiting for a slot if the ring is full.
+    Caller must hold the file lock.
+*/
+int pipeline_submit(cfs_pipeline_t* pipe, cfs_file_t* file, const off_t index, const char* data, const size_t size)
+{
+    cfs_stage_t* slot;
+
+    slot = pipeline_claim(pipe, file, index, size);
+    memcpy(slot->block.data, data, size);
+    pipeline_queue(pipe, slot);
+
+    return 0;
+}
+
+
+/*
+    Stage *block* of *file* without copying it, its buffer goes to the slot
+    and the free buffer of the slot to *block*.
+    Caller must hold the file lock.
+*/
+int pipeline_give(cfs_pipeline_t* pipe, cfs_file_t* file, cfs_block_t* block)
+{
+    cfs_stage_t* slot;
+    char* data;
+
+    slot = pipeline_claim(pipe, file, block->index, block->size);
+    data = slot->block.data;
+    slot->block.data = block->data;
+    block->data = data;
+    pipeline_queue(pipe, slot);
+
+    return 0;
+}
+
+
+/*
+    Wait until every block staged for *file* is mapped.
+    Returns (and clears) the first error hit while committing them.
+*/
+int pipeline_wait(cfs_pipeline_t* pipe, cfs_file_t* file)
+{
+    int ret;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (file->pending > 0) {
+        pthread_cond_wait(&pipe->space, &pipe->lock);
+    }
+    ret = file->error;
+    file->error = 0;
+    pthread_mutex_unlock(&pipe->lock);
+
+    return ret;
+}
+
+
+/*
+    Wait until every block staged for *file* is mapped, errors are left for
+    the next pipeline_wait().
+*/
+void pipeline_drain(cfs_pipeline_t* pipe, cfs_file_t* file)
+{
+    pthread_mutex_lock(&pipe->lock);
+    while (file->pending > 0) {
+        pthread_cond_wait(&pipe->space, &pipe->lock);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+
+/*
+    Latest staged copy of block *index* of *file*, or NULL.
+    Caller must hold the pipeline lock, the slot is valid until it is released.
+*/
+cfs_stage_t* pipeline_find(cfs_pipeline_t* pipe, const cfs_file_t* file, const off_t index)
+{
+    cfs_stage_t* slot;
+    size_t i;
+
+    if (file->pending == 0) {
+        return NULL;
+    }
+
+    for (i=pipe->head + pipe->count; i>pipe->head; i--) {
+        slot = &pipe->slots[(i - 1) % pipe->cap];
+        if (slot->file == file && slot->block.index == index) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Smallest index in [from, end) of a block of *file* in the pipeline, or
+    *end* if there is none.
+    Caller must hold the pipeline lock.
+*/
+off_t pipeline_next(cfs_pipeline_t* pipe, const cfs_file_t* file, const off_t from, const off_t end)
+{
+    cfs_stage_t* slot;
+    off_t next = end;
+    size_t i;
+
+    if (file->pending == 0) {
+        return end;
+    }
+
+    for (i=0; i<pipe->count; i++) {
+        slot = &pipe->slots[(pipe->head + i) % pipe->cap];
+        if (slot->file == file && slot->block.index >= from && slot->block.index < next) {
+            next = slot->block.index;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+    Print queue depth and stage latencies to *buf*, like snprintf.
+*/
+int pipeline_stats(cfs_pipeline_t* pipe, char* buf, size_t size)
+{
+    cfs_pipeline_stats_t stats;
+    size_t depth;
+
+    pthread_mutex_lock(&pipe->lock);
+    stats = pipe->stats;
+    depth = pipe->count;
+    pthread_mutex_unlock(&pipe->lock);
+
+    return snprintf(buf, size,
+        "stage_depth %zu\n"
+        "stage_max_depth %zu\n"
+        "stage_capacity %zu\n"
+        "stage_submitted %zu\n"
+        "stage_committed %zu\n"
+        "stage_stalls %zu\n"
+        "stage_commits %zu\n"
+        "stage_wait_avg_us %llu\n"
+        "stage_latency_avg_us %llu\n"
+        "stage_latency_max_us %llu\n"
+        "stage_hash_us %llu\n"
+        "stage_hashed_bytes %llu\n",
+        depth, stats.max_depth, pipe->cap,
+        stats.submitted, stats.committed, stats.stalls, stats.commits,
+        stats.submitted ? stats.wait_ns / stats.submitted / 1000 : 0,
+        stats.committed ? stats.total_ns / stats.committed / 1000 : 0,
+        stats.max_ns / 1000,
+        stats.hash_ns / 1000, stats.hashed_bytes);
+}
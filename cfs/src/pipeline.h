@@ -0,0 +1,79 @@
+#ifndef __CFS_PIPELINE__
+#define __CFS_PIPELINE__
+
+#include <pthread.h>
+#include <time.h>
+
+#include "cfs.h"
+#include "util.h"
+
+#define CFS_STAGE_SLOTS 256 /* blocks that can wait for hashing, 1MiB */
+#define CFS_STAGE_WORKERS 4
+#define CFS_COMMIT_BATCH 64 /* stored blocks mapped per acquisition of the state lock */
+
+#define STAGE_FREE 0
+#define STAGE_QUEUED 1 /* waiting for a worker */
+#define STAGE_HASHING 2 /* being hashed and stored */
+#define STAGE_STORED 3 /* stored, waiting for its turn to be mapped */
+
+typedef struct {
+    int status;
+    int error;
+    int hit; /* block was already in the store */
+    int unchanged; /* its file maps the same block there already, nothing to store or map */
+    cfs_file_t* file;
+    cfs_block_t block;
+    unsigned char hash[HASH_LENGTH];
+    struct timespec queued;
+} cfs_stage_t;
+
+typedef struct {
+    size_t submitted;
+    size_t committed;
+    size_t stalls; /* writers that had to wait for a free slot */
+    size_t commits; /* acquisitions of the state lock to map committed blocks */
+    size_t max_depth;
+    unsigned long long wait_ns; /* queued -> picked up by a worker */
+    unsigned long long total_ns; /* queued -> mapped in its file */
+    unsigned long long max_ns;
+    unsigned long long hash_ns; /* time spent hashing hashed_bytes */
+    unsigned long long hashed_bytes;
+} cfs_pipeline_stats_t;
+
+/*
+    Blocks are staged in a ring. Workers hash and store them in any order,
+    but they are mapped into their files strictly in submission order, so a
+    later write to the same block always wins.
+    head <= next <= head + count, all three only grow.
+*/
+struct cfs_pipeline {
+    cfs_state_t* state;
+    cfs_stage_t* slots;
+    size_t cap;
+    size_t head; /* oldest slot not yet mapped */
+    size_t next; /* next slot to hash */
+    size_t count; /* slots in use */
+    int committing;
+    int stop;
+
+    pthread_t* workers;
+    size_t n_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t space;
+
+    cfs_pipeline_stats_t stats;
+};
+
+int pipeline_init(cfs_pipeline_t* pipe, cfs_state_t* state, size_t slots, size_t n_workers);
+void pipeline_destroy(cfs_pipeline_t* pipe);
+int pipeline_submit(cfs_pipeline_t* pipe, cfs_file_t* file, const off_t index, const char* data, const size_t size);
+int pipeline_give(cfs_pipeline_t* pipe, cfs_file_t* file, cfs_block_t* block);
+int pipeline_wait(cfs_pipeline_t* pipe, cfs_file_t* file);
+void pipeline_drain(cfs_pipeline_t* pipe, cfs_file_t* file);
+cfs_stage_t* pipeline_find(cfs_pipeline_t* pipe, const cfs_file_t* file, const off_t index);
+off_t pipeline_next(cfs_pipeline_t* pipe, const cfs_file_t* file, const off_t from, const off_t end);
+int pipeline_stats(cfs_pipeline_t* pipe, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+    A small fixed size worker pool.
+
+    Jobs are plain function pointers, they are run in submission order by
+    whichever worker is free. Callers that need to wait for a group of jobs
+    use a cfs_batch_t.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "log.h"
+
+
+static void* pool_worker(void* arg)
+{
+    cfs_pool_t* pool = (cfs_pool_t*)arg;
+    cfs_job_t* job;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            // stopping and nothing left to do
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+        free(job);
+    }
+
+    return NULL;
+}
+
+
+int pool_init(cfs_pool_t* pool, size_t n_threads)
+{
+    size_t i;
+
+    pool->head = pool->tail = NULL;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->threads = malloc(sizeof(pthread_t) * n_threads);
+    if (pool->threads == NULL) {
+        return -1;
+    }
+
+    for (i=0; i<n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            log_msg("\n CFS: Pool: cannot start worker %zu\n", i);
+            break;
+        }
+    }
+    pool->n_threads = i;
+
+    return pool->n_threads > 0 ? 0 : -1;
+}
+
+
+void pool_destroy(cfs_pool_t* pool)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
+
+
+/*
+    Queue *fn* to run on a worker.
+    If the pool has no workers the job is run by the caller.
+*/
+int pool_submit(cfs_pool_t* pool, cfs_job_fn fn, void* arg)
+{
+    cfs_job_t* job;
+
+    if (pool->n_threads == 0) {
+        fn(arg);
+        return 0;
+    }
+
+    job = malloc(sizeof(cfs_job_t));
+    if (job == NULL) {
+        fn(arg);
+        return 0;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+
+void batch_init(cfs_batch_t* batch)
+{
+    batch->pending = 0;
+    batch->error = 0;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+}
+
+
+void batch_destroy(cfs_batch_t* batch)
+{
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->cond);
+}
+
+
+void batch_add(cfs_batch_t* batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->pending++;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+
+/*
+    Mark one job of the batch as finished, the first error is kept.
+*/
+void batch_done(cfs_batch_t* batch, int error)
+{
+    pthread_mutex_lock(&batch->lock);
+    if (error && !batch->error) {
+        batch->error = error;
+    }
+    batch->pending--;
+    if (batch->pending == 0) {
+        pthread_cond_broadcast(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+
+/*
+    Wait for every job of the batch, returns the first error (or 0)
+*/
+int batch_wait(cfs_batch_t* batch)
+{
+    int ret;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->pending > 0) {
+        pthread_cond_wait(&batch->cond, &batch->lock);
+    }
+    ret = batch->error;
+    pthread_mutex_unlock(&batch->lock);
+
+    return ret;
+}
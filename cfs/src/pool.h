@@ -0,0 +1,45 @@
+#ifndef __CFS_POOL__
+#define __CFS_POOL__
+
+#include <pthread.h>
+
+typedef void (*cfs_job_fn)(void* arg);
+
+typedef struct cfs_job {
+    cfs_job_fn fn;
+    void* arg;
+    struct cfs_job* next;
+} cfs_job_t;
+
+typedef struct {
+    pthread_t* threads;
+    size_t n_threads;
+
+    /* pending jobs, FIFO */
+    cfs_job_t* head;
+    cfs_job_t* tail;
+
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} cfs_pool_t;
+
+/* Counts outstanding jobs of one request, so the caller can wait for all of them */
+typedef struct {
+    size_t pending;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} cfs_batch_t;
+
+int pool_init(cfs_pool_t* pool, size_t n_threads);
+void pool_destroy(cfs_pool_t* pool);
+int pool_submit(cfs_pool_t* pool, cfs_job_fn fn, void* arg);
+
+void batch_init(cfs_batch_t* batch);
+void batch_destroy(cfs_batch_t* batch);
+void batch_add(cfs_batch_t* batch);
+void batch_done(cfs_batch_t* batch, int error);
+int batch_wait(cfs_batch_t* batch);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+    Sequential read detection and block prefetching.
+
+    Each open file that is read gets a small cache of upcoming blocks. While
+    its reads keep following each other the prefetch window doubles, up to
+    the cache size, and the blocks ahead of the reader are loaded in the
+    background. A read anywhere else closes the window again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "readahead.h"
+#include "storage.h"
+#include "log.h"
+
+
+static void readahead_job(void* arg)
+{
+    cfs_ra_slot_t* slot = (cfs_ra_slot_t*)arg;
+    cfs_readahead_t* ra = slot->ra;
+    ssize_t ret;
+
+    // the slot is left alone while it is loading
+    ret = load_block_range(ra->storage, slot->hash, (unsigned char*)slot->block.data, 0, BLOCK_SIZE);
+
+    pthread_mutex_lock(&ra->lock);
+    if (ret < 0) {
+        slot->status = RA_EMPTY;
+    } else {
+        slot->block.size = ret;
+        slot->status = RA_READY;
+        ra->stats.prefetched++;
+    }
+    ra->inflight--;
+    pthread_cond_broadcast(&ra->loaded);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+
+int readahead_init(cfs_readahead_t* ra, const cfs_blk_store_t* storage, cfs_pool_t* pool, cfs_buffers_t* buffers,
+    size_t cap)
+{
+    memset(ra, 0, sizeof(*ra));
+    ra->storage = storage;
+    ra->pool = pool;
+    ra->buffers = buffers;
+    ra->cap = cap;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->loaded, NULL);
+
+    return 0;
+}
+
+
+static void readahead_free_slots(cfs_readahead_t* ra)
+{
+    size_t i;
+
+    for (i=0; ra->slots && i<ra->cap; i++) {
+        buffers_put(ra->buffers, ra->slots[i].block.data);
+    }
+    free(ra->slots);
+    ra->slots = NULL;
+}
+
+
+/*
+    Wait for blocks still loading and free the cache.
+*/
+void readahead_destroy(cfs_readahead_t* ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    while (ra->inflight > 0) {
+        pthread_cond_wait(&ra->loaded, &ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    readahead_free_slots(ra);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->loaded);
+}
+
+
+/*
+    Record a read of blocks [first, first + count).
+    Returns how many blocks from *start* should be prefetched now, 0 when the
+    reader is not sequential.
+*/
+size_t readahead_access(cfs_readahead_t* ra, const off_t first, const size_t count, off_t* start)
+{
+    const off_t end = first + count;
+    size_t n = 0, i;
+
+    pthread_mutex_lock(&ra->lock);
+    if (first + 1 == ra->next && end == ra->next) {
+        // small reads still inside the last block read, nothing new to tell
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+
+    // a read may start in the last, partially read, block of the previous one
+    if ((first == ra->next || first + 1 == ra->next) && end > ra->next) {
+        ra->window = ra->window ? min(ra->window * 2, ra->cap) : min(CFS_READAHEAD_MIN, ra->cap);
+        ra->stats.sequential++;
+    } else {
+        if (ra->window) {
+            log_msg("\n CFS: random read at block [%lld], readahead stopped\n", first);
+            ra->stats.stopped++;
+        }
+        ra->window = 0;
+        ra->issued = 0;
+    }
+    ra->next = end;
+
+    if (ra->window && ra->slots == NULL) {
+        ra->slots = calloc(ra->cap, sizeof(cfs_ra_slot_t));
+        for (i=0; ra->slots && i<ra->cap; i++) {
+            ra->slots[i].block.data = buffers_get(ra->buffers);
+            if (ra->slots[i].block.data == NULL) {
+                readahead_free_slots(ra);
+            }
+        }
+        if (ra->slots == NULL) {
+            ra->window = 0;
+        }
+    }
+    if (ra->window) {
+        *start = max(ra->issued, end);
+        n = end + ra->window > *start ? end + ra->window - *start : 0;
+        ra->issued = *start + n;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return n;
+}
+
+
+/*
+    Start loading stored block *hash* as block *index*, unless it is already
+    cached or its slot is busy.
+*/
+void readahead_fetch(cfs_readahead_t* ra, const off_t index, const unsigned char* hash)
+{
+    cfs_ra_slot_t* slot;
+
+    pthread_mutex_lock(&ra->lock);
+    slot = &ra->slots[index % ra->cap];
+    if (slot->status == RA_LOADING ||
+        (slot->status == RA_READY && slot->block.index == index && memcmp(slot->hash, hash, HASH_LENGTH) == 0)) {
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+    if (slot->status == RA_READY && !slot->used) {
+        ra->stats.wasted++;
+    }
+
+    slot->ra = ra;
+    slot->status = RA_LOADING;
+    slot->used = 0;
+    slot->block.index = index;
+    memcpy(slot->hash, hash, HASH_LENGTH);
+    ra->inflight++;
+    pthread_mutex_unlock(&ra->lock);
+
+    pool_submit(ra->pool, readahead_job, slot);
+}
+
+
+/*
+    Copy *len* bytes at *offset* of block *index* from the cache, if it holds
+    that block with that *hash*. Waits for it if it is still loading.
+    Returns 1 when the block was served, 0 otherwise.
+*/
+int readahead_copy(cfs_readahead_t* ra, const off_t index, const unsigned char* hash,
+    char* dst, const off_t offset, const size_t len)
+{
+    cfs_ra_slot_t* slot;
+    size_t avail;
+    int waited = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    if (ra->slots == NULL) {
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+
+    slot = &ra->slots[index % ra->cap];
+    while (slot->status == RA_LOADING && slot->block.index == index && memcmp(slot->hash, hash, HASH_LENGTH) == 0) {
+        waited = 1;
+        pthread_cond_wait(&ra->loaded, &ra->lock);
+    }
+    if (slot->status != RA_READY || slot->block.index != index || memcmp(slot->hash, hash, HASH_LENGTH) != 0) {
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+
+    avail = slot->block.size > offset ? slot->block.size - offset : 0;
+    avail = min(avail, len);
+    memcpy(dst, slot->block.data + offset, avail);
+    memset(dst + avail, '\0', len - avail);
+    slot->used = 1;
+    ra->stats.hits++;
+    ra->stats.waits += waited;
+    pthread_mutex_unlock(&ra->lock);
+
+    return 1;
+}
+
+
+/*
+    Add the counters of *ra* to *total*.
+*/
+void readahead_stats_add(cfs_readahead_stats_t* total, cfs_readahead_t* ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    total->sequential += ra->stats.sequential;
+    total->stopped += ra->stats.stopped;
+    total->prefetched += ra->stats.prefetched;
+    total->hits += ra->stats.hits;
+    total->waits += ra->stats.waits;
+    total->wasted += ra->stats.wasted;
+    pthread_mutex_unlock(&ra->lock);
+}
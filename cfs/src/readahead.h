@@ -0,0 +1,58 @@
+#ifndef __CFS_READAHEAD__
+#define __CFS_READAHEAD__
+
+#include <pthread.h>
+
+#include "cfs.h"
+#include "pool.h"
+#include "util.h"
+
+#define CFS_READAHEAD 256 /* most blocks prefetched ahead of a sequential reader, 1MiB */
+#define CFS_READAHEAD_MIN 8 /* window right after a reader turns out sequential */
+#define CFS_PREFETCH_THREADS 4
+
+#define RA_EMPTY 0
+#define RA_LOADING 1
+#define RA_READY 2
+
+typedef struct {
+    int status;
+    int used; /* served a read since it was loaded */
+    unsigned char hash[HASH_LENGTH];
+    cfs_block_t block;
+    cfs_readahead_t* ra;
+} cfs_ra_slot_t;
+
+/*
+    Access pattern and prefetched blocks of one open file.
+    Block *index* can only live in slot index % cap. Slots are matched by hash
+    as well, a block rewritten since it was prefetched is simply a miss.
+*/
+struct cfs_readahead {
+    const cfs_blk_store_t* storage;
+    cfs_pool_t* pool;
+    cfs_buffers_t* buffers;
+    cfs_ra_slot_t* slots; /* allocated once the reader turns out sequential */
+    size_t cap;
+
+    off_t next; /* block the next read starts at if it is sequential */
+    off_t issued; /* blocks before this one were already prefetched */
+    size_t window;
+    size_t inflight;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+
+    cfs_readahead_stats_t stats;
+};
+
+int readahead_init(cfs_readahead_t* ra, const cfs_blk_store_t* storage, cfs_pool_t* pool, cfs_buffers_t* buffers,
+    size_t cap);
+void readahead_destroy(cfs_readahead_t* ra);
+size_t readahead_access(cfs_readahead_t* ra, const off_t first, const size_t count, off_t* start);
+void readahead_fetch(cfs_readahead_t* ra, const off_t index, const unsigned char* hash);
+int readahead_copy(cfs_readahead_t* ra, const off_t index, const unsigned char* hash,
+    char* dst, const off_t offset, const size_t len);
+void readahead_stats_add(cfs_readahead_stats_t* total, cfs_readahead_t* ra);
+
+#endif
@@ -0,0 +1,593 @@
+/*
+    Snapshots of directory trees.
+
+    Data is addressed by content, so a snapshot only copies the block maps
+    under a directory and takes one more reference to every block they map.
+    Snapshots live in CFS_SNAPSHOTS_DIRECTORY under the root, the mount keeps
+    them read-only. CFS_SNAPSHOT_THREADS threads copy the maps, each block
+    gets one reference update per file it appears in. Deleting a snapshot
+    collects the blocks of all of its files first, then drops the references
+    of each block with a single update.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "storage.h"
+#include "io.h"
+#include "util.h"
+#include "log.h"
+
+
+typedef struct {
+    char* src;
+    char* dst;
+    struct stat st;
+} snapshot_entry_t;
+
+typedef struct {
+    cfs_state_t* state;
+    const char* src;
+    const char* dst;
+    struct stat skip; /* the snapshots directory, never part of a snapshot */
+
+    snapshot_entry_t* files;
+    size_t n_files;
+    size_t files_cap;
+    snapshot_entry_t* dirs;
+    size_t n_dirs;
+    size_t dirs_cap;
+
+    /* blocks of a snapshot being deleted, sorted into distinct ones */
+    unsigned char* hashes;
+    size_t* counts;
+    size_t n_hashes;
+    size_t hashes_cap;
+
+    size_t next; /* next file or block a thread takes */
+    int error;
+    pthread_mutex_t lock;
+} snapshot_walk_t;
+
+
+/* nftw() takes no context, walks run one at a time */
+static snapshot_walk_t* walking;
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int snapshot_add(snapshot_entry_t** entries, size_t* n, size_t* cap, const char* src, const char* dst,
+    const struct stat* st)
+{
+    snapshot_entry_t* grown;
+
+    if (*n == *cap) {
+        *cap = max(*cap * 2, (size_t)64);
+        grown = realloc(*entries, *cap * sizeof(snapshot_entry_t));
+        if (grown == NULL) {
+            return -ENOMEM;
+        }
+        *entries = grown;
+    }
+
+    (*entries)[*n].src = strdup(src);
+    (*entries)[*n].dst = strdup(dst);
+    (*entries)[*n].st = *st;
+    if ((*entries)[*n].src == NULL || (*entries)[*n].dst == NULL) {
+        free((*entries)[*n].src);
+        free((*entries)[*n].dst);
+        return -ENOMEM;
+    }
+    (*n)++;
+
+    return 0;
+}
+
+
+static void snapshot_free(snapshot_walk_t* walk)
+{
+    size_t i;
+
+    for (i=0; i<walk->n_files; i++) {
+        free(walk->files[i].src);
+        free(walk->files[i].dst);
+    }
+    for (i=0; i<walk->n_dirs; i++) {
+        free(walk->dirs[i].src);
+        free(walk->dirs[i].dst);
+    }
+    free(walk->files);
+    free(walk->dirs);
+    free(walk->hashes);
+    free(walk->counts);
+    pthread_mutex_destroy(&walk->lock);
+}
+
+
+/*
+    Give a copied file or directory the owner, mode and times of the
+    original. The mount refuses writes to it whatever the mode says.
+*/
+static void snapshot_set_attrs(const snapshot_entry_t* entry)
+{
+    const struct timespec times[2] = { entry->st.st_atim, entry->st.st_mtim };
+
+    // only works for root, a snapshot then belongs to whoever owns the original
+    if (lchown(entry->dst, entry->st.st_uid, entry->st.st_gid) < 0 && errno != EPERM) {
+        log_error("CFS: Snapshot: chown");
+    }
+    chmod(entry->dst, entry->st.st_mode);
+    utimensat(AT_FDCWD, entry->dst, times, AT_SYMLINK_NOFOLLOW);
+}
+
+
+/*
+    Start *n* threads running *work* on *walk* and wait for them.
+*/
+static void snapshot_run(snapshot_walk_t* walk, void* (*work)(void*), size_t n)
+{
+    pthread_t threads[CFS_SNAPSHOT_THREADS];
+    size_t started, i;
+
+    walk->next = 0;
+    n = min(n, (size_t)CFS_SNAPSHOT_THREADS);
+    for (started=0; started<n; started++) {
+        if (pthread_create(&threads[started], NULL, work, walk) != 0) {
+            break;
+        }
+    }
+    if (started == 0 && n > 0) {
+        work(walk);
+    }
+    for (i=0; i<started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+static void snapshot_fail(snapshot_walk_t* walk, const int error)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->error == 0) {
+        walk->error = error;
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+
+/*
+    Lay out the directories and symbolic links of the snapshot, and list
+    the files to copy.
+*/
+static int snapshot_visit(const char* path, const struct stat* sb, int flag, struct FTW* ftwbuf)
+{
+    snapshot_walk_t* walk = walking;
+    char dst[PATH_MAX];
+    char link[PATH_MAX];
+    ssize_t len;
+
+    if (snprintf(dst, PATH_MAX, "%s%s", walk->dst, path + strlen(walk->src)) >= PATH_MAX) {
+        walk->error = -ENAMETOOLONG;
+        return FTW_STOP;
+    }
+
+    switch (flag) {
+    case FTW_D:
+        if (is_block_store(walk->state->storage, sb) ||
+            (sb->st_dev == walk->skip.st_dev && sb->st_ino == walk->skip.st_ino)) {
+            return FTW_SKIP_SUBTREE;
+        }
+        // writable until the whole tree is in, the snapshot itself exists already
+        if (ftwbuf->level > 0 && mkdir(dst, S_IRWXU) < 0) {
+            walk->error = -errno;
+            return FTW_STOP;
+        }
+        walk->error = snapshot_add(&walk->dirs, &walk->n_dirs, &walk->dirs_cap, path, dst, sb);
+        break;
+
+    case FTW_F:
+        walk->error = snapshot_add(&walk->files, &walk->n_files, &walk->files_cap, path, dst, sb);
+        break;
+
+    case FTW_SL:
+        len = readlink(path, link, PATH_MAX - 1);
+        if (len < 0) {
+            walk->error = -errno;
+            break;
+        }
+        link[len] = '\0';
+        if (symlink(link, dst) < 0) {
+            walk->error = -errno;
+            break;
+        }
+        if (lchown(dst, sb->st_uid, sb->st_gid) < 0 && errno != EPERM) {
+            log_error("CFS: Snapshot: chown");
+        }
+        break;
+
+    case FTW_DNR:
+    case FTW_NS:
+        walk->error = -EACCES;
+        break;
+
+    default:
+        log_msg("\n CFS: Snapshot: skipping %s\n", path);
+        break;
+    }
+
+    return walk->error < 0 ? FTW_STOP : FTW_CONTINUE;
+}
+
+
+/*
+    Copy the block map of one file, sharing all of its blocks.
+*/
+static int snapshot_file(cfs_state_t* state, const snapshot_entry_t* entry)
+{
+    int src_fd, dst_fd, ret;
+
+    // the handle is shared with whoever else has the file open, they may write
+    src_fd = open(entry->src, O_RDWR);
+    if (src_fd < 0 && errno == EACCES) {
+        src_fd = open(entry->src, O_RDONLY);
+    }
+    if (src_fd < 0) {
+        return -errno;
+    }
+    if (cfs_register_file(state, entry->src, src_fd) < 0) {
+        close(src_fd);
+        return -EIO;
+    }
+
+    dst_fd = cfs_create_open(state, entry->dst, S_IRUSR | S_IWUSR);
+    ret = dst_fd < 0 ? dst_fd : cfs_file_clone(state, cfs_get_file(state, src_fd), cfs_get_file(state, dst_fd));
+    if (dst_fd >= 0) {
+        if (cfs_release_file(state, dst_fd) < 0 && ret == 0) {
+            ret = -EIO;
+        }
+        close(dst_fd);
+    }
+    cfs_release_file(state, src_fd);
+    close(src_fd);
+
+    if (ret == 0) {
+        snapshot_set_attrs(entry);
+    }
+
+    return ret;
+}
+
+
+static void* snapshot_copier(void* arg)
+{
+    snapshot_walk_t* walk = (snapshot_walk_t*)arg;
+    size_t i;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&walk->lock);
+        i = walk->next++;
+        ret = walk->error;
+        pthread_mutex_unlock(&walk->lock);
+        if (i >= walk->n_files || ret < 0) {
+            break;
+        }
+
+        ret = snapshot_file(walk->state, &walk->files[i]);
+        if (ret < 0) {
+            log_msg("\n CFS: Snapshot: cannot copy %s\n", walk->files[i].src);
+            snapshot_fail(walk, ret);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Make the directories of a snapshot writable again, so it can be emptied.
+*/
+static int snapshot_unlock_dir(const char* path, const struct stat* sb, int flag, struct FTW* ftwbuf)
+{
+    if (flag == FTW_D) {
+        chmod(path, S_IRWXU);
+    }
+
+    return FTW_CONTINUE;
+}
+
+
+/*
+    Append the stored blocks the map *fd* refers to.
+*/
+static int snapshot_collect(snapshot_walk_t* walk, const int fd)
+{
+    char pairs[CFS_SCAN_PAIRS * (BLOCK_PAIR)];
+    unsigned char* grown;
+    const unsigned char* hash;
+    off_t total, pos = BLOCK_START;
+    ssize_t bytes_read;
+    size_t n, i;
+
+    if (s_pread(fd, &total, sizeof(off_t), TOTAL_BLOCKS_START) != sizeof(off_t)) {
+        return -EIO;
+    }
+
+    while (total > 0) {
+        n = min(total, CFS_SCAN_PAIRS);
+        bytes_read = s_pread(fd, pairs, n * (BLOCK_PAIR), pos);
+        if (bytes_read < (ssize_t)(n * (BLOCK_PAIR))) {
+            return -EIO;
+        }
+
+        if (walk->n_hashes + n > walk->hashes_cap) {
+            walk->hashes_cap = max(walk->hashes_cap * 2, walk->n_hashes + n);
+            grown = realloc(walk->hashes, walk->hashes_cap * HASH_LENGTH);
+            if (grown == NULL) {
+                return -ENOMEM;
+            }
+            walk->hashes = grown;
+        }
+        for (i=0; i<n; i++) {
+            hash = (unsigned char*)pairs + i * (BLOCK_PAIR) + sizeof(off_t);
+            // staged and inline data go with the staging extent and the map
+            if (memcmp(hash, STAGED_MARK, STAGED_MARK_LEN) != 0 && memcmp(hash, INLINE_MARK, INLINE_MARK_LEN) != 0) {
+                memcpy(walk->hashes + walk->n_hashes * HASH_LENGTH, hash, HASH_LENGTH);
+                walk->n_hashes++;
+            }
+        }
+
+        pos += n * (BLOCK_PAIR);
+        total -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+    Remove everything of a snapshot, remembering the blocks of its files.
+    A map that can't be read stays, its blocks keep their references.
+*/
+static int snapshot_remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftwbuf)
+{
+    snapshot_walk_t* walk = walking;
+    int fd, ret = 0;
+
+    if (flag == FTW_F) {
+        fd = open(path, O_RDONLY);
+        ret = fd < 0 ? -errno : snapshot_collect(walk, fd);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ret == 0) {
+            cfs_stat_forget(walk->state, sb);
+            remove_staging(walk->state->storage, sb->st_ino);
+        }
+    }
+
+    if (ret == 0 && (flag == FTW_DP ? rmdir(path) : unlink(path)) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        log_msg("\n CFS: Snapshot: cannot remove %s\n", path);
+        if (walk->error == 0) {
+            walk->error = ret;
+        }
+    }
+
+    return walk->error == -ENOMEM ? FTW_STOP : FTW_CONTINUE;
+}
+
+
+static int snapshot_hash_cmp(const void* a, const void* b)
+{
+    return memcmp(a, b, HASH_LENGTH);
+}
+
+
+static void* snapshot_releaser(void* arg)
+{
+    snapshot_walk_t* walk = (snapshot_walk_t*)arg;
+    size_t i;
+
+    while (1) {
+        pthread_mutex_lock(&walk->lock);
+        i = walk->next++;
+        pthread_mutex_unlock(&walk->lock);
+        if (i >= walk->n_hashes) {
+            break;
+        }
+
+        if (block_sub_ref(walk->state->storage, walk->hashes + i * HASH_LENGTH, walk->counts[i]) < 0) {
+            snapshot_fail(walk, -EIO);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    Delete the snapshot at *path*, then drop the references its files held.
+*/
+static int snapshot_remove(cfs_state_t* state, const char* path)
+{
+    snapshot_walk_t walk;
+    size_t i, n;
+    int ret;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.state = state;
+    pthread_mutex_init(&walk.lock, NULL);
+
+    pthread_mutex_lock(&walk_lock);
+    walking = &walk;
+    nftw(path, snapshot_unlock_dir, 16, FTW_PHYS);
+    nftw(path, snapshot_remove_entry, 16, FTW_PHYS | FTW_DEPTH);
+    walking = NULL;
+    pthread_mutex_unlock(&walk_lock);
+
+    // one update per distinct block
+    if (walk.n_hashes > 0) {
+        qsort(walk.hashes, walk.n_hashes, HASH_LENGTH, snapshot_hash_cmp);
+        walk.counts = malloc(walk.n_hashes * sizeof(size_t));
+        if (walk.counts == NULL) {
+            snapshot_free(&walk);
+            return -ENOMEM;
+        }
+        for (i=0, n=0; i<walk.n_hashes; i++) {
+            if (n > 0 && memcmp(walk.hashes + (n - 1) * HASH_LENGTH, walk.hashes + i * HASH_LENGTH, HASH_LENGTH) == 0) {
+                walk.counts[n - 1]++;
+                continue;
+            }
+            memmove(walk.hashes + n * HASH_LENGTH, walk.hashes + i * HASH_LENGTH, HASH_LENGTH);
+            walk.counts[n++] = 1;
+        }
+        walk.n_hashes = n;
+        snapshot_run(&walk, snapshot_releaser, (n + 1023) / 1024);
+    }
+
+    log_msg("\n CFS: Snapshot: removed %s, %zu blocks released\n", path, walk.n_hashes);
+    ret = walk.error;
+    snapshot_free(&walk);
+
+    return ret;
+}
+
+
+/*
+    Whether *name* can name a snapshot, a single path component.
+*/
+static int snapshot_name_ok(const char* name)
+{
+    return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+        strlen(name) <= NAME_MAX;
+}
+
+
+/*
+    Capture the tree under the directory *path* as snapshot *name*.
+    Only root or the owner of the directory, *uid*, may.
+    Returns 0 or -errno.
+*/
+int snapshot_create(cfs_state_t* state, const char* path, const char* name, const uid_t uid)
+{
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    snapshot_walk_t walk;
+    struct stat st;
+    size_t i, len;
+    int ret;
+
+    if (!snapshot_name_ok(name)) {
+        return -EINVAL;
+    }
+    if (realpath(path, src) == NULL) {
+        return -errno;
+    }
+    len = strlen(state->root);
+    if (strncmp(src, state->root, len) != 0 || (src[len] != '/' && src[len] != '\0')) {
+        return -EXDEV;
+    }
+    if (stat(src, &st) < 0) {
+        return -errno;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return -ENOTDIR;
+    }
+    if (uid != 0 && st.st_uid != uid) {
+        return -EPERM;
+    }
+
+    memset(&walk, 0, sizeof(walk));
+    walk.state = state;
+    walk.src = src;
+    walk.dst = dst;
+
+    snprintf(dst, PATH_MAX, "%s/%s", state->root, CFS_SNAPSHOTS_DIRECTORY);
+    if (mkdir(dst, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    if (stat(dst, &walk.skip) < 0) {
+        return -errno;
+    }
+    if (is_block_store(state->storage, &st) || (st.st_dev == walk.skip.st_dev && st.st_ino == walk.skip.st_ino)) {
+        return -EINVAL;
+    }
+    len = strlen(dst);
+    if (snprintf(dst + len, PATH_MAX - len, "/%s", name) >= PATH_MAX - len) {
+        return -ENAMETOOLONG;
+    }
+    if (mkdir(dst, S_IRWXU) < 0) {
+        return -errno;
+    }
+
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_mutex_lock(&walk_lock);
+    walking = &walk;
+    if (nftw(src, snapshot_visit, 16, FTW_PHYS | FTW_ACTIONRETVAL) < 0 && walk.error == 0) {
+        walk.error = -errno;
+    }
+    walking = NULL;
+    pthread_mutex_unlock(&walk_lock);
+
+    if (walk.error == 0) {
+        snapshot_run(&walk, snapshot_copier, walk.n_files);
+    }
+    // directories last, deepest first, so their contents are in and their times stick
+    for (i=walk.n_dirs; walk.error == 0 && i>0; i--) {
+        snapshot_set_attrs(&walk.dirs[i - 1]);
+    }
+
+    log_msg("\n CFS: Snapshot: %s of %s, %zu files, error %d\n", dst, src, walk.n_files, walk.error);
+    ret = walk.error;
+    snapshot_free(&walk);
+    if (ret < 0) {
+        snapshot_remove(state, dst);
+    }
+
+    return ret;
+}
+
+
+/*
+    Delete snapshot *name*. Only root or the owner of the snapshot, *uid*,
+    may, and none of its files may be open.
+    Returns 0 or -errno.
+*/
+int snapshot_delete(cfs_state_t* state, const char* name, const uid_t uid)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!snapshot_name_ok(name)) {
+        return -EINVAL;
+    }
+    if (snprintf(path, PATH_MAX, "%s/%s/%s", state->root, CFS_SNAPSHOTS_DIRECTORY, name) >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (lstat(path, &st) < 0) {
+        return -errno;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return -ENOTDIR;
+    }
+    if (uid != 0 && st.st_uid != uid) {
+        return -EPERM;
+    }
+    if (cfs_open_under(state, path)) {
+        return -EBUSY;
+    }
+
+    return snapshot_remove(state, path);
+}
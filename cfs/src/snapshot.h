@@ -0,0 +1,11 @@
+#ifndef __CFS_SNAPSHOT__
+#define __CFS_SNAPSHOT__
+
+#include <sys/types.h>
+
+#include "cfs.h"
+
+int snapshot_create(cfs_state_t* state, const char* path, const char* name, const uid_t uid);
+int snapshot_delete(cfs_state_t* state, const char* name, const uid_t uid);
+
+#endif
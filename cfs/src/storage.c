@@ -8,15 +8,26 @@
 	------------------
 	size_t ref_counter
 	BLOCK_SIZE data
+
+	Blocks placed in a region have REF_PLACED set in their counter and keep
+	a cfs_block_loc_t instead of their data. Regions are append only files
+	shared by the blocks one stream stored, so those stay contiguous on disk.
+	The slot of a released block is punched out, a region left without data
+	is removed once its stream has closed it.
  */
 
 #define _GNU_SOURCE
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <linux/falloc.h>
 
 #include "storage.h"
 #include "io.h"
@@ -26,6 +37,88 @@
 #define REF_START 0
 #define REF_SIZE sizeof(size_t)
 #define DATA_START REF_START + REF_SIZE
+#define REF_PLACED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define REF_COUNT(refs) ((refs) & ~REF_PLACED)
+
+
+/*
+	Read the location of a placed block from its open block file.
+	Returns 1 if it was placed in a region, 0 if the data follows the counter.
+ */
+static int read_location(int fd, cfs_block_loc_t* loc) {
+	size_t refs;
+
+	if (s_pread(fd, &refs, REF_SIZE, REF_START) != REF_SIZE) {
+		return -1;
+	}
+	if (!(refs & REF_PLACED)) {
+		return 0;
+	}
+	if (s_pread(fd, loc, sizeof(*loc), DATA_START) != sizeof(*loc)) {
+		return -1;
+	}
+	loc->region[REGION_NAME_LEN - 1] = '\0';
+
+	return 1;
+}
+
+static int open_region_file(const cfs_blk_store_t* storage, const char* name, const int flags) {
+	char path[strlen(storage->regions_path) + REGION_NAME_LEN + 2];
+
+	combine(path, storage->regions_path, name);
+	return open(path, flags);
+}
+
+/*
+	Lock the whole of region *fd* with *type*, without waiting.
+	The stream writing a region holds a read lock on it until close_region().
+ */
+static int lock_region(int fd, const short type) {
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+
+	return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+/*
+	Remove region *name* if no slot of it holds data any more and no stream
+	writes to it. SEEK_DATA finds data not yet written back too, where it is
+	not supported the whole file counts as data and the region stays.
+ */
+static void drop_empty_region(const cfs_blk_store_t* storage, const char* name, int fd) {
+	char path[strlen(storage->regions_path) + REGION_NAME_LEN + 2];
+
+	if (lseek(fd, 0, SEEK_DATA) != -1 || errno != ENXIO) {
+		return;
+	}
+	if (lock_region(fd, F_WRLCK) == -1) {
+		return;
+	}
+	combine(path, storage->regions_path, name);
+	unlink(path);
+}
+
+/*
+	Give the space of the slot a released block had at *loc* back.
+ */
+static void release_slot(const cfs_blk_store_t* storage, const cfs_block_loc_t* loc) {
+	int fd;
+
+	fd = open_region_file(storage, loc->region, O_RDWR);
+	if (fd == -1) {
+		return;
+	}
+	// without hole punching the slot stays allocated until the region goes
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, loc->offset, BLOCK_SIZE) == 0) {
+		drop_empty_region(storage, loc->region, fd);
+	}
+	close(fd);
+}
 
 
 size_t block_get_refs( const cfs_blk_store_t* storage, const unsigned char* hash) {
@@ -61,12 +154,30 @@ size_t block_get_refs( const cfs_blk_store_t* storage, const unsigned char* hash
 }
 
 
+/*
+	Drop a reference to a block, the last one deletes it.
+	Returns the references left. A store that predates exact counts keeps
+	every block.
+ */
 int block_dec_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
+	return block_sub_ref(storage, hash, 1);
+}
+
+
+/*
+	Drop *n* references to a block at once, like block_dec_ref().
+ */
+int block_sub_ref( const cfs_blk_store_t* storage, const unsigned char* hash, const size_t n) {
 	int fd;
 	ssize_t ret;
 	size_t refs;
 	char path[storage->block_fname_size];
 	char buff[HASH_LENGTH * 2 + 1];
+	cfs_block_loc_t loc;
+
+	if (!storage->counted) {
+		return 1;
+	}
 
 	// convert hash to readable hex string
 	hexify(hash, HASH_LENGTH, buff, HASH_LENGTH * 2);
@@ -101,15 +212,24 @@ int block_dec_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
 		return -1;
 	}
 
-	// decrease and write refs or delete the file
-	refs--;
-	if (refs == 0 ) {
+	if (REF_COUNT(refs) == 0) {
+		// already released, only waiting to be unlinked
+		close(fd);
+		return 0;
+	}
+
+	// the count is written even for the last reference, so block_inc_ref()
+	// on a handle opened before the unlink sees the block is gone
+	refs -= min(n, (size_t)REF_COUNT(refs));
+	s_lseek(fd, REF_START, SEEK_SET);
+	if ( s_write(fd, (void*)(&refs), REF_SIZE) != REF_SIZE) {
+		close(fd);
+		return -1;
+	}
+	if (REF_COUNT(refs) == 0) {
 		unlink(path);
-	} else {
-		s_lseek(fd, REF_START, SEEK_SET);
-		if ( s_write(fd, (void*)(&refs), REF_SIZE) != REF_SIZE) {
-			close(fd);
-			return -1;
+		if (read_location(fd, &loc) == 1) {
+			release_slot(storage, &loc);
 		}
 	}
 
@@ -120,11 +240,24 @@ int block_dec_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
 	}
 
 	close(fd);
-	return refs;
+	return REF_COUNT(refs);
 }
 
 
+/*
+	Take another reference to a stored block.
+	Returns the new count, 0 if the block is not (or no longer, or not yet
+	completely) stored.
+ */
 int block_inc_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
+	return block_add_ref(storage, hash, 1);
+}
+
+
+/*
+	Take *n* more references to a stored block at once, like block_inc_ref().
+ */
+int block_add_ref( const cfs_blk_store_t* storage, const unsigned char* hash, const size_t n) {
 	int fd;
 	ssize_t ret;
 	size_t refs;
@@ -138,6 +271,9 @@ int block_inc_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
 	combine(path, storage->blocks_path, buff);
 	fd = open(path, O_RDWR);
 	if (fd == -1) {
+		if (errno == ENOENT) {
+			return 0;
+		}
 		log_error("Cannot open block");
 		return -1;
 	}
@@ -157,15 +293,19 @@ int block_inc_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
 		return -1;
 	}
 
-	// read refs
-	s_lseek(fd, REF_START, SEEK_SET);
-	if ( s_read(fd, (void*)(&refs), REF_SIZE) != REF_SIZE) {
+	// read refs, an empty file is still being stored by someone else
+	ret = s_pread(fd, (void*)(&refs), REF_SIZE, REF_START);
+	if (ret == 0 || (ret == REF_SIZE && REF_COUNT(refs) == 0)) {
+		close(fd);
+		return 0;
+	}
+	if (ret != REF_SIZE) {
 		close(fd);
 		return -1;
 	}
 
 	// increase and write refs
-	refs++;
+	refs += n;
 	s_lseek(fd, 0, SEEK_SET);
 	if ( s_write(fd, (void*)(&refs), REF_SIZE) != REF_SIZE) {
 		close(fd);
@@ -180,7 +320,7 @@ int block_inc_ref( const cfs_blk_store_t* storage, const unsigned char* hash) {
 	}
 
 	close(fd);
-	return refs;
+	return REF_COUNT(refs);
 }
 
 
@@ -217,8 +357,12 @@ ssize_t block_get_size( const cfs_blk_store_t* storage, const unsigned char* has
 		return -1;
 	}
 
-	s_lseek(fd, DATA_START, SEEK_SET);
-	ret = s_lseek(fd, 0, SEEK_END);
+	cfs_block_loc_t loc;
+	if (read_location(fd, &loc) == 1) {
+		ret = loc.size;
+	} else {
+		ret = s_lseek(fd, 0, SEEK_END) - DATA_START;
+	}
 
 	fl.l_type = F_ULOCK;
 	if (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
@@ -244,66 +388,160 @@ int block_exists( const cfs_blk_store_t* storage, const unsigned char* hash) {
 }
 
 int store_block(const cfs_blk_store_t* storage, const unsigned char* data, const size_t size, unsigned char* hash) {
-	int fd, ret;
+	return store_block_in(storage, NULL, data, size, hash);
+}
+
+/*
+	Write *size* bytes of block data to the slot at *pos* of *region*. A
+	direct region only takes whole slots from aligned memory, anything else
+	goes through a copy padded with zeroes.
+ */
+static int write_region(cfs_region_t* region, const unsigned char* data, const size_t size, const off_t pos) {
+	void* padded;
+	ssize_t ret;
+
+	if (!region->direct) {
+		return s_pwrite(region->fd, data, size, pos) == size ? 0 : -1;
+	}
+	if (size == BLOCK_SIZE && (uintptr_t)data % BLOCK_SIZE == 0) {
+		return s_pwrite(region->fd, data, BLOCK_SIZE, pos) == BLOCK_SIZE ? 0 : -1;
+	}
+
+	if (posix_memalign(&padded, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	memcpy(padded, data, size);
+	memset((char*)padded + size, '\0', BLOCK_SIZE - size);
+	ret = s_pwrite(region->fd, padded, BLOCK_SIZE, pos);
+	free(padded);
+
+	return ret == BLOCK_SIZE ? 0 : -1;
+}
+
+/*
+	Write a block to a file in the blocks directory that has no name yet,
+	its data going to the next slot of *region* when it is not NULL. Where
+	the filesystem has no unnamed files it is named *tmp* instead, which is
+	left empty otherwise.
+	Returns the open file, or -1 with nothing left behind.
+ */
+static int write_block_file(const cfs_blk_store_t* storage, cfs_region_t* region, const unsigned char* data,
+		const size_t size, const char* path, char* tmp, cfs_block_loc_t* loc) {
+	int fd;
+	size_t refs = 1;
+
+	tmp[0] = '\0';
+	fd = open(storage->blocks_path, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		sprintf(tmp, "%s.XXXXXX", path);
+		fd = mkstemp(tmp);
+	}
+	if (fd == -1) {
+		log_error("Cannot write block");
+		return -1;
+	}
+
+	if (region) {
+		// the data goes first, readers only follow a complete location
+		memset(loc, 0, sizeof(*loc));
+		strcpy(loc->region, region->name);
+		loc->size = size;
+		pthread_mutex_lock(&region->lock);
+		loc->offset = region->end;
+		region->end += BLOCK_SIZE;
+		pthread_mutex_unlock(&region->lock);
+
+		if (write_region(region, data, size, loc->offset) != 0) {
+			log_error("Cannot write data to region");
+			goto fail;
+		}
+		refs |= REF_PLACED;
+	}
+
+	if (s_write(fd, (void*)(&refs), REF_SIZE) != REF_SIZE) {
+		log_error("Cannot write refs");
+		goto fail;
+	}
+	if (region ? s_write(fd, (void*)loc, sizeof(*loc)) != sizeof(*loc) : s_write(fd, (void*)data, size) != size) {
+		log_error("Cannot write data");
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	if (tmp[0]) {
+		unlink(tmp);
+	}
+	if (region) {
+		release_slot(storage, loc);
+	}
+	return -1;
+}
+
+/*
+	Store a block like store_block(), placing a new one in the next slot of
+	*region* when it is not NULL.
+	The block is written whole before it is linked into place, so whoever
+	finds it by name finds it complete.
+ */
+int store_block_in(const cfs_blk_store_t* storage, cfs_region_t* region, const unsigned char* data, const size_t size, unsigned char* hash) {
+	int fd = -1, ret, linked = 0;
 	char path[storage->block_fname_size];
+	char tmp[storage->block_fname_size + 8];
+	char proc[32];
 	char buff[HASH_LENGTH * 2 + 1];
-	const size_t refs = 1;
+	cfs_block_loc_t loc;
 
 	// convert hash to readable hex string
 	hexify(hash, HASH_LENGTH, buff, HASH_LENGTH * 2);
 
 	// Create the file path and save the block
 	combine(path, storage->blocks_path, buff);
-	if (!file_exists(path)) {
-		fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-		if (fd == -1) {
-			log_error("Cannot write block");
-			return -1;
+	for (;;) {
+		// already stored, unless its last reference is gone
+		ret = block_inc_ref(storage, hash);
+		if (ret != 0) {
+			ret = ret > 0 ? 0 : -1;
+			break;
 		}
-
-		struct flock fl;
-		memset(&fl, 0, sizeof(fl));
-		
-		// lock the whole file
-		fl.l_type = F_WRLCK;
-		fl.l_whence = SEEK_SET; 
-		fl.l_start = 0;
-		fl.l_len = 0;
-
-		if (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
-			// TODO: EINTR
-			log_error("Cannot lock block");
-			close(fd);
-			return -1;
+		if (fd == -1) {
+			fd = write_block_file(storage, region, data, size, path, tmp, &loc);
+			if (fd == -1) {
+				return -1;
+			}
 		}
-
-		ret = s_write(fd,  (void*)(&refs), REF_SIZE);
-		if (ret != REF_SIZE) {
-			log_error("Cannot write refs");
-			close(fd);
-			return -1;
+		if (tmp[0]) {
+			ret = link(tmp, path);
+		} else {
+			sprintf(proc, "/proc/self/fd/%d", fd);
+			ret = linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
 		}
-
-		ret = s_write(fd, (void*)data, size * sizeof(*data));
-		if (ret != size) {
-			log_error("Cannot write data");
-			close(fd);
-			return -1;
+		if (ret == 0) {
+			linked = 1;
+			ret = size;
+			break;
 		}
-
-		fl.l_type = F_ULOCK;
-		if (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
-			// TODO: EINTR
-			log_error("Cannot lock block");
-			close(fd);
-			return -1;
+		if (errno != EEXIST) {
+			log_error("Cannot link block");
+			ret = -1;
+			break;
 		}
+		// stored by someone else meanwhile, reference theirs
+	}
 
+	if (fd != -1) {
 		close(fd);
-		return ret;
+		if (tmp[0]) {
+			unlink(tmp);
+		}
+		if (region && !linked) {
+			// the slot written is not linked to
+			release_slot(storage, &loc);
+		}
 	}
-	
-	return 0;
+	return ret;
 }
 
 int load_block(const cfs_blk_store_t* storage, const unsigned char* hash, unsigned char* data, size_t* size, size_t* refs) {
@@ -346,8 +584,14 @@ int load_block(const cfs_blk_store_t* storage, const unsigned char* hash, unsign
 			return -1;
 		}
 
-		s_lseek(fd, DATA_START, SEEK_SET);
-		ret = s_read(fd, data, BLOCK_SIZE);
+		cfs_block_loc_t loc;
+		if (*refs & REF_PLACED) {
+			*refs = REF_COUNT(*refs);
+			ret = read_location(fd, &loc) == 1 ? load_region_range(storage, &loc, data, 0, loc.size) : -1;
+		} else {
+			s_lseek(fd, DATA_START, SEEK_SET);
+			ret = s_read(fd, data, BLOCK_SIZE);
+		}
 		if (ret <= 0) {
 			log_error("Cannot read block");
 			close(fd);
@@ -374,33 +618,378 @@ int load_block(const cfs_blk_store_t* storage, const unsigned char* hash, unsign
 	return 0;
 }
 
-int init_storage(cfs_blk_store_t* storage, const char* root) {
+/*
+	Read *len* bytes of a block's data starting at *offset* straight into *data*.
+	Returns the number of bytes read, which is less than *len* for short blocks.
+ */
+ssize_t load_block_range(const cfs_blk_store_t* storage, const unsigned char* hash, unsigned char* data, const off_t offset, const size_t len) {
+	int fd;
+	ssize_t ret;
+	char path[storage->block_fname_size];
+	char buff[HASH_LENGTH * 2 + 1];
+
+	// convert hash to readable hex string
+	hexify(hash, HASH_LENGTH, buff, HASH_LENGTH * 2);
+
+	combine(path, storage->blocks_path, buff);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		log_msg("\n CFS: BLOCK NOT FOUND %s\n", buff);
+		return -ENOENT;
+	}
+
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+
+	// lock the counter and the data region we are about to read
+	fl.l_type = F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = REF_START;
+	fl.l_len = DATA_START + offset + len;
+
+	if (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+		// TODO: EINTR
+		log_error("Cannot lock block");
+		close(fd);
+		return -1;
+	}
+
+	cfs_block_loc_t loc;
+	ret = read_location(fd, &loc);
+	if (ret == 1) {
+		if (loc.size <= offset) {
+			ret = 0;
+		} else if (storage->direct && offset + len <= BLOCK_SIZE) {
+			// the rest of the slot is zeroes, reading all of it can bypass the page cache
+			ret = load_region_range(storage, &loc, data, offset, len);
+			ret = ret < 0 ? ret : min(ret, (ssize_t)(loc.size - offset));
+		} else {
+			ret = load_region_range(storage, &loc, data, offset, min(len, loc.size - offset));
+		}
+	} else if (ret == 0) {
+		ret = s_pread(fd, data, len, DATA_START + offset);
+	}
+	if (ret < 0) {
+		log_error("Cannot read block");
+	}
+
+	// closing the descriptor drops the lock
+	close(fd);
+	return ret;
+}
+
+/*
+	Staging extents are plain sparse files, named after the inode of the CFS
+	file they belong to so they survive renames. Data sits at its logical offset.
+ */
+int open_staging(const cfs_blk_store_t* storage, const ino_t ino, const int flags) {
+	char path[strlen(storage->staging_path) + 32];
+	char name[32];
+
+	snprintf(name, sizeof(name), "%lu", (unsigned long)ino);
+	combine(path, storage->staging_path, name);
+
+	return open(path, flags, S_IRUSR | S_IWUSR);
+}
+
+int remove_staging(const cfs_blk_store_t* storage, const ino_t ino) {
+	char path[strlen(storage->staging_path) + 32];
+	char name[32];
+
+	snprintf(name, sizeof(name), "%lu", (unsigned long)ino);
+	combine(path, storage->staging_path, name);
+
+	return unlink(path);
+}
+
+/*
+	Where block *hash* keeps its data.
+	Returns 1 if it was placed in a region, 0 if not, -ENOENT if there is no such block.
+ */
+int block_locate(const cfs_blk_store_t* storage, const unsigned char* hash, cfs_block_loc_t* loc) {
+	int fd, ret;
+	char path[storage->block_fname_size];
+	char buff[HASH_LENGTH * 2 + 1];
+
+	// convert hash to readable hex string
+	hexify(hash, HASH_LENGTH, buff, HASH_LENGTH * 2);
+
+	combine(path, storage->blocks_path, buff);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -ENOENT;
+	}
+
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+
+	// lock the counter and the location
+	fl.l_type = F_RDLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = REF_START;
+	fl.l_len = DATA_START + sizeof(*loc);
+
+	if (fcntl(fd, F_OFD_SETLKW, &fl) == -1) {
+		// TODO: EINTR
+		log_error("Cannot lock block");
+		close(fd);
+		return -1;
+	}
+
+	ret = read_location(fd, loc);
+	close(fd);
+	return ret;
+}
+
+/*
+	Read *len* bytes at *offset* of a placed block straight from its region.
+	Reading past the block runs on into the slots that follow it, which is
+	how blocks stored back to back are loaded with a single read. A direct
+	store reads whole aligned slots into aligned memory with O_DIRECT.
+ */
+ssize_t load_region_range(const cfs_blk_store_t* storage, const cfs_block_loc_t* loc, unsigned char* data, const off_t offset, const size_t len) {
+	int fd = -1;
+	ssize_t ret;
+
+	if (storage->direct && (uintptr_t)data % BLOCK_SIZE == 0 &&
+		(loc->offset + offset) % BLOCK_SIZE == 0 && len % BLOCK_SIZE == 0) {
+		fd = open_region_file(storage, loc->region, O_RDONLY | O_DIRECT);
+	}
+	if (fd == -1) {
+		fd = open_region_file(storage, loc->region, O_RDONLY);
+	}
+	if (fd == -1) {
+		log_msg("\n CFS: REGION NOT FOUND %s\n", loc->region);
+		return -ENOENT;
+	}
+
+	// slots are never rewritten, no lock needed
+	ret = s_pread(fd, data, len, loc->offset + offset);
+	close(fd);
+	return ret;
+}
+
+/*
+	Open the file that holds the data of block *hash* for reading it in place,
+	or, when *loc* is given, the region of that slot. *pos* is set to where the
+	data starts in it. Stored data never changes, so no lock is kept.
+ */
+int open_block_data(const cfs_blk_store_t* storage, const unsigned char* hash, const cfs_block_loc_t* loc, off_t* pos) {
+	int fd;
+	char path[storage->block_fname_size];
+	char buff[HASH_LENGTH * 2 + 1];
+	cfs_block_loc_t placed;
+
+	if (loc) {
+		*pos = loc->offset;
+		return open_region_file(storage, loc->region, O_RDONLY);
+	}
+
+	// convert hash to readable hex string
+	hexify(hash, HASH_LENGTH, buff, HASH_LENGTH * 2);
+
+	combine(path, storage->blocks_path, buff);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -ENOENT;
+	}
+
+	switch (read_location(fd, &placed)) {
+	case 0:
+		*pos = DATA_START;
+		return fd;
+	case 1:
+		close(fd);
+		*pos = placed.offset;
+		return open_region_file(storage, placed.region, O_RDONLY);
+	default:
+		close(fd);
+		return -1;
+	}
+}
+
+/*
+	Flush everything written to the store so far to disk: block files, their
+	directory entries, regions and staging extents. The filesystem holding
+	the store is synced as a whole, one journal commit however many blocks
+	were written since the last sync.
+ */
+int sync_storage(const cfs_blk_store_t* storage) {
+	int fd, ret;
+
+	fd = open(storage->blocks_path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		log_error("Cannot open the block store");
+		return -1;
+	}
+
+	ret = syncfs(fd);
+	if (ret == -1) {
+		log_error("Cannot sync the block store");
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+	Create a new, empty append region.
+ */
+int open_region(const cfs_blk_store_t* storage, cfs_region_t* region) {
+	char path[strlen(storage->regions_path) + REGION_NAME_LEN + 2];
+
+	combine(path, storage->regions_path, "XXXXXX");
+	region->fd = mkstemp(path);
+	if (region->fd == -1) {
+		log_error("Cannot create region");
+		return -1;
+	}
+
+	// set afterwards, a filesystem without O_DIRECT would fail the open after creating the file
+	region->direct = storage->direct && fcntl(region->fd, F_SETFL, O_DIRECT) == 0;
+	if (storage->direct && !region->direct) {
+		log_msg("\n CFS: Storage: region %s uses the page cache, no O_DIRECT here\n", path);
+	}
+
+	// marks the region as written to, it is not removed while this is held
+	if (lock_region(region->fd, F_RDLCK) == -1) {
+		log_error("Cannot lock region");
+		close(region->fd);
+		unlink(path);
+		return -1;
+	}
+
+	strncpy(region->name, strrchr(path, '/') + 1, REGION_NAME_LEN - 1);
+	region->name[REGION_NAME_LEN - 1] = '\0';
+	region->end = 0;
+	pthread_mutex_init(&region->lock, NULL);
+
+	return 0;
+}
+
+/*
+	Close the region of a stream, removing it if it holds no data, either
+	because nothing was stored in it or because all of its blocks were
+	released while it was open.
+ */
+void close_region(const cfs_blk_store_t* storage, cfs_region_t* region) {
+	int fd;
+
+	// a second description, the lock of region->fd would block the removal
+	lock_region(region->fd, F_UNLCK);
+	fd = open_region_file(storage, region->name, O_RDWR);
+	if (fd != -1) {
+		drop_empty_region(storage, region->name, fd);
+		close(fd);
+	}
+	close(region->fd);
+	pthread_mutex_destroy(&region->lock);
+}
+
+/*
+	Whether the blocks directory holds no block yet.
+ */
+static int blocks_dir_empty(const char* path) {
+	DIR* dir;
+	struct dirent* entry;
+	int empty = 1;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+	while (empty && (entry = readdir(dir)) != NULL) {
+		empty = strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+			strcmp(entry->d_name, STAGING_DIRECTORY) == 0 || strcmp(entry->d_name, REGIONS_DIRECTORY) == 0;
+	}
+	closedir(dir);
+
+	return empty;
+}
+
+/*
+	Set up the block store at *blocks*, or in BLOCKS_DIRECTORY under *root*
+	when it is NULL.  It may sit on another device than the files.
+*/
+int init_storage(cfs_blk_store_t* storage, const char* root, const char* blocks) {
+	int fd;
 	size_t root_len = strlen(root);
+	size_t blocks_len = blocks ? strlen(blocks) : root_len + sizeof(BLOCKS_DIRECTORY);
 
 	// Calculate the filename size for all blocks
-	storage->block_fname_size = root_len + 1 + sizeof(BLOCKS_DIRECTORY) +  1 + SHA_DIGEST_LENGTH * 2 + 2;
+	storage->block_fname_size = blocks_len + 1 + SHA_DIGEST_LENGTH * 2 + 2;
 
-	storage->blocks_path = malloc(root_len + sizeof(BLOCKS_DIRECTORY) + 1);
+	storage->blocks_path = malloc(blocks_len + 1);
+	storage->staging_path = malloc(blocks_len + sizeof(STAGING_DIRECTORY) + 2);
+	storage->regions_path = malloc(blocks_len + sizeof(REGIONS_DIRECTORY) + 2);
 	storage->root_path = malloc(root_len + 1);
-	if (storage->blocks_path == NULL || storage->root_path == NULL) {
+	if (storage->blocks_path == NULL || storage->staging_path == NULL || storage->regions_path == NULL ||
+		storage->root_path == NULL) {
 		perror("Storage: alloc paths");
 		return -1;
 	}
 
 	/* store paths */
 	strcpy(storage->root_path, root);
-	combine(storage->blocks_path, root, BLOCKS_DIRECTORY);
+	if (blocks) {
+		strcpy(storage->blocks_path, blocks);
+	} else {
+		combine(storage->blocks_path, root, BLOCKS_DIRECTORY);
+	}
+	combine(storage->staging_path, storage->blocks_path, STAGING_DIRECTORY);
+	combine(storage->regions_path, storage->blocks_path, REGIONS_DIRECTORY);
 
 	/* check if the blocks directory exists, otherwise create it */
 	struct stat st = {0};
 	if (stat(storage->blocks_path, &st) == -1) {
 		mkdir(storage->blocks_path, 0700);
 	}
+	if (stat(storage->staging_path, &st) == -1) {
+		mkdir(storage->staging_path, 0700);
+	}
+	if (stat(storage->regions_path, &st) == -1) {
+		mkdir(storage->regions_path, 0700);
+	}
+
+	/* remember which directory it is, wherever it is reached from */
+	if (stat(storage->blocks_path, &st) == -1) {
+		perror("Storage: blocks directory");
+		return -1;
+	}
+	storage->dev = st.st_dev;
+	storage->ino = st.st_ino;
+	storage->direct = 0;
+
+	/* counts of blocks stored before they were kept exact can't be trusted */
+	char marker[blocks_len + sizeof(COUNTED_MARKER) + 2];
+	combine(marker, storage->blocks_path, COUNTED_MARKER);
+	if (file_exists(marker)) {
+		storage->counted = 1;
+	} else if (blocks_dir_empty(storage->blocks_path)) {
+		fd = creat(marker, S_IRUSR | S_IWUSR);
+		storage->counted = fd != -1;
+		if (fd != -1) {
+			close(fd);
+		}
+	} else {
+		storage->counted = 0;
+		log_msg("\n CFS: Storage: %s predates reference counts, its blocks are never deleted\n", storage->blocks_path);
+	}
 
 	return 1;
 }
 
+/*
+	Whether *st* is the blocks directory, which is kept out of the
+	exported tree.
+*/
+int is_block_store(const cfs_blk_store_t* storage, const struct stat* st) {
+	return S_ISDIR(st->st_mode) && st->st_dev == storage->dev && st->st_ino == storage->ino;
+}
+
 void destroy_storage(cfs_blk_store_t* storage) {
 	free(storage->blocks_path);
+	free(storage->staging_path);
+	free(storage->regions_path);
 	free(storage->root_path);
 }
@@ -2,22 +2,64 @@
 #define __CFS_STORAGE__
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 typedef struct {
     char* root_path;
     char* blocks_path;
+    char* staging_path; /* plain extents of files written in offline dedup mode */
+    char* regions_path; /* append regions blocks are placed in, one per write stream */
     size_t block_fname_size;
+    dev_t dev; /* of blocks_path, it is hidden wherever it shows up */
+    ino_t ino;
+    int counted; /* reference counts are exact, blocks are deleted when no longer used */
+    int direct; /* region slots are read and written with O_DIRECT, bypassing the page cache */
 } cfs_blk_store_t;
 
 
-#define BLOCKS_DIRECTORY ".BLOCKS"
+#define BLOCKS_DIRECTORY ".BLOCKS" /* under the root, unless placed elsewhere */
+#define STAGING_DIRECTORY "staging" /* inside the blocks directory */
+#define REGIONS_DIRECTORY "regions" /* inside the blocks directory */
+#define COUNTED_MARKER "counted" /* inside the blocks directory, see init_storage() */
 #define BLOCK_SIZE 4096
+#define REGION_NAME_LEN 16
 
-int init_storage(cfs_blk_store_t* storage, const char* root);
+/* Where a block placed in a region keeps its data */
+typedef struct {
+    char region[REGION_NAME_LEN];
+    off_t offset;
+    size_t size;
+} cfs_block_loc_t;
+
+/* Append region of one write stream, new blocks get consecutive BLOCK_SIZE slots */
+typedef struct {
+    int fd;
+    char name[REGION_NAME_LEN];
+    off_t end;
+    int direct; /* fd is in O_DIRECT mode, it only takes whole aligned slots */
+    pthread_mutex_t lock;
+} cfs_region_t;
+
+int init_storage(cfs_blk_store_t* storage, const char* root, const char* blocks);
+int is_block_store(const cfs_blk_store_t* storage, const struct stat* st);
 void destroy_storage(cfs_blk_store_t* storage);
 int store_block(const cfs_blk_store_t* storage, const unsigned char* data, const size_t size, unsigned char* hash);
+int store_block_in(const cfs_blk_store_t* storage, cfs_region_t* region, const unsigned char* data, const size_t size, unsigned char* hash);
+int block_locate(const cfs_blk_store_t* storage, const unsigned char* hash, cfs_block_loc_t* loc);
+ssize_t load_region_range(const cfs_blk_store_t* storage, const cfs_block_loc_t* loc, unsigned char* data, const off_t offset, const size_t len);
+int open_block_data(const cfs_blk_store_t* storage, const unsigned char* hash, const cfs_block_loc_t* loc, off_t* pos);
 int load_block(const cfs_blk_store_t* storage, const unsigned char* hash, unsigned char* data, size_t* size, size_t* refs);
+ssize_t load_block_range(const cfs_blk_store_t* storage, const unsigned char* hash, unsigned char* data, const off_t offset, const size_t len);
+int block_exists( const cfs_blk_store_t* storage, const unsigned char* hash);
 ssize_t block_get_size( const cfs_blk_store_t* storage, const unsigned char* hash);
 int block_inc_ref( const cfs_blk_store_t* storage, const unsigned char* hash);
+int block_add_ref( const cfs_blk_store_t* storage, const unsigned char* hash, const size_t n);
 int block_dec_ref( const cfs_blk_store_t* storage, const unsigned char* hash);
+int block_sub_ref( const cfs_blk_store_t* storage, const unsigned char* hash, const size_t n);
+int open_staging(const cfs_blk_store_t* storage, const ino_t ino, const int flags);
+int remove_staging(const cfs_blk_store_t* storage, const ino_t ino);
+int open_region(const cfs_blk_store_t* storage, cfs_region_t* region);
+void close_region(const cfs_blk_store_t* storage, cfs_region_t* region);
+int sync_storage(const cfs_blk_store_t* storage);
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+import os
+import os.path
+import sys
+import subprocess
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, read_all, finish
+
+BLOCKS = 150
+TESTS = 20
+CFSCLONE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "cfs", "src", "cfsclone")
+
+def main():
+    mount = sys.argv[1]
+
+    src_file = test_path(mount)
+    dst_file = test_path(mount)
+    clone_file = test_path(mount)
+    print("Files are : {} {} {}".format(src_file, dst_file, clone_file))
+
+    stuff = random_str(BLOCK_SIZE * BLOCKS + randint(0, BLOCK_SIZE-1))
+    with open(src_file, 'wb') as f:
+        f.write(stuff)
+
+    # ranges at block boundaries share blocks, the others are copied
+    ok = True
+    copy = bytearray()
+    with open(src_file, 'rb') as src, open(dst_file, 'w+b') as dst:
+        for i in range(TESTS):
+            off_in = randint(0, len(stuff) - 1)
+            off_out = randint(0, len(stuff))
+            if i % 2:
+                off_in -= off_in % BLOCK_SIZE
+                off_out -= off_out % BLOCK_SIZE
+            length = randint(1, len(stuff) - off_in)
+            done = 0
+            while done < length:
+                ret = os.copy_file_range(src.fileno(), dst.fileno(), length - done, off_in + done, off_out + done)
+                if ret == 0:
+                    break
+                done += ret
+            copy[len(copy):off_out] = b'\0' * (off_out - len(copy))
+            copy[off_out:off_out + done] = stuff[off_in:off_in + done]
+            if done != length:
+                print("Copied {} of {} bytes".format(done, length))
+                ok = False
+    if read_all(dst_file) != bytes(copy):
+        print("Copy differs")
+        ok = False
+
+    # a clone starts out equal, writing to it leaves the source alone
+    if subprocess.call([CFSCLONE, src_file, clone_file]) != 0:
+        print("cfsclone failed")
+        ok = False
+    if read_all(clone_file) != stuff:
+        print("Clone differs")
+        ok = False
+    with open(clone_file, 'r+b') as f:
+        f.seek(randint(0, len(stuff)))
+        f.write(random_str(BLOCK_SIZE))
+    if read_all(src_file) != stuff:
+        print("Source changed by a write to its clone")
+        ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
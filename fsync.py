@@ -0,0 +1,64 @@
+import os
+import sys
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, read_all, finish
+
+BLOCKS = 40
+TESTS = 10
+
+def stats(mount):
+    """The counters of the mount, by name"""
+    text = os.getxattr(mount, "user.cfs.stats").decode()
+    return dict((line.split()[0], int(line.split()[1])) for line in text.splitlines() if len(line.split()) == 2)
+
+def main():
+    mount = sys.argv[1]
+
+    test_file = test_path(mount)
+    print("File is : {}".format(test_file))
+
+    # what an fsync returned for reads back through a new handle
+    ok = True
+    stuff = bytearray()
+    for i in range(TESTS):
+        data = random_str(randint(1, BLOCK_SIZE * BLOCKS))
+        offset = randint(0, len(stuff))
+        with open(test_file, 'r+b' if stuff else 'wb', buffering=0) as f:
+            f.seek(offset)
+            f.write(data)
+            os.fsync(f.fileno())
+        stuff[offset:offset + len(data)] = data
+        if os.stat(test_file).st_size != len(stuff) or read_all(test_file) != bytes(stuff):
+            print("Write of {} at {} read back wrong after fsync".format(len(data), offset))
+            ok = False
+
+    # blocks written through a handle closed without fsync are synced by
+    # the fsync of a later one, each fsync syncs the store or is saved
+    data = random_str(BLOCK_SIZE * BLOCKS)
+    with open(test_file, 'ab', buffering=0) as f:
+        f.write(data)
+    stuff += data
+    with open(test_file, 'rb') as f:
+        before = stats(mount)
+        os.fsync(f.fileno())
+        after = stats(mount)
+        if after["store_syncs"] <= before["store_syncs"]:
+            print("Fsync after a reopen did not sync the store")
+            ok = False
+        os.fsync(f.fileno())
+        again = stats(mount)
+        if again["store_syncs"] + again["store_syncs_saved"] != after["store_syncs"] + after["store_syncs_saved"] + 1:
+            print("Fsync counted {} times".format(again["store_syncs"] + again["store_syncs_saved"] -
+                after["store_syncs"] - after["store_syncs_saved"]))
+            ok = False
+
+    if read_all(test_file) != bytes(stuff):
+        print("Contents differ")
+        ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
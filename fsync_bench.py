@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+import os
+import sys
+import threading
+from timeit import default_timer as timer
+
+from testutil import random_str, test_path
+
+WRITE_SIZE = 64 * 1024
+ROUNDS = 50
+WRITERS = [1, 8]
+
+
+def stats(mount):
+    text = os.getxattr(mount, "user.cfs.stats").decode()
+    return dict((line.split()[0], int(line.split()[1])) for line in text.splitlines() if len(line.split()) == 2)
+
+
+def writer(path, data, times):
+    with open(path, 'wb', buffering=0) as f:
+        for i in range(ROUNDS):
+            f.write(data[i])
+            t1 = timer()
+            os.fsync(f.fileno())
+            times.append(timer() - t1)
+
+
+def main():
+    if (len(sys.argv) != 2):
+        print("Usage {} <mount>.".format(sys.argv[0]))
+        sys.exit(1)
+    mount = sys.argv[1]
+
+    print('\n' + '*' * 80)
+    print("Each writer appends {}KiB {} times, each append followed by fsync.".format(WRITE_SIZE // 1024, ROUNDS))
+    print("Then the same file is fsynced {} times with nothing new to sync.".format(ROUNDS))
+    print('*' * 80 + '\n')
+
+    for n in WRITERS:
+        # new data every time, or the blocks would dedup to ones already synced
+        data = [[random_str(WRITE_SIZE) for i in range(ROUNDS)] for j in range(n)]
+        times = []
+        before = stats(mount)
+        threads = [threading.Thread(target=writer, args=(test_path(mount), data[j], times)) for j in range(n)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        after = stats(mount)
+        print("{} writer(s): {:.3f}ms per fsync, {} fsyncs needed {} store syncs".format(n,
+            sum(times) / len(times) * 1000, len(times), after["store_syncs"] - before["store_syncs"]))
+
+    path = test_path(mount)
+    with open(path, 'wb') as f:
+        f.write(random_str(WRITE_SIZE))
+        os.fsync(f.fileno())
+        t1 = timer()
+        for i in range(ROUNDS):
+            os.fsync(f.fileno())
+        print("Clean fsync: {:.3f}ms".format((timer() - t1) / ROUNDS * 1000))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+import os
+import sys
+import ctypes
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, finish
+
+BLOCKS = 150
+TESTS = 40
+
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+FALLOC_FL_ZERO_RANGE = 0x10
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.fallocate.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_longlong, ctypes.c_longlong]
+
+def fallocate(fd, mode, offset, length):
+    if libc.fallocate(fd, mode, offset, length) != 0:
+        err = ctypes.get_errno()
+        raise OSError(err, os.strerror(err))
+
+def main():
+    mount = sys.argv[1]
+
+    test_file = test_path(mount)
+    print("File is : {}".format(test_file))
+
+    stuff = bytearray(random_str(BLOCK_SIZE * BLOCKS + randint(0, BLOCK_SIZE-1)))
+    with open(test_file, 'wb') as f:
+        f.write(stuff)
+
+    # punched and zeroed ranges read as zeroes, whole blocks or not, the
+    # size only grows for a zero range past the end without KEEP_SIZE
+    ok = True
+    with open(test_file, 'r+b') as f:
+        for i in range(TESTS):
+            offset = randint(0, len(stuff) + BLOCK_SIZE)
+            length = randint(1, BLOCK_SIZE * (4 if i % 2 else 40))
+            if i % 3 == 0:
+                fallocate(f.fileno(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length)
+                end = min(offset + length, len(stuff))
+            elif i % 3 == 1:
+                fallocate(f.fileno(), FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length)
+                end = min(offset + length, len(stuff))
+            else:
+                fallocate(f.fileno(), FALLOC_FL_ZERO_RANGE, offset, length)
+                end = offset + length
+            if end > len(stuff):
+                stuff.extend(b'\0' * (end - len(stuff)))
+            if end > offset:
+                stuff[offset:end] = b'\0' * (end - offset)
+
+            # data written over a hole is back
+            if i % 5 == 0:
+                data = random_str(randint(1, BLOCK_SIZE * 2))
+                f.seek(offset)
+                f.write(data)
+                f.flush()
+                if offset > len(stuff):
+                    stuff.extend(b'\0' * (offset - len(stuff)))
+                stuff[offset:offset + len(data)] = data
+
+            f.seek(0)
+            maybe_stuff = f.read()
+            if os.fstat(f.fileno()).st_size != len(stuff) or maybe_stuff != bytes(stuff):
+                print("Mode {} at {} for {} read back wrong".format(i % 3, offset, length))
+                ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Runs the test scripts under run_test.sh once per set of mount options.
+# After each script the file system is remounted on the same root and
+# must read back the same files.
+root=$1
+mount=$2
+
+if [[ "$#" -lt 2 ]]; then
+    echo "Usage $0 <root> <mount> [python scipts]"
+    echo "BBFS=cfs/src/bbfs3 runs the low-level front end instead"
+    exit 1
+fi
+shift 2
+scripts=${@:-simple.py append.py truncate.py clone.py snapshot.py punch.py fsync.py tree.py}
+# lseek reaches the file system only with the low-level front end
+if [[ "$#" -eq 0 && "${BBFS:-cfs/src/bbfs}" == *bbfs3* ]]; then
+    scripts="$scripts seek.py"
+fi
+
+# the first run is the default configuration
+runs=(
+    ""
+    "dedup=offline"
+    "placement=stream"
+    "placement=stream,direct_store,block_cache=16"
+)
+
+# fusermount -u returns before the daemon has synced what it still holds,
+# wait for it to exit before the root is used again
+unmount() {
+    fusermount -u $mount
+    while pgrep -xf "${BBFS:-cfs/src/bbfs} .*$root $mount" > /dev/null; do
+        sleep 0.1
+    done
+}
+
+sums() {
+    (cd $mount && find . -type f | sort | xargs -r -d '\n' sha1sum)
+}
+
+failed=0
+for opts in "${runs[@]}"; do
+    for py in $scripts; do
+        name="$py ${opts:-(defaults)}"
+        out=$(./run_test.sh $root $mount $py "$opts" 2>&1)
+        if [[ $? -ne 0 ]] || grep -q "MEH" <<< "$out"; then
+            echo "FAIL $name"
+            echo "$out" | tail -20
+            failed=1
+            continue
+        fi
+
+        before=$(sums)
+        unmount
+        ${BBFS:-cfs/src/bbfs} ${opts:+-o $opts} $root $mount
+        if [[ "$(sums)" != "$before" ]]; then
+            echo "FAIL $name: changed across a remount"
+            failed=1
+            continue
+        fi
+        echo "ok   $name"
+    done
+done
+unmount
+
+exit $failed
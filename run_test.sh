@@ -2,15 +2,26 @@
 root=$1
 mount=$2
 py=$3
+opts=$4
 
-if [[ "$#" -ne 3 ]]; then
-    echo "Usage $0 <root> <mount> <python scipt>"
+if [[ "$#" -lt 3 || "$#" -gt 4 ]]; then
+    echo "Usage $0 <root> <mount> <python scipt> [mount options]"
+    echo "BBFS=cfs/src/bbfs3 runs the low-level front end instead"
     exit 1
 fi
 
-fusermount -u $mount
+# fusermount -u returns before the daemon has synced what it still holds,
+# wait for it to exit before the root is used again
+unmount() {
+    fusermount -u $mount
+    while pgrep -xf "${BBFS:-cfs/src/bbfs} .*$root $mount" > /dev/null; do
+        sleep 0.1
+    done
+}
+
+unmount
 rm -rf $root $mount
 mkdir $root $mount
 rm -f bbfs.log 
-cfs/src/bbfs $root $mount
+${BBFS:-cfs/src/bbfs} ${opts:+-o $opts} $root $mount
 python $py $mount
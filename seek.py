@@ -0,0 +1,63 @@
+import os
+import sys
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, finish
+
+BLOCKS = 150
+TESTS = 200
+
+def expected(blocks, size, offset, whence):
+    """Where SEEK_DATA or SEEK_HOLE from offset lands, None for ENXIO"""
+    if offset >= size:
+        return None
+    index = offset // BLOCK_SIZE
+    while index * BLOCK_SIZE < size and (index in blocks) != (whence == os.SEEK_DATA):
+        index += 1
+    if index * BLOCK_SIZE >= size:
+        return None if whence == os.SEEK_DATA else size
+    return max(offset, index * BLOCK_SIZE)
+
+# lseek reaches the file system only with the low-level front end:
+#     BBFS=cfs/src/bbfs3 ./run_test.sh <root> <mount> seek.py
+def main():
+    mount = sys.argv[1]
+
+    test_file = test_path(mount)
+    print("File is : {}".format(test_file))
+
+    # runs of blocks with holes between them, mid-block writes included
+    blocks = set()
+    size = 0
+    ok = True
+    with open(test_file, 'w+b') as f:
+        index = randint(0, 3)
+        while index < BLOCKS:
+            run = randint(1, 10)
+            offset = index * BLOCK_SIZE + randint(0, BLOCK_SIZE-1)
+            length = max(1, (index + run) * BLOCK_SIZE - offset - randint(0, BLOCK_SIZE-1))
+            f.seek(offset)
+            f.write(random_str(length))
+            blocks.update(range(offset // BLOCK_SIZE, (offset + length - 1) // BLOCK_SIZE + 1))
+            size = max(size, offset + length)
+            index += run + randint(1, 5)
+        f.flush()
+
+        # asked while written blocks may still be buffered
+        for i in range(TESTS):
+            offset = randint(0, size + BLOCK_SIZE)
+            whence = os.SEEK_DATA if i % 2 else os.SEEK_HOLE
+            try:
+                got = os.lseek(f.fileno(), offset, whence)
+            except OSError:
+                got = None
+            if got != expected(blocks, size, offset, whence):
+                print("{} from {} got {} want {}".format("SEEK_DATA" if i % 2 else "SEEK_HOLE", offset, got,
+                    expected(blocks, size, offset, whence)))
+                ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
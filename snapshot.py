@@ -0,0 +1,72 @@
+import os
+import os.path
+import sys
+import uuid
+import subprocess
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, read_all, finish
+
+BLOCKS = 50
+FILES = 10
+CFSSNAP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "cfs", "src", "cfssnap")
+
+def main():
+    mount = sys.argv[1]
+
+    test_dir = test_path(mount)
+    name = "snap" + uuid.uuid4().hex
+    snap_dir = os.path.join(mount, ".snapshots", name)
+    print("Directory is : {}, snapshot {}".format(test_dir, snap_dir))
+
+    # a small tree, some files in a subdirectory
+    os.makedirs(os.path.join(test_dir, "sub"))
+    stuffs = {}
+    for i in range(FILES):
+        rel = os.path.join("sub" if i % 2 else "", "file{}".format(i))
+        stuffs[rel] = random_str(randint(0, BLOCK_SIZE * BLOCKS))
+        with open(os.path.join(test_dir, rel), 'wb') as f:
+            f.write(stuffs[rel])
+
+    ok = True
+    if subprocess.call([CFSSNAP, test_dir, name]) != 0:
+        print("cfssnap failed")
+        ok = False
+
+    # the live tree changes, the snapshot keeps what it captured
+    lives = {}
+    for rel in stuffs:
+        offset = randint(0, len(stuffs[rel]))
+        data = random_str(BLOCK_SIZE)
+        with open(os.path.join(test_dir, rel), 'r+b') as f:
+            f.seek(offset)
+            f.write(data)
+        lives[rel] = stuffs[rel][:offset] + data + stuffs[rel][offset + len(data):]
+    os.unlink(os.path.join(test_dir, "file0"))
+    del lives["file0"]
+    for rel in stuffs:
+        if read_all(os.path.join(snap_dir, rel)) != stuffs[rel]:
+            print("Snapshot of {} differs".format(rel))
+            ok = False
+
+    # snapshots are read-only
+    try:
+        open(os.path.join(snap_dir, "file0"), 'r+b').close()
+        print("Snapshot file opened for writing")
+        ok = False
+    except OSError:
+        pass
+
+    if subprocess.call([CFSSNAP, "-d", test_dir, name]) != 0 or os.path.exists(snap_dir):
+        print("Snapshot not deleted")
+        ok = False
+    for rel in lives:
+        if read_all(os.path.join(test_dir, rel)) != lives[rel]:
+            print("Deleting the snapshot changed {}".format(rel))
+            ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,30 @@
+"""Helpers shared by the test scripts run under run_test.sh"""
+import os
+import os.path
+import sys
+import uuid
+import random
+import string
+
+BLOCK_SIZE = 4096
+
+def random_str(stringLength=10):
+    """Generate a random string of fixed length """
+    letters = string.ascii_lowercase
+    return ''.join(random.choice(letters) for i in range(stringLength)).encode()
+
+def test_path(mount):
+    """A new name under mount for a test file or directory"""
+    return os.path.join(mount, "test" + uuid.uuid4().hex)
+
+def read_all(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+def finish(ok):
+    """Report the result, a failed test exits with status 1"""
+    if ok:
+        print ("NICE! :)")
+    else:
+        print ("MEH! :(")
+        sys.exit(1)
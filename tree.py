@@ -0,0 +1,100 @@
+import os
+import sys
+from random import randint, choice
+
+from testutil import BLOCK_SIZE, random_str, test_path, read_all, finish
+
+DIRS = 4
+FILES = 25
+ROUNDS = 6
+
+def forget_all():
+    """Have the kernel forget every inode it doesn't use, only works as root"""
+    try:
+        with open("/proc/sys/vm/drop_caches", 'w') as f:
+            f.write("2")
+    except OSError:
+        pass
+
+def check(top, files, when):
+    """Sizes as listed, as stat'ed by name and the contents of a few files"""
+    ok = True
+    listed = {}
+    for d in os.scandir(top):
+        for e in os.scandir(d.path):
+            listed[os.path.join(d.name, e.name)] = e.stat(follow_symlinks=False).st_size
+    if listed != dict((rel, len(files[rel])) for rel in files):
+        print("{}: listing differs".format(when))
+        ok = False
+    for rel in files:
+        if os.stat(os.path.join(top, rel)).st_size != len(files[rel]):
+            print("{}: size of {} differs".format(when, rel))
+            ok = False
+    for i in range(FILES):
+        rel = choice(list(files))
+        if read_all(os.path.join(top, rel)) != files[rel]:
+            print("{}: {} differs".format(when, rel))
+            ok = False
+    return ok
+
+# inodes looked up by name and by listing, forgotten and looked up again:
+#     BBFS=cfs/src/bbfs3 ./run_test.sh <root> <mount> tree.py
+def main():
+    mount = sys.argv[1]
+
+    top = test_path(mount)
+    print("Directory is : {}".format(top))
+
+    os.mkdir(top)
+    files = {}
+    for i in range(DIRS):
+        os.mkdir(os.path.join(top, "dir{}".format(i)))
+        for j in range(FILES):
+            rel = os.path.join("dir{}".format(i), "file{}".format(j))
+            files[rel] = random_str(randint(0, BLOCK_SIZE * 4))
+            with open(os.path.join(top, rel), 'wb') as f:
+                f.write(files[rel])
+
+    # every round renames, links, rewrites and unlinks through names the
+    # kernel may or may not still hold
+    ok = check(top, files, "Created")
+    shared = set() # names of files linked twice, only those two see a write
+    for r in range(ROUNDS):
+        if r % 2:
+            forget_all()
+        rel = choice(list(files))
+        moved = os.path.join("dir{}".format(randint(0, DIRS - 1)), "moved{}".format(r))
+        os.rename(os.path.join(top, rel), os.path.join(top, moved))
+        files[moved] = files.pop(rel)
+        if rel in shared:
+            shared.remove(rel)
+            shared.add(moved)
+
+        rel = choice([rel for rel in files if rel not in shared])
+        linked = os.path.join("dir{}".format(randint(0, DIRS - 1)), "linked{}".format(r))
+        os.link(os.path.join(top, rel), os.path.join(top, linked))
+        files[rel] = random_str(randint(1, BLOCK_SIZE * 4))
+        with open(os.path.join(top, linked), 'wb') as f:
+            f.write(files[rel])
+        files[linked] = files[rel]
+        shared.update((rel, linked))
+
+        rel = choice(list(files))
+        os.unlink(os.path.join(top, rel))
+        del files[rel]
+        shared.discard(rel)
+        # a link of the unlinked file is still there
+        ok = check(top, files, "Round {}".format(r)) and ok
+
+    forget_all()
+    ok = check(top, files, "Forgotten") and ok
+    for rel in files:
+        if read_all(os.path.join(top, rel)) != files[rel]:
+            print("{} differs".format(rel))
+            ok = False
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,52 @@
+import os
+import sys
+from random import randint
+
+from testutil import BLOCK_SIZE, random_str, test_path, finish
+
+BLOCKS = 150
+TESTS = 20
+
+def main():
+    mount = sys.argv[1]
+
+    test_file = test_path(mount)
+    print("File is : {}".format(test_file))
+
+    stuff = random_str(BLOCK_SIZE * BLOCKS + randint(0, BLOCK_SIZE-1))
+    print("Buffer len: {}".format(len(stuff)))
+
+    with open(test_file, 'wb') as f:
+        f.write(stuff)
+
+    # shrink and grow, by path and through an open file, mid-block too
+    ok = True
+    for i in range(TESTS):
+        size = randint(0, BLOCK_SIZE * BLOCKS * 2)
+        if i % 2:
+            os.truncate(test_file, size)
+        else:
+            with open(test_file, 'r+b') as f:
+                f.truncate(size)
+        stuff = stuff[:size] + b'\0' * (size - len(stuff))
+
+        with open(test_file, 'rb') as f:
+            maybe_stuff = f.read()
+        if os.stat(test_file).st_size != size or maybe_stuff != stuff:
+            print("Truncate to {} read back {} bytes".format(size, len(maybe_stuff)))
+            ok = False
+
+        # a write into the tail of the last block must not bring old data back
+        with open(test_file, 'r+b') as f:
+            f.seek(size)
+            f.write(b'x')
+        stuff += b'x'
+
+    with open(test_file, 'rb') as f:
+        ok = ok and f.read() == stuff
+
+    finish(ok)
+
+
+if __name__ == "__main__":
+    main()